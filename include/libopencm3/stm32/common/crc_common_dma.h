@@ -0,0 +1,92 @@
+/** @addtogroup crc_defines
+
+*/
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* THIS FILE SHOULD NOT BE INCLUDED DIRECTLY, BUT ONLY VIA CRC.H
+The order of header inclusion is important. crc.h includes the device
+specific memorymap.h header before including this header file.*/
+
+/** @cond */
+#ifdef LIBOPENCM3_CRC_H
+/** @endcond */
+#pragma once
+
+/**@{*/
+
+/* --- Streaming calculation ----------------------------------------------- */
+
+struct crc_stream;
+
+/** Called when an update has finished, @p error on a DMA error. */
+typedef void (*crc_stream_callback)(struct crc_stream *cs, bool error);
+
+/** One CRC calculation over a byte stream fed in pieces. Several streams,
+ * each with its own parameters, may be interleaved on the one CRC unit.
+ */
+struct crc_stream {
+	/** Polynomial, e.g. @ref CRC_POL_DEFAULT. */
+	uint32_t polynomial;
+	/** Polynomial size @ref crc_polysize. */
+	uint32_t polysize;
+	uint32_t initial;
+	/** XORed into the value returned by @ref crc_stream_result. */
+	uint32_t final_xor;
+	/** Process each byte least significant bit first. */
+	bool reflect_in;
+	/** Bit reverse the result. */
+	bool reflect_out;
+	/** DMA controller and stream (f7) or channel for memory to memory
+	 * transfers. Only DMA2 can do these on f7.
+	 */
+	uint32_t dma;
+	uint8_t stream;
+	/** Updates of at least this many bytes use the DMA, 0 for never. */
+	uint32_t dma_threshold;
+	crc_stream_callback callback;
+	void *user;
+	/** Running remainder. It may be saved and restored later, with the
+	 * same parameters, to resume the calculation.
+	 */
+	uint32_t state;
+	/* Private to the driver. */
+	const uint8_t *data;
+	uint32_t left;
+	bool wide;
+	volatile bool busy;
+};
+
+/* --- Function prototypes ------------------------------------------------- */
+
+BEGIN_DECLS
+
+void crc_stream_begin(struct crc_stream *cs);
+int crc_stream_update(struct crc_stream *cs, const void *data, uint32_t len);
+bool crc_stream_busy(const struct crc_stream *cs);
+uint32_t crc_stream_result(const struct crc_stream *cs);
+void crc_stream_isr(struct crc_stream *cs);
+
+END_DECLS
+
+/**@}*/
+
+/** @cond */
+#else
+#warning "crc_common_dma.h should not be included explicitly, only via crc.h"
+#endif
+/** @endcond */
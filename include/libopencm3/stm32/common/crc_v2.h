@@ -32,6 +32,7 @@
 /**@{*/
 
 #include <libopencm3/stm32/common/crc_common_all.h>
+#include <libopencm3/stm32/common/crc_common_dma.h>
 
 /*****************************************************************************/
 /* Module definitions                                                        */
@@ -561,6 +561,78 @@ being at the same relative location */
 
 /* [31:8]: Reserved */
 
+/* --- Descriptor based transfers ----------------------------------------- */
+
+/** Number of streams on each DMA controller. */
+#define DMA_STREAM_COUNT		8
+
+/** Completion callback for @ref dma_transfer_submit.
+ *
+ * Called from @ref dma_transfer_isr with the stream's interrupt flags
+ * (@ref dma_if_offset, already cleared) that caused the interrupt.
+ */
+typedef void (*dma_transfer_callback)(uint32_t dma, uint8_t stream,
+				      uint32_t flags, void *user);
+
+/** A complete stream configuration, programmed by @ref dma_transfer_submit.
+ *
+ * @c src and @c dst are routed to the peripheral and memory address
+ * registers according to the direction held in @c cr; for memory to memory
+ * transfers @c src is the peripheral port as the hardware requires.
+ */
+struct dma_transfer {
+	uint32_t src;
+	uint32_t dst;
+	/** Second memory buffer, only used with @ref DMA_SxCR_DBM. */
+	uint32_t mem1;
+	/** Number of peripheral sized items to move. */
+	uint16_t count;
+	/** OR of DMA_SxCR_CHSEL(), DIR, PSIZE, MSIZE, PBURST, MBURST, PL,
+	 * MINC, PINC, CIRC, DBM, PFCTRL and HTIE. EN and the remaining
+	 * interrupt enables are managed by the submit call.
+	 */
+	uint32_t cr;
+	/** 0 for direct mode, or DMA_SxFCR_DMDIS | DMA_SxFCR_FTH_x. */
+	uint32_t fcr;
+	dma_transfer_callback callback;
+	void *user;
+};
+
+/** One stream/channel pairing that can serve a peripheral request. */
+struct dma_stream_option {
+	uint32_t dma;
+	uint8_t stream;
+	uint8_t channel;
+};
+
+/** One segment of a scatter-gather chain: a memory block and its length. */
+struct dma_sg_segment {
+	uint32_t mem;
+	uint16_t count;
+	const struct dma_sg_segment *next;
+};
+
+struct dma_sg;
+
+/** Called for every segment that completes, and once on a transfer error.
+ * @p seg is the segment that finished; the chain is done when its @c next is
+ * NULL or @p flags holds an error.
+ */
+typedef void (*dma_sg_callback)(struct dma_sg *sg,
+				const struct dma_sg_segment *seg,
+				uint32_t flags);
+
+/** Scatter-gather state, owned by the caller for the life of the chain. */
+struct dma_sg {
+	dma_sg_callback callback;
+	void *user;
+	/* Private to the driver. */
+	const struct dma_sg_segment *current;
+	const struct dma_sg_segment *loaded;
+	uint32_t dma;
+	uint8_t stream;
+};
+
 /* --- Function prototypes ------------------------------------------------- */
 
 BEGIN_DECLS
@@ -615,6 +687,19 @@ void dma_set_memory_address(uint32_t dma, uint8_t stream, uint32_t address);
 void dma_set_memory_address_1(uint32_t dma, uint8_t stream, uint32_t address);
 uint16_t dma_get_number_of_data(uint32_t dma, uint8_t stream);
 void dma_set_number_of_data(uint32_t dma, uint8_t stream, uint16_t number);
+int dma_transfer_submit(uint32_t dma, uint8_t stream,
+			const struct dma_transfer *xfer);
+int dma_transfer_abort(uint32_t dma, uint8_t stream);
+void dma_transfer_isr(uint32_t dma, uint8_t stream);
+bool dma_stream_claim(uint32_t dma, uint8_t stream);
+int dma_stream_claim_any(const struct dma_stream_option *options, int count);
+void dma_stream_release(uint32_t dma, uint8_t stream);
+bool dma_stream_is_free(uint32_t dma, uint8_t stream);
+int dma_sg_start(struct dma_sg *sg, uint32_t dma, uint8_t stream,
+		 const struct dma_transfer *xfer,
+		 const struct dma_sg_segment *list);
+void dma_sg_stop(struct dma_sg *sg);
+bool dma_sg_busy(const struct dma_sg *sg);
 
 END_DECLS
 /**@}*/
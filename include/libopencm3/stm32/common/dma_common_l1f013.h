@@ -379,6 +379,35 @@ group.
 #define DMA_CHANNEL7			7
 /**@}*/
 
+/* --- Scatter-gather chains ---------------------------------------------- */
+
+/** One segment of a scatter-gather chain: a memory block and its length. */
+struct dma_sg_segment {
+	uint32_t mem;
+	uint16_t count;
+	const struct dma_sg_segment *next;
+};
+
+struct dma_sg;
+
+/** Called for every segment that completes, and once on a transfer error.
+ * @p seg is the segment that finished; the chain is done when its @c next is
+ * NULL or @p flags holds an error.
+ */
+typedef void (*dma_sg_callback)(struct dma_sg *sg,
+				const struct dma_sg_segment *seg,
+				uint32_t flags);
+
+/** Scatter-gather state, owned by the caller for the life of the chain. */
+struct dma_sg {
+	dma_sg_callback callback;
+	void *user;
+	/* Private to the driver. */
+	const struct dma_sg_segment *current;
+	uint32_t dma;
+	uint8_t channel;
+};
+
 /* --- function prototypes ------------------------------------------------- */
 
 BEGIN_DECLS
@@ -412,6 +441,11 @@ void dma_set_peripheral_address(uint32_t dma, uint8_t channel,
 void dma_set_memory_address(uint32_t dma, uint8_t channel, uint32_t address);
 uint16_t dma_get_number_of_data(uint32_t dma, uint8_t channel);
 void dma_set_number_of_data(uint32_t dma, uint8_t channel, uint16_t number);
+int dma_sg_start(struct dma_sg *sg, uint32_t dma, uint8_t channel,
+		 const struct dma_sg_segment *list);
+void dma_sg_isr(struct dma_sg *sg);
+void dma_sg_stop(struct dma_sg *sg);
+bool dma_sg_busy(const struct dma_sg *sg);
 
 END_DECLS
 
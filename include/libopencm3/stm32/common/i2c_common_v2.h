@@ -400,6 +400,62 @@ enum i2c_speeds {
 	i2c_speed_unknown
 };
 
+/* --- Asynchronous transactions ------------------------------------------- */
+
+/** Outcome of an asynchronous transaction. */
+enum i2c_async_status {
+	I2C_ASYNC_OK = 0,
+	/** The address or a data byte was not acknowledged. */
+	I2C_ASYNC_NACK,
+	/** Another master won arbitration. */
+	I2C_ASYNC_ARLO,
+	/** Misplaced start/stop or overrun. */
+	I2C_ASYNC_BUS_ERROR,
+	/** The transaction did not finish in time; the bus was recovered. */
+	I2C_ASYNC_TIMEOUT,
+};
+
+struct i2c_async_xfer;
+
+typedef void (*i2c_async_callback)(struct i2c_async_xfer *xfer,
+				   enum i2c_async_status status);
+
+/** One transaction: write @c w, then, after a repeated start, read @c r.
+ * Either part may be empty. Owned by the caller until its callback runs.
+ */
+struct i2c_async_xfer {
+	uint8_t addr;
+	const uint8_t *w;
+	uint16_t wn;
+	uint8_t *r;
+	uint16_t rn;
+	i2c_async_callback callback;
+	void *user;
+	/* Private to the driver. */
+	struct i2c_async_xfer *next;
+};
+
+/** A queue of transactions on one I2C master. */
+struct i2c_async {
+	uint32_t i2c;
+	/** Time allowed per transaction, in the units of i2c_async_tick(). */
+	uint16_t timeout;
+	/** SCL and SDA pins, used to clock a stuck slave free. Leave
+	 * @c gpio_port 0 to only reset the peripheral.
+	 */
+	uint32_t gpio_port;
+	uint16_t scl_pin;
+	uint16_t sda_pin;
+	/* Private to the driver. */
+	struct i2c_async_xfer *head;
+	struct i2c_async_xfer *tail;
+	uint16_t pos;
+	uint16_t left;
+	uint16_t elapsed;
+	bool reading;
+	enum i2c_async_status status;
+};
+
 BEGIN_DECLS
 
 void i2c_peripheral_enable(uint32_t i2c);
@@ -445,6 +501,12 @@ void i2c_enable_txdma(uint32_t i2c);
 void i2c_disable_txdma(uint32_t i2c);
 void i2c_transfer7(uint32_t i2c, uint8_t addr, const uint8_t *w, size_t wn, uint8_t *r, size_t rn);
 void i2c_set_speed(uint32_t i2c, enum i2c_speeds speed, uint32_t clock_megahz);
+void i2c_async_init(struct i2c_async *bus);
+int i2c_async_submit(struct i2c_async *bus, struct i2c_async_xfer *xfer);
+bool i2c_async_busy(const struct i2c_async *bus);
+void i2c_async_isr(struct i2c_async *bus);
+void i2c_async_tick(struct i2c_async *bus, uint16_t elapsed);
+void i2c_bus_recover(struct i2c_async *bus);
 
 END_DECLS
 
@@ -0,0 +1,77 @@
+/** @addtogroup spi_defines
+
+*/
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* THIS FILE SHOULD NOT BE INCLUDED DIRECTLY, BUT ONLY VIA SPI.H
+The order of header inclusion is important. spi.h includes the device
+specific memorymap.h header before including this header file.*/
+
+/** @cond */
+#ifdef LIBOPENCM3_SPI_H
+/** @endcond */
+#pragma once
+
+/**@{*/
+
+/* --- DMA bulk transfers -------------------------------------------------- */
+
+struct spi_dma;
+
+/** Called when a bulk transfer has finished, @p error on a DMA error. */
+typedef void (*spi_dma_callback)(struct spi_dma *sd, bool error);
+
+/** A SPI master with a pair of DMA streams/channels for bulk transfers. */
+struct spi_dma {
+	uint32_t spi;
+	uint32_t dma;
+	/** DMA streams (f2/f4/f7) or channel numbers. */
+	uint8_t rx_stream;
+	uint8_t tx_stream;
+	/** Request channels on stream controllers. Other parts must have the
+	 * requests routed (CSELR/DMAMUX) beforehand.
+	 */
+	uint8_t rx_channel;
+	uint8_t tx_channel;
+	/** Transfers shorter than this many frames are done by the CPU. */
+	uint16_t cpu_threshold;
+	spi_dma_callback callback;
+	void *user;
+	/* Private to the driver. */
+	volatile bool busy;
+	uint16_t dummy;
+};
+
+/* --- Function prototypes ------------------------------------------------- */
+
+BEGIN_DECLS
+
+int spi_transfer_dma(struct spi_dma *sd, const void *tx, void *rx,
+		     uint16_t frames);
+bool spi_dma_busy(const struct spi_dma *sd);
+void spi_dma_isr(struct spi_dma *sd);
+
+END_DECLS
+
+/**@}*/
+
+/** @cond */
+#else
+#warning "spi_common_dma.h should not be included explicitly, only via spi.h"
+#endif
+/** @endcond */
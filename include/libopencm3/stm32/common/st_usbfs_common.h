@@ -255,6 +255,8 @@ LGPL License Terms @ref lgpl_license
 
 #define USB_SET_EP_STAT_OUT(EP)	USB_SET_EP_KIND(EP)
 #define USB_CLR_EP_STAT_OUT(EP)	USB_CLR_EP_KIND(EP)
+#define USB_SET_EP_DBL_BUF(EP)	USB_SET_EP_KIND(EP)
+#define USB_CLR_EP_DBL_BUF(EP)	USB_CLR_EP_KIND(EP)
 
 #define USB_SET_EP_ADDR(EP, ADDR) \
 	SET_REG(USB_EP_REG(EP), \
@@ -273,6 +275,27 @@ LGPL License Terms @ref lgpl_license
 		GET_REG(USB_EP_REG(EP)) & \
 		(USB_EP_NTOGGLE_MSK | USB_EP_RX_DTOG))
 
+/* Macros for toggling DTOG bits */
+#define USB_TOG_EP_TX_DTOG(EP) \
+	SET_REG(USB_EP_REG(EP), \
+		(GET_REG(USB_EP_REG(EP)) & USB_EP_NTOGGLE_MSK) | \
+		USB_EP_RX_CTR | USB_EP_TX_CTR | USB_EP_TX_DTOG)
+
+#define USB_TOG_EP_RX_DTOG(EP) \
+	SET_REG(USB_EP_REG(EP), \
+		(GET_REG(USB_EP_REG(EP)) & USB_EP_NTOGGLE_MSK) | \
+		USB_EP_RX_CTR | USB_EP_TX_CTR | USB_EP_RX_DTOG)
+
+/*
+ * Double-buffered endpoints use the DTOG bit of the unused direction as the
+ * SW_BUF flag, which selects the buffer owned by the application.
+ */
+#define USB_EP_TX_SW_BUF		USB_EP_RX_DTOG
+#define USB_EP_RX_SW_BUF		USB_EP_TX_DTOG
+
+#define USB_TOG_EP_TX_SW_BUF(EP)	USB_TOG_EP_RX_DTOG(EP)
+#define USB_TOG_EP_RX_SW_BUF(EP)	USB_TOG_EP_TX_DTOG(EP)
+
 
 /* --- USB BTABLE registers ------------------------------------------------ */
 
@@ -94,6 +94,44 @@ specific memorymap.h header before including this header file.*/
 /**@}*/
 #define USART_FLOWCONTROL_MASK	        (USART_CR3_RTSE | USART_CR3_CTSE)
 
+/* --- Transmit queue ------------------------------------------------------ */
+
+/** Number of buffers a transmit queue holds, a power of two. */
+#define USART_TX_QUEUE_SIZE		8
+
+struct usart_tx;
+
+/** Called once a queued buffer has been fully handed to the USART and may be
+ * reused.
+ */
+typedef void (*usart_tx_callback)(struct usart_tx *tx, const uint8_t *data,
+				  uint16_t len);
+
+/** Non-blocking transmit queue, fed by DMA or, on parts without a DMA
+ * driver, by TX FIFO threshold interrupts.
+ */
+struct usart_tx {
+	uint32_t usart;
+	/** DMA controller and stream (f2/f4/f7) or channel number. */
+	uint32_t dma;
+	uint8_t stream;
+	/** Request channel on stream controllers. Other parts must have the
+	 * request routed (CSELR/DMAMUX) beforehand.
+	 */
+	uint8_t dma_channel;
+	usart_tx_callback callback;
+	void *user;
+	/* Private to the driver. */
+	struct {
+		const uint8_t *data;
+		uint16_t len;
+	} queue[USART_TX_QUEUE_SIZE];
+	volatile uint8_t head;
+	volatile uint8_t tail;
+	volatile bool active;
+	uint16_t pos;
+};
+
 /* --- Function prototypes ------------------------------------------------- */
 
 BEGIN_DECLS
@@ -130,6 +168,10 @@ void usart_disable_idle_interrupt(uint32_t usart);
 void usart_enable_error_interrupt(uint32_t usart);
 void usart_disable_error_interrupt(uint32_t usart);
 bool usart_get_flag(uint32_t usart, uint32_t flag);
+void usart_tx_init(struct usart_tx *tx);
+int usart_tx_submit(struct usart_tx *tx, const uint8_t *data, uint16_t len);
+bool usart_tx_busy(const struct usart_tx *tx);
+void usart_tx_isr(struct usart_tx *tx);
 
 END_DECLS
 
@@ -0,0 +1,77 @@
+/** @addtogroup usart_defines
+ */
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**@{*/
+
+/* THIS FILE SHOULD NOT BE INCLUDED DIRECTLY, BUT ONLY VIA USART.H
+The order of header inclusion is important. usart.h includes the device
+specific memorymap.h header before including this header file.*/
+
+/** @cond */
+#if defined(LIBOPENCM3_USART_H)
+/** @endcond */
+#ifndef LIBOPENCM3_USART_COMMON_DMA_H
+#define LIBOPENCM3_USART_COMMON_DMA_H
+
+/* --- DMA receive engine -------------------------------------------------- */
+
+struct usart_rx;
+
+/** Receives data as it arrives.
+ * @p idle is set on the last chunk before the line went idle, i.e. at the end
+ * of a frame. @p data points into the ring and is only valid in the callback.
+ */
+typedef void (*usart_rx_callback)(struct usart_rx *rx, const uint8_t *data,
+				  uint16_t len, bool idle);
+
+/** Circular DMA receiver, owned by the caller while running. */
+struct usart_rx {
+	uint32_t usart;
+	uint32_t dma;
+	/** DMA stream (f2/f4/f7) or channel number. */
+	uint8_t stream;
+	/** Request channel on stream controllers. Other parts must have the
+	 * request routed (CSELR/DMAMUX) beforehand.
+	 */
+	uint8_t dma_channel;
+	uint8_t *buffer;
+	uint16_t size;
+	usart_rx_callback callback;
+	void *user;
+	/* Private to the driver. */
+	uint16_t tail;
+};
+
+/* --- Function prototypes ------------------------------------------------- */
+
+BEGIN_DECLS
+
+int usart_rx_start(struct usart_rx *rx);
+void usart_rx_stop(struct usart_rx *rx);
+void usart_rx_isr(struct usart_rx *rx);
+
+END_DECLS
+
+#endif
+/** @cond */
+#else
+#warning "usart_common_dma.h should not be included directly, only via usart.h"
+#endif
+/** @endcond */
+/**@}*/
@@ -36,6 +36,7 @@ specific memorymap.h header before including this header file.*/
 #define LIBOPENCM3_USART_COMMON_F124_H
 
 #include <libopencm3/stm32/common/usart_common_all.h>
+#include <libopencm3/stm32/common/usart_common_dma.h>
 
 
 /** @defgroup usart_reg_base USART register base addresses
@@ -189,11 +189,48 @@ LGPL License Terms @ref lgpl_license
 #define ADC_CCR_ADCPRE_SHIFT		16
 
 
+/* --- Continuous capture -------------------------------------------------- */
+
+struct adc_capture;
+
+/** Receives each finished half of the capture buffer.
+ * @p block holds @p samples results, whole scan sequences in sequence order.
+ * It stays valid until the DMA wraps round to it again.
+ */
+typedef void (*adc_capture_callback)(struct adc_capture *cap,
+				     const uint16_t *block, uint16_t samples);
+
+/** Timer triggered, DMA driven scan of a regular sequence into a ring. */
+struct adc_capture {
+	uint32_t adc;
+	const uint8_t *channels;
+	uint8_t length;
+	/** Trigger timer. Its time base is set up by the caller; the capture
+	 * routes its update event to TRGO and starts/stops the counter.
+	 */
+	uint32_t timer;
+	/** Matching ADC_CR2_EXTSEL_TIMx_TRGO value. */
+	uint32_t trigger;
+	uint32_t dma;
+	uint8_t stream;
+	uint8_t dma_channel;
+	/** Ring buffer, @c samples long. A multiple of 2 * @c length. */
+	uint16_t *buffer;
+	uint16_t samples;
+	adc_capture_callback callback;
+	void *user;
+	/** Number of times an overrun forced a restart. */
+	uint32_t overruns;
+};
+
 BEGIN_DECLS
 
 void adc_set_multi_mode(uint32_t mode);
 void adc_enable_vbat_sensor(void);
 void adc_disable_vbat_sensor(void);
+int adc_capture_start(struct adc_capture *cap);
+void adc_capture_stop(struct adc_capture *cap);
+int adc_capture_recover(struct adc_capture *cap);
 
 END_DECLS
 
@@ -41,6 +41,7 @@ LGPL License Terms @ref lgpl_license
 #define LIBOPENCM3_USB_AUDIO_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 /*
  * Definitions from the USB_AUDIO_ or usb_audio_ namespace come from:
@@ -229,6 +230,27 @@ struct usb_audio_format_type1_descriptor_1freq {
 	struct usb_audio_format_discrete_sampling_frequency freqs[1];
 } __attribute__((packed));
 
+/*
+ * Explicit feedback for asynchronous isochronous streams (USB 2.0, 5.12.4.2).
+ * The device reports its actual sample rate in samples per (micro)frame, as
+ * a 10.14 fixed point number in 3 bytes at full speed or a 16.16 number in
+ * 4 bytes at high speed. The rate is measured by counting the samples the
+ * audio clock consumed over 2^period_log2 (micro)frames.
+ */
+struct usb_audio_feedback {
+	uint32_t value;
+	uint32_t samples;
+	uint16_t frames;
+	uint8_t period_log2;
+	bool high_speed;
+};
+
+void usb_audio_feedback_init(struct usb_audio_feedback *fb, uint32_t rate_hz,
+			     uint8_t period_log2, bool high_speed);
+void usb_audio_feedback_sof(struct usb_audio_feedback *fb, uint32_t samples);
+uint8_t usb_audio_feedback_pack(const struct usb_audio_feedback *fb,
+				uint8_t *buf);
+
 #endif
 
 /**@}*/
@@ -39,6 +39,8 @@ LGPL License Terms @ref lgpl_license
 #define __CDC_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <libopencm3/usb/usbd.h>
 
 /* Definitions of Communications Device Class from
  * "Universal Serial Bus Class Definitions for Communications Devices
@@ -52,6 +54,8 @@ LGPL License Terms @ref lgpl_license
 #define USB_CDC_SUBCLASS_DLCM		0x01
 #define USB_CDC_SUBCLASS_ACM		0x02
 /* ... */
+#define USB_CDC_SUBCLASS_NCM		0x0d
+/* ... */
 
 /* Table 5 Communications Interface Class Control Protocol Codes */
 #define USB_CDC_PROTOCOL_NONE		0x00
@@ -61,6 +65,9 @@ LGPL License Terms @ref lgpl_license
 /* Table 6: Data Interface Class Code */
 #define USB_CLASS_DATA			0x0A
 
+/* Table 7: Data Interface Class Protocol Codes */
+#define USB_CDC_PROTOCOL_NTB		0x01
+
 /* Table 12: Type Values for the bDescriptorType Field */
 #define CS_INTERFACE			0x24
 #define CS_ENDPOINT			0x25
@@ -73,6 +80,9 @@ LGPL License Terms @ref lgpl_license
 /* ... */
 #define USB_CDC_TYPE_UNION		0x06
 /* ... */
+#define USB_CDC_TYPE_ETHERNET		0x0F
+/* ... */
+#define USB_CDC_TYPE_NCM		0x1A
 
 /* Table 15: Class-Specific Descriptor Header Format */
 struct usb_cdc_header_descriptor {
@@ -158,6 +168,133 @@ struct usb_cdc_notification {
 	uint16_t wLength;
 } __attribute__((packed));
 
+/* Table 31: UART State Bitmap Values */
+#define USB_CDC_SERIAL_STATE_DCD		(1 << 0)
+#define USB_CDC_SERIAL_STATE_DSR		(1 << 1)
+#define USB_CDC_SERIAL_STATE_BREAK		(1 << 2)
+#define USB_CDC_SERIAL_STATE_RING		(1 << 3)
+#define USB_CDC_SERIAL_STATE_FRAMING		(1 << 4)
+#define USB_CDC_SERIAL_STATE_PARITY		(1 << 5)
+#define USB_CDC_SERIAL_STATE_OVERRUN		(1 << 6)
+
+/* Table 18: Control Signal Bitmap Values for SetControlLineState */
+#define USB_CDC_CONTROL_LINE_DTR		(1 << 0)
+#define USB_CDC_CONTROL_LINE_RTS		(1 << 1)
+
+/* Largest bulk packet handled by the CDC-ACM function */
+#define USB_CDCACM_MAX_PACKET			64
+
+/* Definitions for Network Control Model devices from:
+ * "Universal Serial Bus Communications Class Subclass Specifications for
+ * Ethernet Control Model Devices, Revision 1.2" (ECM) and
+ * "Universal Serial Bus Network Control Model Devices Specification,
+ * Revision 1.0" (NCM)
+ */
+
+/* ECM Table 3: Ethernet Networking Functional Descriptor */
+struct usb_cdc_ecm_descriptor {
+	uint8_t bFunctionLength;
+	uint8_t bDescriptorType;
+	uint8_t bDescriptorSubtype;
+	uint8_t iMACAddress;
+	uint32_t bmEthernetStatistics;
+	uint16_t wMaxSegmentSize;
+	uint16_t wNumberMCFilters;
+	uint8_t bNumberPowerFilters;
+} __attribute__((packed));
+
+/* NCM Table 5-2: NCM Functional Descriptor */
+struct usb_cdc_ncm_descriptor {
+	uint8_t bFunctionLength;
+	uint8_t bDescriptorType;
+	uint8_t bDescriptorSubtype;
+	uint16_t bcdNcmVersion;
+	uint8_t bmNetworkCapabilities;
+} __attribute__((packed));
+
+/* ECM Table 6 and NCM Table 6-2: Class-Specific Request Codes */
+#define USB_CDC_REQ_SET_ETHERNET_PACKET_FILTER	0x43
+#define USB_CDC_REQ_GET_NTB_PARAMETERS		0x80
+#define USB_CDC_REQ_GET_NTB_FORMAT		0x83
+#define USB_CDC_REQ_SET_NTB_FORMAT		0x84
+#define USB_CDC_REQ_GET_NTB_INPUT_SIZE		0x85
+#define USB_CDC_REQ_SET_NTB_INPUT_SIZE		0x86
+
+/* NCM Table 6-3: NTB Parameter Structure */
+struct usb_cdc_ncm_ntb_parameters {
+	uint16_t wLength;
+	uint16_t bmNtbFormatsSupported;
+	uint32_t dwNtbInMaxSize;
+	uint16_t wNdpInDivisor;
+	uint16_t wNdpInPayloadRemainder;
+	uint16_t wNdpInAlignment;
+	uint16_t wReserved;
+	uint32_t dwNtbOutMaxSize;
+	uint16_t wNdpOutDivisor;
+	uint16_t wNdpOutPayloadRemainder;
+	uint16_t wNdpOutAlignment;
+	uint16_t wNtbOutMaxDatagrams;
+} __attribute__((packed));
+
+/* ECM Table 11 and NCM Table 6-4: Class-Specific Notification Codes */
+#define USB_CDC_NOTIFY_NETWORK_CONNECTION	0x00
+#define USB_CDC_NOTIFY_SPEED_CHANGE		0x2A
+
+/* NCM Table 3-1: NTH16 */
+#define USB_CDC_NCM_NTH16_SIGNATURE		0x484D434E
+struct usb_cdc_ncm_nth16 {
+	uint32_t dwSignature;
+	uint16_t wHeaderLength;
+	uint16_t wSequence;
+	uint16_t wBlockLength;
+	uint16_t wNdpIndex;
+} __attribute__((packed));
+
+/* NCM Table 3-3: NDP16, followed by datagram index/length pairs */
+#define USB_CDC_NCM_NDP16_NOCRC_SIGNATURE	0x304D434E
+struct usb_cdc_ncm_ndp16 {
+	uint32_t dwSignature;
+	uint16_t wLength;
+	uint16_t wNextNdpIndex;
+} __attribute__((packed));
+
+typedef struct _usbd_cdcacm usbd_cdcacm;
+
+usbd_cdcacm *usb_cdcacm_init(usbd_device *usbd_dev, uint8_t comm_iface,
+			     uint8_t ep_in, uint8_t ep_out, uint8_t ep_notif,
+			     uint16_t max_packet,
+			     uint8_t *rx_buf, uint16_t rx_size,
+			     uint8_t *tx_buf, uint16_t tx_size);
+void usb_cdcacm_register_line_coding_callback(usbd_cdcacm *acm,
+	int (*callback)(usbd_cdcacm *acm,
+			const struct usb_cdc_line_coding *coding));
+void usb_cdcacm_register_line_state_callback(usbd_cdcacm *acm,
+	void (*callback)(usbd_cdcacm *acm, uint16_t state));
+const struct usb_cdc_line_coding *usb_cdcacm_line_coding(usbd_cdcacm *acm);
+uint16_t usb_cdcacm_line_state(usbd_cdcacm *acm);
+int usb_cdcacm_notify_serial_state(usbd_cdcacm *acm, uint16_t state);
+
+uint16_t usb_cdcacm_rx_span(usbd_cdcacm *acm, const uint8_t **data);
+void usb_cdcacm_rx_consume(usbd_cdcacm *acm, uint16_t len);
+uint16_t usb_cdcacm_read(usbd_cdcacm *acm, void *buf, uint16_t len);
+uint16_t usb_cdcacm_tx_span(usbd_cdcacm *acm, uint8_t **data);
+void usb_cdcacm_tx_commit(usbd_cdcacm *acm, uint16_t len);
+uint16_t usb_cdcacm_write(usbd_cdcacm *acm, const void *buf, uint16_t len);
+
+/* Datagrams held by one transmitted NTB */
+#define USB_NCM_MAX_DATAGRAMS			32
+
+typedef struct _usbd_ncm usbd_ncm;
+
+usbd_ncm *usb_ncm_init(usbd_device *usbd_dev, uint8_t comm_iface,
+		       uint8_t data_iface, uint8_t ep_in, uint8_t ep_out,
+		       uint8_t ep_notif, uint16_t max_packet,
+		       void *arena, uint32_t arena_size);
+void usb_ncm_set_link(usbd_ncm *ncm, bool up);
+uint8_t *usb_ncm_tx_alloc(usbd_ncm *ncm, uint16_t len);
+void usb_ncm_tx_commit(usbd_ncm *ncm, uint16_t len);
+uint16_t usb_ncm_rx_datagram(usbd_ncm *ncm, const uint8_t **data);
+
 #endif
 
 /**@}*/
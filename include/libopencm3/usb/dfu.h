@@ -39,6 +39,8 @@ LGPL License Terms @ref lgpl_license
 #define __DFU_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <libopencm3/usb/usbd.h>
 
 #define USB_CLASS_DFU 0xFE
 
@@ -100,6 +102,49 @@ struct usb_dfu_descriptor {
 	uint16_t bcdDFUVersion;
 } __attribute__((packed));
 
+/* DfuSe commands, sent by the host as DNLOAD block 0 */
+#define DFUSE_CMD_GET_COMMANDS		0x00
+#define DFUSE_CMD_SET_ADDRESS		0x21
+#define DFUSE_CMD_ERASE			0x41
+
+typedef struct _usbd_dfu usbd_dfu;
+
+/** Memory written by the DFU download engine.
+ *
+ * The callbacks are called from usb_dfu_poll(), never from the USB
+ * interrupt, and typically wrap the family's flash routines. The flash
+ * must be unlocked by the application.
+ */
+struct usb_dfu_memory {
+	uint32_t base;		/**< Start of the region open to the host */
+	uint32_t size;		/**< Size of the region in bytes */
+	/** Largest piece programmed per usb_dfu_poll() call, 0 for a block */
+	uint16_t program_size;
+	/** bwPollTimeout in ms reported while the host has to wait */
+	uint16_t poll_timeout;
+	/** Erase the page holding @a address. Returns the number of bytes
+	 * erased from @a address to the end of the page, <= 0 on failure. */
+	int32_t (*erase)(uint32_t address);
+	/** Program @a len bytes, returns 0 on success. */
+	int (*program)(uint32_t address, const uint8_t *data, uint16_t len);
+	/** Read back for UPLOAD, returns 0 on success. May be NULL. */
+	int (*read)(uint32_t address, uint8_t *data, uint16_t len);
+	/** Called once the download is complete and programmed. May be
+	 * NULL. Without USB_DFU_MANIFEST_TOLERANT it is not expected to
+	 * return, usually it starts the new firmware. */
+	void (*manifest)(void);
+};
+
+usbd_dfu *usb_dfu_init(usbd_device *usbd_dev, uint8_t iface,
+		       uint8_t attributes, uint16_t transfer_size, bool dfuse,
+		       const struct usb_dfu_memory *mem,
+		       void *arena, uint32_t arena_size);
+void usb_dfu_poll(usbd_dfu *dfu);
+bool usb_dfu_busy(usbd_dfu *dfu);
+
+void usb_dfu_runtime_init(usbd_device *usbd_dev, uint8_t iface,
+			  void (*detach)(void));
+
 #endif
 
 /**@}*/
@@ -80,6 +80,8 @@
 #define OTG_DIEPTSIZ(x)			(0x910 + 0x20*(x))
 #define OTG_DOEPTSIZ0			0xB10
 #define OTG_DOEPTSIZ(x)			(0xB10 + 0x20*(x))
+#define OTG_DIEPDMA(x)			(0x914 + 0x20*(x))
+#define OTG_DOEPDMA(x)			(0xB14 + 0x20*(x))
 #define OTG_DTXFSTS(x)			(0x918 + 0x20*(x))
 
 /* Power and clock gating control and status register */
@@ -112,6 +114,13 @@
 
 /* OTG AHB configuration register (OTG_GAHBCFG) */
 #define OTG_GAHBCFG_GINT		0x0001
+#define OTG_GAHBCFG_HBSTLEN_SINGLE	(0x0 << 1)
+#define OTG_GAHBCFG_HBSTLEN_INCR	(0x1 << 1)
+#define OTG_GAHBCFG_HBSTLEN_INCR4	(0x3 << 1)
+#define OTG_GAHBCFG_HBSTLEN_INCR8	(0x5 << 1)
+#define OTG_GAHBCFG_HBSTLEN_INCR16	(0x7 << 1)
+#define OTG_GAHBCFG_HBSTLEN_MASK	(0xf << 1)
+#define OTG_GAHBCFG_DMAEN		0x0020
 #define OTG_GAHBCFG_TXFELVL		0x0080
 #define OTG_GAHBCFG_PTXFELVL		0x0100
 
@@ -255,6 +264,8 @@
 
 /* OTG device status register (OTG_DSTS) */
 #define OTG_DSTS_SUSPSTS	(1 << 0)
+#define OTG_DSTS_FNSOF_SHIFT	8
+#define OTG_DSTS_FNSOF_MASK	(0x3fff << 8)
 
 /* OTG Device IN Endpoint Common Interrupt Mask Register (OTG_DIEPMSK) */
 /* Bits 31:10 - Reserved */
@@ -286,15 +297,19 @@
 #define OTG_DIEPCTL0_EPENA		(1 << 31)
 #define OTG_DIEPCTL0_EPDIS		(1 << 30)
 /* Bits 29:28 - Reserved */
+#define OTG_DIEPCTLX_SODDFRM		(1 << 29)
 #define OTG_DIEPCTLX_SD0PID		(1 << 28)
+#define OTG_DIEPCTLX_SEVNFRM		(1 << 28)
 #define OTG_DIEPCTL0_SNAK		(1 << 27)
 #define OTG_DIEPCTL0_CNAK		(1 << 26)
 #define OTG_DIEPCTL0_TXFNUM_MASK	(0xf << 22)
 #define OTG_DIEPCTL0_STALL		(1 << 21)
 /* Bit 20 - Reserved */
 #define OTG_DIEPCTL0_EPTYP_MASK		(0x3 << 18)
+#define OTG_DIEPCTLX_EPTYP_ISO		(0x1 << 18)
 #define OTG_DIEPCTL0_NAKSTS		(1 << 17)
 /* Bit 16 - Reserved */
+#define OTG_DIEPCTLX_EONUM		(1 << 16)
 #define OTG_DIEPCTL0_USBAEP		(1 << 15)
 /* Bits 14:2 - Reserved */
 #define OTG_DIEPCTL0_MPSIZ_MASK		(0x3 << 0)
@@ -307,13 +322,16 @@
 #define OTG_DOEPCTL0_EPENA		(1 << 31)
 #define OTG_DOEPCTL0_EPDIS		(1 << 30)
 /* Bits 29:28 - Reserved */
+#define OTG_DOEPCTLX_SODDFRM		(1 << 29)
 #define OTG_DOEPCTLX_SD0PID		(1 << 28)
+#define OTG_DOEPCTLX_SEVNFRM		(1 << 28)
 #define OTG_DOEPCTL0_SNAK		(1 << 27)
 #define OTG_DOEPCTL0_CNAK		(1 << 26)
 /* Bits 25:22 - Reserved */
 #define OTG_DOEPCTL0_STALL		(1 << 21)
 #define OTG_DOEPCTL0_SNPM		(1 << 20)
 #define OTG_DOEPCTL0_EPTYP_MASK		(0x3 << 18)
+#define OTG_DOEPCTLX_EPTYP_ISO		(0x1 << 18)
 #define OTG_DOEPCTL0_NAKSTS		(1 << 17)
 /* Bit 16 - Reserved */
 #define OTG_DOEPCTL0_USBAEP		(1 << 15)
@@ -356,6 +374,13 @@
 /* Bits 18:7 - Reserved */
 #define OTG_DIEPSIZ0_XFRSIZ_MASK	(0x7f << 0)
 
+/* OTG Device IN/OUT Endpoint x Transfer Size Register (OTG_DxEPTSIZx) */
+/* Bits 30:29 - MCNT (IN) / RXDPID (OUT) */
+#define OTG_DIEPSIZX_MCNT_1		(0x1 << 29)
+#define OTG_DIEPSIZX_PKTCNT_SHIFT	19
+#define OTG_DIEPSIZX_PKTCNT_MASK	(0x3ff << 19)
+#define OTG_DIEPSIZX_XFRSIZ_MASK	(0x7ffff << 0)
+
 
 
 /* Host-mode CSRs */
@@ -39,6 +39,8 @@ LGPL License Terms @ref lgpl_license
 #define __HID_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <libopencm3/usb/usbd.h>
 
 #define USB_CLASS_HID	3
 
@@ -85,6 +87,35 @@ struct usb_hid_descriptor {
 	uint8_t bNumDescriptors;
 } __attribute__((packed));
 
+/* Most reports the HID function can queue */
+#define USB_HID_MAX_QUEUE	16
+
+typedef struct _usbd_hid usbd_hid;
+
+/** Called for GET_REPORT and SET_REPORT requests.
+ * @param get True for GET_REPORT.
+ * @param type One of USB_HID_REPORT_TYPE_*.
+ * @param id Report ID, 0 if reports carry no ID.
+ * @param buf Report data, to be filled in for GET_REPORT.
+ * @param len Size of @a buf, to be set to the report size for GET_REPORT.
+ * @return 0 on success, non-zero to stall the request.
+ */
+typedef int (*usb_hid_report_callback)(usbd_hid *hid, bool get, uint8_t type,
+				       uint8_t id, uint8_t *buf,
+				       uint16_t *len);
+
+usbd_hid *usb_hid_init(usbd_device *usbd_dev, uint8_t iface, uint8_t ep_in,
+		       uint16_t max_packet, uint8_t interval,
+		       const uint8_t *report_desc, uint16_t report_desc_len,
+		       bool report_ids, void *arena, uint32_t arena_size);
+void usb_hid_register_report_callback(usbd_hid *hid,
+				      usb_hid_report_callback callback);
+int usb_hid_send(usbd_hid *hid, const void *report, uint16_t len,
+		 bool coalesce);
+uint8_t usb_hid_queued(usbd_hid *hid);
+uint8_t usb_hid_protocol(usbd_hid *hid);
+void usb_hid_sof(usbd_hid *hid);
+
 #endif
 
 /**@}*/
@@ -91,6 +91,26 @@ usbd_mass_storage *usb_msc_init(usbd_device *usbd_dev,
 				 int (*read_block)(uint32_t lba, uint8_t *copy_to),
 				 int (*write_block)(uint32_t lba, const uint8_t *copy_from));
 
+int usb_msc_set_pipeline(usbd_mass_storage *ms, void *arena,
+			 uint32_t arena_size, uint8_t buf_count,
+			 uint16_t block_size,
+			 int (*read_blocks)(uint8_t lun, uint64_t lba,
+					    uint32_t count, uint8_t *copy_to),
+			 int (*write_blocks)(uint8_t lun, uint64_t lba,
+					     uint32_t count,
+					     const uint8_t *copy_from));
+void usb_msc_io_done(usbd_mass_storage *ms, int result);
+int usb_msc_add_lun(usbd_mass_storage *ms, uint64_t block_count,
+		    uint16_t block_size,
+		    int (*read_block)(uint64_t lba, uint8_t *copy_to),
+		    int (*write_block)(uint64_t lba, const uint8_t *copy_from));
+void usb_msc_set_flush(usbd_mass_storage *ms, uint8_t lun,
+		       int (*flush)(void));
+int usb_msc_set_cache(usbd_mass_storage *ms, void *arena,
+		      uint32_t arena_size, uint32_t idle_ticks);
+int usb_msc_cache_flush(usbd_mass_storage *ms);
+void usb_msc_cache_tick(usbd_mass_storage *ms);
+
 #endif
 
 /**@}*/
@@ -49,15 +49,37 @@ enum usbd_request_return_codes {
 	USBD_REQ_NEXT_CALLBACK	= 2,
 };
 
+/** Flag that may be OR-ed into the @a type argument of @ref usbd_ep_setup
+ * to request a double-buffered endpoint, where the driver supports it. */
+#define USBD_EP_DOUBLEBUF	0x80
+
 typedef struct _usbd_driver usbd_driver;
 typedef struct _usbd_device usbd_device;
 
 extern const usbd_driver st_usbfs_v1_usb_driver;
 extern const usbd_driver stm32f107_usb_driver;
 extern const usbd_driver stm32f207_usb_driver;
+extern const usbd_driver stm32f207_dma_usb_driver;
 extern const usbd_driver st_usbfs_v2_usb_driver;
 #define otgfs_usb_driver stm32f107_usb_driver
 #define otghs_usb_driver stm32f207_usb_driver
+/**
+ * OTG_HS driver moving endpoint data with the core's internal DMA.
+ *
+ * Pass it to @ref usbd_init instead of @ref otghs_usb_driver to stop the CPU
+ * copying every word through the FIFOs. Buffers passed to
+ * @ref usbd_ep_write_packet for endpoints other than 0 must then be 32-bit
+ * aligned, reachable by the OTG_HS DMA (not CCM RAM) and left untouched until
+ * the endpoint's IN callback; unaligned buffers are rejected. OUT packets
+ * are stored by the DMA in driver buffers of 512 bytes per endpoint, so only
+ * endpoints 1 to 3 with OUT packets of up to 512 bytes can be set up.
+ *
+ * The driver does no data cache maintenance. On parts with a data cache
+ * (F7), the driver's .bss and all transfer buffers must be in memory the
+ * cache does not cover, such as DTCM or a non-cacheable MPU region, or the
+ * cache must be left disabled.
+ */
+#define otghs_dma_usb_driver stm32f207_dma_usb_driver
 extern const usbd_driver efm32lg_usb_driver;
 extern const usbd_driver efm32hg_usb_driver;
 extern const usbd_driver lm4f_usb_driver;
@@ -114,14 +136,45 @@ extern void usbd_register_resume_callback(usbd_device *usbd_dev,
 extern void usbd_register_sof_callback(usbd_device *usbd_dev,
 				       void (*callback)(void));
 
+/** Get the current (micro)frame number
+ *
+ * Lets isochronous streams be scheduled against the bus clock, typically
+ * from the SOF callback.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @return frame number of the last SOF, 0 if the driver cannot tell
+ */
+extern uint16_t usbd_get_frame_number(usbd_device *usbd_dev);
+
 typedef void (*usbd_control_complete_callback)(usbd_device *usbd_dev,
 		struct usb_setup_data *req);
 
+/**
+ * Control request handler.
+ *
+ * @a buf points to the control buffer, holding the data stage of OUT
+ * requests. For IN requests the handler either writes its reply there, or
+ * points @a buf at the data, which is then sent from where it is, so
+ * constant data is not copied and may be larger than the control buffer.
+ * @a len is the size of the data stage, to be lowered to the size of the
+ * reply. See also @ref usbd_control_set_generator.
+ */
 typedef enum usbd_request_return_codes (*usbd_control_callback)(
 		usbd_device *usbd_dev,
 		struct usb_setup_data *req, uint8_t **buf, uint16_t *len,
 		usbd_control_complete_callback *complete);
 
+/**
+ * Produce part of the data stage of an IN control request.
+ *
+ * @param offset Position of @a buf within the reply.
+ * @param buf Where to write, space for one control packet.
+ * @param len Bytes wanted, at most the control endpoint max packet size.
+ * @return Bytes written, less than @a len at the end of the reply.
+ */
+typedef uint16_t (*usbd_control_generator)(usbd_device *usbd_dev,
+		struct usb_setup_data *req, uint16_t offset, uint8_t *buf,
+		uint16_t len);
+
 typedef void (*usbd_set_config_callback)(usbd_device *usbd_dev,
 					 uint16_t wValue);
 
@@ -130,6 +183,9 @@ typedef void (*usbd_set_altsetting_callback)(usbd_device *usbd_dev,
 
 typedef void (*usbd_endpoint_callback)(usbd_device *usbd_dev, uint8_t ep);
 
+typedef void (*usbd_transfer_callback)(usbd_device *usbd_dev, uint8_t addr,
+				       uint32_t len);
+
 /* <usb_control.c> */
 /** Registers a control callback.
  *
@@ -149,6 +205,18 @@ extern int usbd_register_control_callback(usbd_device *usbd_dev, uint8_t type,
 					  uint8_t type_mask,
 					  usbd_control_callback callback);
 
+/** Send the reply of the current IN request from a generator.
+ *
+ * Called by a control callback instead of filling the control buffer. The
+ * callback sets its @a len to the size of the reply, which may exceed the
+ * control buffer: @a generator is called for each packet of the data stage,
+ * so only one packet is ever held in the control buffer.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param generator produces the data stage packet by packet
+ */
+extern void usbd_control_set_generator(usbd_device *usbd_dev,
+				       usbd_control_generator generator);
+
 /* <usb_standard.c> */
 /** Registers a "Set Config" callback
  * @param usbd_dev the usb device handle returned from @ref usbd_init
@@ -165,9 +233,56 @@ extern int usbd_register_set_config_callback(usbd_device *usbd_dev,
 extern void usbd_register_set_altsetting_callback(usbd_device *usbd_dev,
 					usbd_set_altsetting_callback callback);
 
+/** Flatten a configuration descriptor
+ *
+ * Writes configuration @a index with all its interface, endpoint and class
+ * descriptors into @a buf, as sent to the host, and fills in wTotalLength.
+ * Meant to build the blobs for @ref usbd_register_config_blobs once.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param index configuration index, not bConfigurationValue
+ * @param buf destination buffer
+ * @param len size of @a buf, the output is truncated to it
+ * @return # of bytes written
+ */
+extern uint16_t usbd_build_config_descriptor(usbd_device *usbd_dev,
+					     uint8_t index, uint8_t *buf,
+					     uint16_t len);
+
+/** Registers prebuilt configuration descriptors
+ *
+ * GET_DESCRIPTOR(CONFIGURATION) is then answered straight from
+ * @a blobs[index] instead of assembling the descriptor from the structures
+ * passed to @ref usbd_init into the control buffer on every request. The
+ * blobs may be const data in flash, generated at compile time, or built at
+ * startup with @ref usbd_build_config_descriptor. The structures are still
+ * used for SET_CONFIGURATION and must match.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param blobs one flattened descriptor per configuration, NULL to go back
+ *              to building them on request
+ */
+extern void usbd_register_config_blobs(usbd_device *usbd_dev,
+				       const uint8_t * const *blobs);
+
 /** Registers a non-contiguous string descriptor */
 extern void usbd_register_extra_string(usbd_device *usbd_dev, int index, const char* string);
 
+/** Set the number of transfer events handled per usbd_poll() call
+ *
+ * By default a single endpoint transfer event is handled per call. A larger
+ * budget lets drivers that support it (currently st_usbfs) drain all pending
+ * transfer events before returning, up to @a budget of them, so that busy
+ * endpoints do not delay each other by a full poll/interrupt round trip.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param budget max number of events per call, 0 is treated as 1
+ */
+extern void usbd_set_poll_budget(usbd_device *usbd_dev, uint8_t budget);
+
+/** Get the number of transfer events handled by the last usbd_poll() call
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @return number of events, always 0 with drivers that do not count them
+ */
+extern uint8_t usbd_poll_event_count(usbd_device *usbd_dev);
+
 /* Functions to be provided by the hardware abstraction layer */
 extern void usbd_poll(usbd_device *usbd_dev);
 
@@ -184,12 +299,18 @@ extern void usbd_disconnect(usbd_device *usbd_dev, bool disconnected);
 /** Setup an endpoint
  * @param usbd_dev the usb device handle returned from @ref usbd_init
  * @param addr Full EP address including direction (e.g. 0x01 or 0x81)
- * @param type Value for bmAttributes (USB_ENDPOINT_ATTR_*)
+ * @param type Value for bmAttributes (USB_ENDPOINT_ATTR_*), optionally
+ *             OR-ed with @ref USBD_EP_DOUBLEBUF
  * @param max_size Endpoint max size
  * @param callback your desired callback function
  * @note The stack only supports 8 endpoints, 0..7, so don't try
  * and use arbitrary addresses here, even though USB itself would allow this.
  * Not all backends support arbitrary addressing anyway.
+ * @note @ref USBD_EP_DOUBLEBUF is currently honoured for bulk endpoints by
+ * the st_usbfs driver only, and ignored by the others. A double-buffered
+ * st_usbfs endpoint consumes the packet memory of both directions of its
+ * endpoint number, so that number cannot also be used in the opposite
+ * direction. Isochronous st_usbfs endpoints are always double-buffered.
  */
 extern void usbd_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
 		uint16_t max_size, usbd_endpoint_callback callback);
@@ -213,6 +334,33 @@ extern uint16_t usbd_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
  */
 extern uint16_t usbd_ep_read_packet(usbd_device *usbd_dev, uint8_t addr,
 			       void *buf, uint16_t len);
+/** Queue a multi-packet transfer
+ *
+ * Moves a whole buffer over a non-control endpoint, split into max packet
+ * sized packets by the driver, and calls @a callback once when done. The
+ * endpoint callback is not called for the packets of the transfer. DWC
+ * based drivers program the whole transfer into the hardware, the others
+ * emulate it packet by packet.
+ *
+ * A bus reset or SET_CONFIGURATION drops the queued transfers without
+ * calling their @a callback. Classes using this must reset their transfer
+ * state in their set config callback.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param addr Full EP address (with direction bit)
+ * @param buf buffer to send from or receive into; it must stay valid until
+ *            @a callback. With @ref otghs_dma_usb_driver it must be 32-bit
+ *            aligned.
+ * @param len # of bytes. An OUT transfer also ends on a short packet.
+ * @param zlp IN only: terminate with a zero length packet if @a len is a
+ *            non-zero multiple of the max packet size
+ * @param callback called with the # of bytes transferred, may be NULL
+ * @return 0 if queued, -1 if the endpoint is invalid or busy, no slot is
+ *         free or the driver cannot use @a buf
+ */
+extern int usbd_ep_transfer(usbd_device *usbd_dev, uint8_t addr, void *buf,
+			    uint32_t len, bool zlp,
+			    usbd_transfer_callback callback);
+
 /** Set/clear STALL condition on an endpoint
  * @param usbd_dev the usb device handle returned from @ref usbd_init
  * @param addr Full EP address (with direction bit)
@@ -235,6 +383,109 @@ extern uint8_t usbd_ep_stall_get(usbd_device *usbd_dev, uint8_t addr);
  */
 extern void usbd_ep_nak_set(usbd_device *usbd_dev, uint8_t addr, uint8_t nak);
 
+/* <usb_stats.c> */
+/*
+ * Instrumentation, only kept when the library is built with USBD_STATS
+ * defined, for instance with "make DEBUG_FLAGS=-DUSBD_STATS". Times are in
+ * DWT cycle counter ticks, which stay 0 on cores without one. On ARMv6-M
+ * (Cortex-M0/M0+) the poll time histograms are not kept and nothing is
+ * written to the ITM.
+ */
+#define USBD_STATS_ENDPOINTS		8
+#define USBD_STATS_BUCKETS		16
+#ifndef USBD_TRACE_SIZE
+#define USBD_TRACE_SIZE			64
+#endif
+
+/* Vendor request reading the instrumentation, wValue selects what */
+#define USBD_STATS_REQ_READ		0x5a
+#define USBD_STATS_READ_COUNTERS	0
+#define USBD_STATS_READ_TRACE		1
+
+/** Counters of one endpoint direction */
+struct usbd_ep_stats {
+	uint32_t packets;	/**< Packets moved through read/write_packet */
+	uint32_t bytes;		/**< Bytes of those packets */
+	uint32_t busy;		/**< Packets refused as the endpoint was busy */
+	uint32_t naks;		/**< Times the endpoint was set to NAK */
+	uint32_t stalls;	/**< Times the endpoint was stalled */
+	uint32_t transfers;	/**< usbd_ep_transfer() completions */
+};
+
+/** Statistics of a device, polled from a debugger or read by the host */
+struct usbd_stats {
+	struct usbd_ep_stats ep[USBD_STATS_ENDPOINTS][2]; /**< [ep][OUT, IN] */
+	uint32_t resets;
+	uint32_t setups;
+	uint32_t polls;
+	/** Time spent in usbd_poll(), bucket n counts durations below 4^n
+	 * cycles that did not fit in bucket n - 1. */
+	uint32_t poll_time[USBD_STATS_BUCKETS];
+	/** Time from one usbd_poll() to the next, same buckets */
+	uint32_t poll_gap[USBD_STATS_BUCKETS];
+};
+
+enum usbd_trace_type {
+	USBD_TRACE_RESET,
+	USBD_TRACE_SETUP,
+	USBD_TRACE_IN,
+	USBD_TRACE_OUT,
+	USBD_TRACE_BUSY,
+	USBD_TRACE_NAK,
+	USBD_TRACE_STALL,
+	USBD_TRACE_TRANSFER,
+};
+
+struct usbd_trace_event {
+	uint32_t cycles;	/**< DWT cycle counter */
+	uint8_t type;		/**< enum usbd_trace_type */
+	uint8_t addr;		/**< Endpoint address, with direction bit */
+	uint16_t len;		/**< Bytes, or bRequest for a SETUP */
+} __attribute__((packed));
+
+/** Ring of the last USBD_TRACE_SIZE events, oldest at head % size */
+struct usbd_trace {
+	uint32_t head;		/**< Number of events ever recorded */
+	struct usbd_trace_event event[USBD_TRACE_SIZE];
+} __attribute__((packed));
+
+/** Get the statistics
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @return the statistics, NULL if the library is built without USBD_STATS
+ */
+extern const struct usbd_stats *usbd_get_stats(usbd_device *usbd_dev);
+
+/** Get the event trace ring
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @return the trace, NULL if the library is built without USBD_STATS
+ */
+extern const struct usbd_trace *usbd_get_trace(usbd_device *usbd_dev);
+
+/** Clear the statistics and the trace
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ */
+extern void usbd_stats_reset(usbd_device *usbd_dev);
+
+/** Control callback answering @ref USBD_STATS_REQ_READ
+ *
+ * Register it for vendor device requests in the set config callback. The
+ * reply is struct usbd_stats or struct usbd_trace, in the device's byte
+ * order, sent from where it is kept.
+ */
+extern enum usbd_request_return_codes usbd_stats_control_request(
+		usbd_device *usbd_dev, struct usb_setup_data *req,
+		uint8_t **buf, uint16_t *len,
+		usbd_control_complete_callback *complete);
+
+/** Write the events recorded since the last call to an ITM stimulus port
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param port ITM stimulus port, which must be enabled
+ * @return number of events written, older ones overwritten meanwhile are
+ *         skipped. 0 if the ITM or @a port is not enabled, e.g. with no
+ *         debugger attached.
+ */
+extern uint32_t usbd_trace_itm(usbd_device *usbd_dev, uint8_t port);
+
 END_DECLS
 
 #endif
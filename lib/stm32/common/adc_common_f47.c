@@ -28,6 +28,8 @@ LGPL License Terms @ref lgpl_license
  */
 
 #include <libopencm3/stm32/adc.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/timer.h>
 
 /**@{*/
 
@@ -121,4 +123,154 @@ void adc_disable_vbat_sensor(void)
 	ADC_CCR &= ~ADC_CCR_VBATE;
 }
 
+/*---------------------------------------------------------------------------*/
+/* Continuous capture. */
+
+static int adc_capture_restart(struct adc_capture *cap);
+
+static void adc_capture_dma(uint32_t dma, uint8_t stream, uint32_t flags,
+			    void *user)
+{
+	struct adc_capture *cap = user;
+	uint16_t half = cap->samples / 2;
+
+	(void)dma;
+	(void)stream;
+
+	if (flags & DMA_TEIF) {
+		adc_capture_restart(cap);
+		return;
+	}
+	if (!cap->callback) {
+		return;
+	}
+	/* Both halves may be due if this interrupt was held off. */
+	if (flags & DMA_HTIF) {
+		cap->callback(cap, cap->buffer, half);
+	}
+	if (flags & DMA_TCIF) {
+		cap->callback(cap, cap->buffer + half, half);
+	}
+}
+
+static int adc_capture_arm(struct adc_capture *cap)
+{
+	const struct dma_transfer xfer = {
+		.src = (uint32_t) &ADC_DR(cap->adc),
+		.dst = (uint32_t) cap->buffer,
+		.count = cap->samples,
+		.cr = DMA_SxCR_CHSEL(cap->dma_channel) |
+		      DMA_SxCR_DIR_PERIPHERAL_TO_MEM |
+		      DMA_SxCR_PSIZE_16BIT | DMA_SxCR_MSIZE_16BIT |
+		      DMA_SxCR_MINC | DMA_SxCR_CIRC | DMA_SxCR_HTIE |
+		      DMA_SxCR_PL_VERY_HIGH,
+		.callback = adc_capture_dma,
+		.user = cap,
+	};
+
+	if (dma_transfer_submit(cap->dma, cap->stream, &xfer) < 0) {
+		return -1;
+	}
+	adc_clear_overrun_flag(cap->adc);
+	adc_enable_dma(cap->adc);
+	return 0;
+}
+
+static int adc_capture_restart(struct adc_capture *cap)
+{
+	adc_disable_dma(cap->adc);
+	dma_transfer_abort(cap->dma, cap->stream);
+	return adc_capture_arm(cap);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief ADC Start a Continuous Capture
+
+Ties the pieces of a free running acquisition together: each update event of
+the timer triggers one conversion of the regular sequence, the results are
+moved into the ring buffer by a circular DMA stream, and every time half of
+the ring fills the callback is handed that half while the other one is being
+written. No CPU time is spent per sample.
+
+The ADC, timer and DMA clocks must be enabled, the channels' sample times set
+and the timer's time base configured beforehand. The DMA stream must be idle
+and its interrupt handler must call @ref dma_transfer_isr. Enable the ADC
+interrupt and call @ref adc_capture_recover from adc_isr to resume after an
+overrun.
+
+@param[in] cap Capture description, must stay valid until stopped.
+@returns int. 0 on success, -1 if the buffer size is not a multiple of two
+sequences or the DMA stream is busy.
+*/
+int adc_capture_start(struct adc_capture *cap)
+{
+	if (!cap->length || !cap->samples ||
+	    cap->samples % (2 * cap->length)) {
+		return -1;
+	}
+
+	cap->overruns = 0;
+	adc_set_regular_sequence(cap->adc, cap->length,
+				 (uint8_t *)cap->channels);
+	if (cap->length > 1) {
+		adc_enable_scan_mode(cap->adc);
+	} else {
+		adc_disable_scan_mode(cap->adc);
+	}
+	adc_set_single_conversion_mode(cap->adc);
+	adc_set_dma_continue(cap->adc);
+	if (adc_capture_arm(cap) < 0) {
+		return -1;
+	}
+	adc_enable_overrun_interrupt(cap->adc);
+	adc_enable_external_trigger_regular(cap->adc, cap->trigger,
+					    ADC_CR2_EXTEN_RISING_EDGE);
+	adc_power_on(cap->adc);
+
+	timer_set_master_mode(cap->timer, TIM_CR2_MMS_UPDATE);
+	timer_enable_counter(cap->timer);
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief ADC Stop a Continuous Capture
+
+The trigger timer is stopped and the ADC and DMA stream are released. The ADC
+is left powered.
+
+@param[in] cap Capture description.
+*/
+void adc_capture_stop(struct adc_capture *cap)
+{
+	timer_disable_counter(cap->timer);
+	adc_disable_external_trigger_regular(cap->adc);
+	adc_disable_overrun_interrupt(cap->adc);
+	adc_disable_dma(cap->adc);
+	dma_transfer_abort(cap->dma, cap->stream);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief ADC Recover a Continuous Capture from an Overrun
+
+On an overrun the ADC stops issuing DMA requests. When the overrun flag is
+set, the DMA stream is restarted from the start of the ring and DMA requests
+are re-enabled, as the reference manual requires. The timer keeps running so
+capture resumes with the next trigger.
+
+@param[in] cap Capture description.
+@returns int. 1 if an overrun was found and cleared, 0 if there was none, -1
+if the DMA stream could not be restarted.
+*/
+int adc_capture_recover(struct adc_capture *cap)
+{
+	if (!adc_get_overrun_flag(cap->adc)) {
+		return 0;
+	}
+	cap->overruns++;
+	if (adc_capture_restart(cap) < 0) {
+		return -1;
+	}
+	return 1;
+}
+
 /**@}*/
\ No newline at end of file
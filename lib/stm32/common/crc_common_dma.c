@@ -0,0 +1,332 @@
+/** @addtogroup crc_file CRC peripheral API
+ * @ingroup peripheral_apis
+
+*/
+
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**@{*/
+
+#include <stddef.h>
+#include <libopencm3/stm32/crc.h>
+#include <libopencm3/stm32/dma.h>
+
+/* The stream whose DMA update is holding the CRC unit. */
+static struct crc_stream *crc_stream_owner;
+
+static uint32_t crc_stream_width(const struct crc_stream *cs)
+{
+	switch (cs->polysize) {
+	case CRC_CR_POLYSIZE_16:
+		return 16;
+	case CRC_CR_POLYSIZE_8:
+		return 8;
+	case CRC_CR_POLYSIZE_7:
+		return 7;
+	default:
+		return 32;
+	}
+}
+
+static uint32_t crc_stream_mask(const struct crc_stream *cs)
+{
+	uint32_t width = crc_stream_width(cs);
+
+	return width == 32 ? 0xffffffff : (1UL << width) - 1;
+}
+
+/* Bytes go in through the 8 bit data register, reflected by the unit if
+ * needed. Aligned words go in whole: a little endian word holds its first
+ * byte in the low bits, so a reflected CRC reverses the whole word, and an
+ * unreflected one byte swaps it.
+ */
+static void crc_stream_cpu(const struct crc_stream *cs, const uint8_t *p,
+			   uint32_t len)
+{
+	uint32_t cr = cs->polysize;
+	uint32_t w;
+
+	CRC_CR = cr | (cs->reflect_in ? CRC_CR_REV_IN_BYTE : CRC_CR_REV_IN_NONE);
+	while (len && ((uint32_t)p & 3)) {
+		CRC_DR8 = *p++;
+		len--;
+	}
+
+	if (len >= 4) {
+		CRC_CR = cr | (cs->reflect_in ? CRC_CR_REV_IN_WORD :
+			       CRC_CR_REV_IN_NONE);
+		for (; len >= 4; len -= 4, p += 4) {
+			w = *(const uint32_t *)p;
+			CRC_DR = cs->reflect_in ? w : __builtin_bswap32(w);
+		}
+		CRC_CR = cr | (cs->reflect_in ? CRC_CR_REV_IN_BYTE :
+			       CRC_CR_REV_IN_NONE);
+	}
+
+	while (len--) {
+		CRC_DR8 = *p++;
+	}
+}
+
+static void crc_stream_dma_done(struct crc_stream *cs, bool error);
+
+#ifdef DMA_SxCR_EN
+static void crc_stream_dma(uint32_t dma, uint8_t stream, uint32_t flags,
+			   void *user)
+{
+	(void)dma;
+	(void)stream;
+
+	if (flags & (DMA_TCIF | DMA_TEIF | DMA_DMEIF)) {
+		crc_stream_dma_done(user, flags & (DMA_TEIF | DMA_DMEIF));
+	}
+}
+#endif
+
+/* Feed the next chunk of at most 65535 items to the data register. */
+static int crc_stream_dma_start(struct crc_stream *cs, bool first)
+{
+	uint32_t n = cs->wide ? cs->left / 4 : cs->left;
+#ifdef DMA_SxCR_EN
+	struct dma_transfer xfer = {
+		.src = (uint32_t) cs->data,
+		.dst = (uint32_t) &CRC_DR,
+		.cr = DMA_SxCR_DIR_MEM_TO_MEM | DMA_SxCR_PINC |
+		      (cs->wide ? DMA_SxCR_PSIZE_32BIT | DMA_SxCR_MSIZE_32BIT :
+			      DMA_SxCR_PSIZE_8BIT | DMA_SxCR_MSIZE_8BIT) |
+		      DMA_SxCR_PL_LOW,
+		/* Direct mode is not available memory to memory. */
+		.fcr = DMA_SxFCR_DMDIS | DMA_SxFCR_FTH_4_4_FULL,
+		.callback = crc_stream_dma,
+		.user = cs,
+	};
+#endif
+
+	if (n > 0xffff) {
+		n = 0xffff;
+	}
+#ifdef DMA_SxCR_EN
+	(void)first;
+
+	xfer.count = n;
+	if (dma_transfer_submit(cs->dma, cs->stream, &xfer) < 0) {
+		return -1;
+	}
+#else
+	if (first && (DMA_CCR(cs->dma, cs->stream) & DMA_CCR_EN)) {
+		return -1;
+	}
+	/* The channel stays enabled after completing. */
+	DMA_CCR(cs->dma, cs->stream) = 0;
+	dma_clear_interrupt_flags(cs->dma, cs->stream, DMA_FLAGS);
+	DMA_CPAR(cs->dma, cs->stream) = (uint32_t) &CRC_DR;
+	DMA_CMAR(cs->dma, cs->stream) = (uint32_t) cs->data;
+	DMA_CNDTR(cs->dma, cs->stream) = n;
+	DMA_CCR(cs->dma, cs->stream) = DMA_CCR_MEM2MEM | DMA_CCR_DIR |
+				       DMA_CCR_MINC | DMA_CCR_TCIE |
+				       DMA_CCR_TEIE | DMA_CCR_PL_LOW |
+				       (cs->wide ?
+					DMA_CCR_PSIZE_32BIT |
+					DMA_CCR_MSIZE_32BIT :
+					DMA_CCR_PSIZE_8BIT |
+					DMA_CCR_MSIZE_8BIT);
+	DMA_CCR(cs->dma, cs->stream) |= DMA_CCR_EN;
+#endif
+
+	n *= cs->wide ? 4 : 1;
+	cs->data += n;
+	cs->left -= n;
+	return 0;
+}
+
+static void crc_stream_dma_stop(struct crc_stream *cs)
+{
+#ifdef DMA_SxCR_EN
+	dma_transfer_abort(cs->dma, cs->stream);
+#else
+	DMA_CCR(cs->dma, cs->stream) = 0;
+	dma_clear_interrupt_flags(cs->dma, cs->stream, DMA_FLAGS);
+#endif
+}
+
+static void crc_stream_dma_done(struct crc_stream *cs, bool error)
+{
+	if (!cs->busy) {
+		return;
+	}
+	if (!error && cs->left >= (cs->wide ? 4 : 1)) {
+		if (crc_stream_dma_start(cs, false) == 0) {
+			return;
+		}
+		error = true;
+	}
+	crc_stream_dma_stop(cs);
+
+	/* On error the update is dropped as a whole. */
+	if (!error) {
+		crc_stream_cpu(cs, cs->data, cs->left);
+		cs->state = CRC_DR & crc_stream_mask(cs);
+	}
+	crc_stream_owner = NULL;
+	cs->busy = false;
+	if (cs->callback) {
+		cs->callback(cs, error);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief CRC Start a Streaming Calculation
+
+Sets the running remainder to the initial value. The parameters of @p cs
+must be filled in beforehand.
+
+@param[in] cs Stream.
+*/
+void crc_stream_begin(struct crc_stream *cs)
+{
+	cs->state = cs->initial & crc_stream_mask(cs);
+	cs->busy = false;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief CRC Add Data to a Streaming Calculation
+
+The unit is loaded with the stream's polynomial, size and running remainder,
+so streams can be interleaved and a saved @c state resumes where it left off.
+@p data may have any length and alignment.
+
+Updates of at least @c dma_threshold bytes are fed to the unit by a memory to
+memory DMA transfer in word steps, or in byte steps for CRCs without input
+reflection, and the call returns straight away. Unaligned leading and
+trailing bytes are done by the CPU. The DMA interrupt handler must call
+@ref crc_stream_isr (or, on f7, @ref dma_transfer_isr), and the data must
+stay valid until the callback. Shorter updates are done by the CPU before the
+call returns. The callback is run in both cases.
+
+Updates must not be made from contexts that can preempt each other.
+
+@param[in] cs Stream.
+@param[in] data Bytes to add.
+@param[in] len Number of bytes.
+@returns int. 0 if the update was started or done, -1 if the unit is busy
+with a DMA update or the DMA could not be started.
+*/
+int crc_stream_update(struct crc_stream *cs, const void *data, uint32_t len)
+{
+	const uint8_t *p = data;
+	uint32_t head;
+
+	if (crc_stream_owner) {
+		return -1;
+	}
+
+	CRC_POL = cs->polynomial;
+	CRC_INIT = cs->state;
+	CRC_CR = cs->polysize | CRC_CR_RESET;
+
+	/* Leading bytes up to the next word go by CPU, the DMA needs at
+	 * least one item after them.
+	 */
+	head = cs->reflect_in ? -(uint32_t)p & 3 : 0;
+	if (!cs->dma_threshold || len < cs->dma_threshold ||
+	    len < head + 4) {
+		crc_stream_cpu(cs, p, len);
+		cs->state = CRC_DR & crc_stream_mask(cs);
+		if (cs->callback) {
+			cs->callback(cs, false);
+		}
+		return 0;
+	}
+
+	cs->wide = cs->reflect_in;
+	if (cs->wide) {
+		crc_stream_cpu(cs, p, head);
+		p += head;
+		len -= head;
+		CRC_CR = cs->polysize | CRC_CR_REV_IN_WORD;
+	} else {
+		CRC_CR = cs->polysize | CRC_CR_REV_IN_NONE;
+	}
+
+	cs->data = p;
+	cs->left = len;
+	cs->busy = true;
+	crc_stream_owner = cs;
+	if (crc_stream_dma_start(cs, true) < 0) {
+		crc_stream_owner = NULL;
+		cs->busy = false;
+		return -1;
+	}
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief CRC Check for a Running Update
+
+@param[in] cs Stream.
+@returns bool. true until the callback of the current DMA update has run.
+*/
+bool crc_stream_busy(const struct crc_stream *cs)
+{
+	return cs->busy;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief CRC Result of a Streaming Calculation
+
+Applies output reflection and the final XOR to the running remainder, which
+is left unchanged, so more data may still be added afterwards.
+
+@param[in] cs Stream.
+@returns uint32_t. CRC of the data added so far.
+*/
+uint32_t crc_stream_result(const struct crc_stream *cs)
+{
+	uint32_t width = crc_stream_width(cs);
+	uint32_t crc = cs->state;
+	uint32_t out = 0;
+	uint32_t i;
+
+	if (cs->reflect_out) {
+		for (i = 0; i < width; i++) {
+			out = (out << 1) | ((crc >> i) & 1);
+		}
+		crc = out;
+	}
+	return (crc ^ cs->final_xor) & crc_stream_mask(cs);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief CRC Streaming Update Interrupt Handler
+
+Call from the DMA stream or channel interrupt handler.
+
+@param[in] cs Stream.
+*/
+void crc_stream_isr(struct crc_stream *cs)
+{
+	bool done = dma_get_interrupt_flag(cs->dma, cs->stream, DMA_TCIF);
+	bool error = dma_get_interrupt_flag(cs->dma, cs->stream, DMA_TEIF);
+
+	dma_clear_interrupt_flags(cs->dma, cs->stream, DMA_TCIF | DMA_TEIF);
+	if (done || error) {
+		crc_stream_dma_done(cs, error);
+	}
+}
+
+/**@}*/
@@ -48,6 +48,8 @@ LGPL License Terms @ref lgpl_license
 
 /**@{*/
 
+#include <stddef.h>
+#include <libopencm3/cm3/cortex.h>
 #include <libopencm3/stm32/dma.h>
 
 /*---------------------------------------------------------------------------*/
@@ -806,5 +808,377 @@ void dma_set_number_of_data(uint32_t dma, uint8_t stream, uint16_t number)
 {
 	DMA_SNDTR(dma, stream) = number;
 }
+
+/* Upper bound for a stream to stop after EN is cleared. */
+#define DMA_ABORT_LOOPS		10000
+
+/* Per stream completion state for the descriptor API, indexed [DMA2?][stream]. */
+static struct {
+	dma_transfer_callback callback;
+	void *user;
+} dma_transfer_state[2][DMA_STREAM_COUNT];
+
+/* Streams handed out by the allocator, one bit per stream. */
+static uint8_t dma_stream_claimed[2];
+
+static inline unsigned int dma_index(uint32_t dma)
+{
+	return dma == DMA2 ? 1 : 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief DMA Stream Submit a Transfer Descriptor
+
+The whole stream configuration is written in one pass: address, count and
+FIFO registers first, then the control register with all fields set and
+finally the enable bit, instead of the read-modify-write sequence of the
+individual setters. Stale interrupt flags are cleared beforehand, as the
+stream will not start while any are pending.
+
+If the descriptor has a callback, transfer complete, transfer error and
+direct mode error interrupts are enabled and the callback is run from
+@ref dma_transfer_isr. The stream's interrupt must be enabled in the NVIC
+by the caller.
+
+@param[in] dma unsigned int32. DMA controller base address: DMA1 or DMA2
+@param[in] stream unsigned int8. Stream number: @ref dma_st_number
+@param[in] xfer Transfer descriptor. Only read during the call.
+@returns int. 0 on success, -1 if the stream is still enabled.
+*/
+
+int dma_transfer_submit(uint32_t dma, uint8_t stream,
+			const struct dma_transfer *xfer)
+{
+	unsigned int idx = dma_index(dma);
+	uint32_t cr = xfer->cr & ~(DMA_SxCR_EN | DMA_SxCR_TCIE |
+				   DMA_SxCR_TEIE | DMA_SxCR_DMEIE);
+
+	if (DMA_SCR(dma, stream) & DMA_SxCR_EN) {
+		return -1;
+	}
+
+	if (xfer->callback) {
+		cr |= DMA_SxCR_TCIE | DMA_SxCR_TEIE | DMA_SxCR_DMEIE;
+	} else {
+		cr &= ~DMA_SxCR_HTIE;
+	}
+	dma_transfer_state[idx][stream].callback = xfer->callback;
+	dma_transfer_state[idx][stream].user = xfer->user;
+
+	dma_clear_interrupt_flags(dma, stream, DMA_ISR_FLAGS);
+
+	if ((cr & DMA_SxCR_DIR_MASK) == DMA_SxCR_DIR_MEM_TO_PERIPHERAL) {
+		DMA_SPAR(dma, stream) = (uint32_t *) xfer->dst;
+		DMA_SM0AR(dma, stream) = (uint32_t *) xfer->src;
+	} else {
+		DMA_SPAR(dma, stream) = (uint32_t *) xfer->src;
+		DMA_SM0AR(dma, stream) = (uint32_t *) xfer->dst;
+	}
+	if (cr & DMA_SxCR_DBM) {
+		DMA_SM1AR(dma, stream) = (uint32_t *) xfer->mem1;
+	}
+	DMA_SNDTR(dma, stream) = xfer->count;
+	DMA_SFCR(dma, stream) = xfer->fcr;
+	DMA_SCR(dma, stream) = cr;
+	DMA_SCR(dma, stream) = cr | DMA_SxCR_EN;
+
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief DMA Stream Abort a Transfer
+
+The stream is disabled and the call waits until the hardware has finished the
+current beat and the enable bit reads back as clear, so the stream may be
+resubmitted immediately. Pending flags are cleared and no callback is run.
+The wait is bounded, in case a peripheral holds the bus.
+
+@param[in] dma unsigned int32. DMA controller base address: DMA1 or DMA2
+@param[in] stream unsigned int8. Stream number: @ref dma_st_number
+@returns int. 0 once the stream is stopped, -1 if it did not stop in time.
+*/
+
+int dma_transfer_abort(uint32_t dma, uint8_t stream)
+{
+	uint32_t i;
+
+	DMA_SCR(dma, stream) &= ~(DMA_SxCR_EN | DMA_SxCR_TCIE |
+				  DMA_SxCR_HTIE | DMA_SxCR_TEIE |
+				  DMA_SxCR_DMEIE);
+	for (i = 0; DMA_SCR(dma, stream) & DMA_SxCR_EN; i++) {
+		if (i == DMA_ABORT_LOOPS) {
+			return -1;
+		}
+	}
+	dma_clear_interrupt_flags(dma, stream, DMA_ISR_FLAGS);
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief DMA Stream Interrupt Dispatcher
+
+Call this from the stream's interrupt handler (e.g. dma2_stream0_isr) for
+streams started with @ref dma_transfer_submit. The stream's flags are read
+and cleared in one go and the descriptor's callback is called with them.
+
+@param[in] dma unsigned int32. DMA controller base address: DMA1 or DMA2
+@param[in] stream unsigned int8. Stream number: @ref dma_st_number
+*/
+
+void dma_transfer_isr(uint32_t dma, uint8_t stream)
+{
+	unsigned int idx = dma_index(dma);
+	uint32_t isr = stream < 4 ? DMA_LISR(dma) : DMA_HISR(dma);
+	uint32_t flags = (isr >> DMA_ISR_OFFSET(stream)) & DMA_ISR_FLAGS;
+
+	if (!flags) {
+		return;
+	}
+	dma_clear_interrupt_flags(dma, stream, flags);
+
+	if (dma_transfer_state[idx][stream].callback) {
+		dma_transfer_state[idx][stream].callback(dma, stream, flags,
+				dma_transfer_state[idx][stream].user);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief DMA Stream Claim
+
+Mark a stream as in use so that other drivers querying the allocator will not
+pick it. The stream hardware is not touched.
+
+@param[in] dma unsigned int32. DMA controller base address: DMA1 or DMA2
+@param[in] stream unsigned int8. Stream number: @ref dma_st_number
+@returns bool. true if the stream was free and is now claimed.
+*/
+
+bool dma_stream_claim(uint32_t dma, uint8_t stream)
+{
+	unsigned int idx = dma_index(dma);
+	bool ok = false;
+
+	CM_ATOMIC_BLOCK() {
+		if (!(dma_stream_claimed[idx] & (1 << stream))) {
+			dma_stream_claimed[idx] |= 1 << stream;
+			ok = true;
+		}
+	}
+	return ok;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief DMA Stream Claim the First Free Option
+
+Peripheral requests can usually be served by more than one stream/channel
+pair. The options are tried in order and the first free stream is claimed.
+
+@param[in] options Candidate streams, in order of preference.
+@param[in] count int. Number of entries in @p options.
+@returns int. Index into @p options of the claimed stream, or -1 if all of
+them are in use.
+*/
+
+int dma_stream_claim_any(const struct dma_stream_option *options, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (dma_stream_claim(options[i].dma, options[i].stream)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief DMA Stream Release
+
+Return a claimed stream to the allocator. Any transfer still running on it
+should be aborted first with @ref dma_transfer_abort.
+
+@param[in] dma unsigned int32. DMA controller base address: DMA1 or DMA2
+@param[in] stream unsigned int8. Stream number: @ref dma_st_number
+*/
+
+void dma_stream_release(uint32_t dma, uint8_t stream)
+{
+	unsigned int idx = dma_index(dma);
+
+	CM_ATOMIC_BLOCK() {
+		dma_stream_claimed[idx] &= ~(1 << stream);
+	}
+	dma_transfer_state[idx][stream].callback = NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief DMA Stream Check if Free
+
+@param[in] dma unsigned int32. DMA controller base address: DMA1 or DMA2
+@param[in] stream unsigned int8. Stream number: @ref dma_st_number
+@returns bool. true if the stream has not been claimed.
+*/
+
+bool dma_stream_is_free(uint32_t dma, uint8_t stream)
+{
+	return !(dma_stream_claimed[dma_index(dma)] & (1 << stream));
+}
+
+/* A chain can run in double buffer mode when it loops back on itself and every
+ * segment has the same length, as the hardware reloads NDTR with one count for
+ * both memory registers and never stops on its own.
+ */
+static bool dma_sg_is_ring(const struct dma_sg_segment *list)
+{
+	const struct dma_sg_segment *slow = list;
+	const struct dma_sg_segment *fast = list;
+
+	while (fast && fast->next) {
+		if (fast->count != list->count ||
+		    fast->next->count != list->count) {
+			return false;
+		}
+		slow = slow->next;
+		fast = fast->next->next;
+		if (slow == fast) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void dma_sg_complete(uint32_t dma, uint8_t stream, uint32_t flags,
+			    void *user)
+{
+	struct dma_sg *sg = user;
+	const struct dma_sg_segment *done = sg->current;
+
+	if (!done) {
+		return;
+	}
+
+	if (flags & (DMA_TEIF | DMA_DMEIF)) {
+		dma_transfer_abort(dma, stream);
+		sg->current = NULL;
+		if (sg->callback) {
+			sg->callback(sg, done, flags);
+		}
+		return;
+	}
+	if (!(flags & DMA_TCIF)) {
+		return;
+	}
+
+	if (sg->loaded) {
+		/* The stream has already switched to the preloaded segment,
+		 * refill the register it has just let go of.
+		 */
+		sg->current = sg->loaded;
+		sg->loaded = sg->loaded->next;
+		if (DMA_SCR(dma, stream) & DMA_SxCR_CT) {
+			dma_set_memory_address(dma, stream, sg->loaded->mem);
+		} else {
+			dma_set_memory_address_1(dma, stream,
+						 sg->loaded->mem);
+		}
+	} else if (done->next) {
+		/* The stream disabled itself, re-arm it with the next one. */
+		sg->current = done->next;
+		DMA_SM0AR(dma, stream) = (uint32_t *) done->next->mem;
+		DMA_SNDTR(dma, stream) = done->next->count;
+		DMA_SCR(dma, stream) |= DMA_SxCR_EN;
+	} else {
+		sg->current = NULL;
+	}
+
+	if (sg->callback) {
+		sg->callback(sg, done, flags);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief DMA Stream Start a Scatter-Gather Chain
+
+The stream is set up from @p xfer, except that the memory side address and
+the count come from each segment of @p list in turn. The stream hardware
+cannot follow a chain itself, so the next segment is loaded from the
+transfer complete interrupt, which must be routed to @ref dma_transfer_isr.
+
+A chain that loops back to an earlier segment, with all segments of equal
+length, runs in double buffer mode: the next segment is always preloaded in
+the idle memory register and the stream never stops between segments, as long
+as each interrupt is serviced before the following segment completes. Any
+other chain is re-armed from the interrupt and pauses for its latency between
+segments.
+
+@param[in] sg Chain state, must stay valid until the chain ends.
+@param[in] dma unsigned int32. DMA controller base address: DMA1 or DMA2
+@param[in] stream unsigned int8. Stream number: @ref dma_st_number
+@param[in] xfer Stream configuration. The memory address, count, callback,
+circular and double buffer settings are ignored.
+@param[in] list First segment of the chain.
+@returns int. 0 on success, -1 if the stream is still enabled.
+*/
+
+int dma_sg_start(struct dma_sg *sg, uint32_t dma, uint8_t stream,
+		 const struct dma_transfer *xfer,
+		 const struct dma_sg_segment *list)
+{
+	struct dma_transfer t = *xfer;
+
+	t.cr &= ~(DMA_SxCR_CIRC | DMA_SxCR_DBM | DMA_SxCR_HTIE);
+	if ((t.cr & DMA_SxCR_DIR_MASK) == DMA_SxCR_DIR_MEM_TO_PERIPHERAL) {
+		t.src = list->mem;
+	} else {
+		t.dst = list->mem;
+	}
+	t.count = list->count;
+	t.callback = dma_sg_complete;
+	t.user = sg;
+
+	sg->loaded = NULL;
+	if (dma_sg_is_ring(list)) {
+		t.cr |= DMA_SxCR_DBM;
+		t.mem1 = list->next->mem;
+		sg->loaded = list->next;
+	}
+	sg->dma = dma;
+	sg->stream = stream;
+	sg->current = list;
+
+	if (dma_transfer_submit(dma, stream, &t) < 0) {
+		sg->current = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief DMA Stream Stop a Scatter-Gather Chain
+
+The stream is aborted with @ref dma_transfer_abort. This is the only way to
+end a chain running in double buffer mode. No callback is run.
+
+@param[in] sg Chain state.
+*/
+
+void dma_sg_stop(struct dma_sg *sg)
+{
+	dma_transfer_abort(sg->dma, sg->stream);
+	sg->current = NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief DMA Stream Check if a Scatter-Gather Chain is Running
+
+@param[in] sg Chain state.
+@returns bool. true until the last segment completes, an error occurs or the
+chain is stopped.
+*/
+
+bool dma_sg_busy(const struct dma_sg *sg)
+{
+	return sg->current != NULL;
+}
 /**@}*/
 
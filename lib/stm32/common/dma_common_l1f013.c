@@ -40,6 +40,7 @@ LGPL License Terms @ref lgpl_license
 
 /**@{*/
 
+#include <stddef.h>
 #include <libopencm3/stm32/dma.h>
 
 /*---------------------------------------------------------------------------*/
@@ -447,5 +448,117 @@ void dma_set_number_of_data(uint32_t dma, uint8_t channel, uint16_t number)
 {
 	DMA_CNDTR(dma, channel) = number;
 }
+
+/*---------------------------------------------------------------------------*/
+/** @brief DMA Channel Start a Scatter-Gather Chain
+
+The channel must already be configured for the transfer (peripheral address,
+direction, data sizes, increments and priority) but left disabled. The memory
+address and count are taken from each segment of @p list in turn. This
+controller cannot follow a chain or preload a second buffer, so the next
+segment is loaded by @ref dma_sg_isr, which must be called from the
+channel's interrupt handler; the channel pauses for the interrupt latency
+between segments.
+
+@param[in] sg Chain state, must stay valid until the chain ends.
+@param[in] dma unsigned int32. DMA controller base address: DMA1 or DMA2
+@param[in] channel unsigned int8. Channel number: @ref dma_ch
+@param[in] list First segment of the chain.
+@returns int. 0 on success, -1 if the channel is still enabled.
+*/
+
+int dma_sg_start(struct dma_sg *sg, uint32_t dma, uint8_t channel,
+		 const struct dma_sg_segment *list)
+{
+	uint32_t ccr = DMA_CCR(dma, channel);
+
+	if (ccr & DMA_CCR_EN) {
+		return -1;
+	}
+
+	sg->dma = dma;
+	sg->channel = channel;
+	sg->current = list;
+
+	ccr &= ~(DMA_CCR_CIRC | DMA_CCR_HTIE);
+	ccr |= DMA_CCR_TCIE | DMA_CCR_TEIE;
+	dma_clear_interrupt_flags(dma, channel, DMA_FLAGS);
+	DMA_CMAR(dma, channel) = list->mem;
+	DMA_CNDTR(dma, channel) = list->count;
+	DMA_CCR(dma, channel) = ccr;
+	DMA_CCR(dma, channel) = ccr | DMA_CCR_EN;
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief DMA Channel Scatter-Gather Interrupt Handler
+
+Clears the channel's flags, loads the next segment on transfer complete and
+runs the chain's callback for the segment that finished.
+
+@param[in] sg Chain state.
+*/
+
+void dma_sg_isr(struct dma_sg *sg)
+{
+	uint32_t dma = sg->dma;
+	uint8_t channel = sg->channel;
+	const struct dma_sg_segment *done = sg->current;
+	uint32_t flags = (DMA_ISR(dma) >> DMA_FLAG_OFFSET(channel)) &
+			 DMA_FLAGS;
+
+	dma_clear_interrupt_flags(dma, channel, flags);
+	if (!done || !(flags & (DMA_TCIF | DMA_TEIF))) {
+		return;
+	}
+
+	/* The channel stays enabled after completing, and the address and
+	 * count may only be written while it is disabled.
+	 */
+	DMA_CCR(dma, channel) &= ~DMA_CCR_EN;
+	if (flags & DMA_TEIF) {
+		sg->current = NULL;
+	} else if (done->next) {
+		sg->current = done->next;
+		DMA_CMAR(dma, channel) = done->next->mem;
+		DMA_CNDTR(dma, channel) = done->next->count;
+		DMA_CCR(dma, channel) |= DMA_CCR_EN;
+	} else {
+		sg->current = NULL;
+	}
+
+	if (sg->callback) {
+		sg->callback(sg, done, flags);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief DMA Channel Stop a Scatter-Gather Chain
+
+The channel is disabled, its flags cleared, and no callback is run.
+
+@param[in] sg Chain state.
+*/
+
+void dma_sg_stop(struct dma_sg *sg)
+{
+	DMA_CCR(sg->dma, sg->channel) &= ~(DMA_CCR_EN | DMA_CCR_TCIE |
+					   DMA_CCR_TEIE);
+	dma_clear_interrupt_flags(sg->dma, sg->channel, DMA_FLAGS);
+	sg->current = NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief DMA Channel Check if a Scatter-Gather Chain is Running
+
+@param[in] sg Chain state.
+@returns bool. true until the last segment completes, an error occurs or the
+chain is stopped.
+*/
+
+bool dma_sg_busy(const struct dma_sg *sg)
+{
+	return sg->current != NULL;
+}
 /**@}*/
 
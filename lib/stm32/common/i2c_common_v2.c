@@ -19,7 +19,10 @@
  * along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stddef.h>
+#include <libopencm3/cm3/cortex.h>
 #include <libopencm3/stm32/i2c.h>
+#include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/rcc.h>
 
 /**@{*/
@@ -348,10 +351,23 @@ void i2c_disable_txdma(uint32_t i2c)
 	I2C_CR1(i2c) &= ~I2C_CR1_TXDMAEN;
 }
 
+/* Has the transfer ended early, on a NACK or a STOP? Clears both flags. */
+static bool i2c_transfer7_ended(uint32_t i2c)
+{
+	if (!(I2C_ISR(i2c) & (I2C_ISR_NACKF | I2C_ISR_STOPF))) {
+		return false;
+	}
+	/* The peripheral sends STOP by itself after a NACK. */
+	while (!(I2C_ISR(i2c) & I2C_ISR_STOPF));
+	I2C_ICR(i2c) = I2C_ICR_NACKCF | I2C_ICR_STOPCF;
+	return true;
+}
+
 /**
  * Run a write/read transaction to a given 7bit i2c address
  * If both write & read are provided, the read will use repeated start.
  * Both write and read are optional
+ * A NACK from the device ends the transaction early.
  * @param i2c peripheral of choice, eg I2C1
  * @param addr 7 bit i2c device address
  * @param w buffer of data to write
@@ -362,6 +378,9 @@ void i2c_disable_txdma(uint32_t i2c)
 void i2c_transfer7(uint32_t i2c, uint8_t addr, const uint8_t *w, size_t wn, uint8_t *r, size_t rn)
 {
 	/*  waiting for busy is unnecessary. read the RM */
+	/* Drop the STOP of the previous transaction. */
+	I2C_ICR(i2c) = I2C_ICR_NACKCF | I2C_ICR_STOPCF;
+
 	if (wn) {
 		i2c_set_7bit_address(i2c, addr);
 		i2c_set_write_transfer_dir(i2c);
@@ -374,12 +393,11 @@ void i2c_transfer7(uint32_t i2c, uint8_t addr, const uint8_t *w, size_t wn, uint
 		i2c_send_start(i2c);
 
 		while (wn--) {
-			bool wait = true;
-			while (wait) {
-				if (i2c_transmit_int_status(i2c)) {
-					wait = false;
+			while (!i2c_transmit_int_status(i2c)) {
+				/* Nobody there, or the byte was refused. */
+				if (i2c_transfer7_ended(i2c)) {
+					return;
 				}
-				while (i2c_nack(i2c)); /* FIXME Some error */
 			}
 			i2c_send_data(i2c, *w++);
 		}
@@ -387,7 +405,12 @@ void i2c_transfer7(uint32_t i2c, uint8_t addr, const uint8_t *w, size_t wn, uint
 		 * RM implies it will stall until it can write out the later bits
 		 */
 		if (rn) {
-			while (!i2c_transfer_complete(i2c));
+			while (!i2c_transfer_complete(i2c)) {
+				/* The last byte was refused. */
+				if (i2c_transfer7_ended(i2c)) {
+					return;
+				}
+			}
 		}
 	}
 
@@ -402,13 +425,17 @@ void i2c_transfer7(uint32_t i2c, uint8_t addr, const uint8_t *w, size_t wn, uint
 		i2c_enable_autoend(i2c);
 
 		for (size_t i = 0; i < rn; i++) {
-			while (i2c_received_data(i2c) == 0);
+			while (i2c_received_data(i2c) == 0) {
+				/* The address was not acknowledged. */
+				if (i2c_transfer7_ended(i2c)) {
+					return;
+				}
+			}
 			r[i] = i2c_get_data(i2c);
 		}
 	}
 }
 
-
 /**
  * Set the i2c communication speed.
  * NOTE: 1MHz mode not yet implemented!
@@ -447,4 +474,311 @@ void i2c_set_speed(uint32_t i2c, enum i2c_speeds speed, uint32_t clock_megahz)
 	}
 }
 
+/*---------------------------------------------------------------------------*/
+/* Asynchronous transactions. */
+
+#define I2C_ASYNC_CHUNK		255
+
+#define I2C_ASYNC_ERRORS	(I2C_ISR_BERR | I2C_ISR_ARLO | I2C_ISR_OVR | \
+				 I2C_ISR_TIMEOUT)
+
+/* Program the next NBYTES chunk of the current phase, with a (repeated)
+ * start for the first chunk.
+ */
+static void i2c_async_load(struct i2c_async *bus, bool start)
+{
+	struct i2c_async_xfer *x = bus->head;
+	uint32_t cr2 = I2C_CR2(bus->i2c);
+
+	cr2 &= ~(I2C_CR2_NBYTES_MASK | I2C_CR2_RELOAD | I2C_CR2_AUTOEND);
+	if (bus->left > I2C_ASYNC_CHUNK) {
+		cr2 |= (I2C_ASYNC_CHUNK << I2C_CR2_NBYTES_SHIFT) |
+		       I2C_CR2_RELOAD;
+	} else {
+		cr2 |= bus->left << I2C_CR2_NBYTES_SHIFT;
+		/* Stop after the last byte, unless a read follows. */
+		if (bus->reading || !x->rn) {
+			cr2 |= I2C_CR2_AUTOEND;
+		}
+	}
+
+	if (start) {
+		cr2 &= ~(I2C_CR2_SADD_7BIT_MASK | I2C_CR2_ADD10 |
+			 I2C_CR2_RD_WRN);
+		cr2 |= (x->addr << I2C_CR2_SADD_7BIT_SHIFT) | I2C_CR2_START;
+		if (bus->reading) {
+			cr2 |= I2C_CR2_RD_WRN;
+		}
+	}
+	I2C_CR2(bus->i2c) = cr2;
+}
+
+static void i2c_async_start(struct i2c_async *bus)
+{
+	struct i2c_async_xfer *x = bus->head;
+
+	bus->pos = 0;
+	bus->elapsed = 0;
+	bus->status = I2C_ASYNC_OK;
+	bus->reading = !x->wn && x->rn;
+	bus->left = bus->reading ? x->rn : x->wn;
+
+	I2C_ICR(bus->i2c) = I2C_ICR_NACKCF | I2C_ICR_STOPCF;
+	i2c_async_load(bus, true);
+}
+
+/* Retire the current transaction and start the next one before reporting,
+ * so the bus is not left idle while the callback runs.
+ */
+static void i2c_async_finish(struct i2c_async *bus,
+			     enum i2c_async_status status)
+{
+	struct i2c_async_xfer *x = bus->head;
+
+	bus->head = x->next;
+	if (bus->head) {
+		i2c_async_start(bus);
+	} else {
+		bus->tail = NULL;
+	}
+
+	if (x->callback) {
+		x->callback(x, status);
+	}
+}
+
+static void i2c_bus_delay(void)
+{
+	uint16_t i;
+
+	/* At least a standard mode half period at any core clock. */
+	for (i = 0; i < 1000; i++) {
+		__asm__("nop");
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief I2C Recover the Bus
+ *
+ * Resets the peripheral, dropping whatever it was doing. If the SCL and SDA
+ * pins are given, a slave left holding SDA low by an interrupted read is then
+ * clocked with up to nine SCL pulses until it lets go, and a stop condition
+ * is sent. The pins are returned to their previous mode afterwards. Blocks
+ * for up to a few milliseconds.
+ *
+ * @param[in] bus Bus description.
+ */
+void i2c_bus_recover(struct i2c_async *bus)
+{
+	uint32_t port = bus->gpio_port;
+	uint16_t pins = bus->scl_pin | bus->sda_pin;
+	uint32_t moder;
+	uint32_t mask = 0;
+	int i;
+
+	I2C_CR1(bus->i2c) &= ~I2C_CR1_PE;
+	/* PE must read back low before it takes effect. */
+	while (I2C_CR1(bus->i2c) & I2C_CR1_PE);
+
+	if (port) {
+		for (i = 0; i < 16; i++) {
+			if (pins & (1 << i)) {
+				mask |= GPIO_MODE_MASK(i);
+			}
+		}
+		moder = GPIO_MODER(port);
+		gpio_set(port, pins);
+		GPIO_MODER(port) = (moder & ~mask) | (mask & 0x55555555);
+		i2c_bus_delay();
+
+		for (i = 0; i < 9 && !gpio_get(port, bus->sda_pin); i++) {
+			gpio_clear(port, bus->scl_pin);
+			i2c_bus_delay();
+			gpio_set(port, bus->scl_pin);
+			i2c_bus_delay();
+		}
+
+		/* Stop: SDA rises while SCL is high. */
+		gpio_clear(port, bus->scl_pin);
+		i2c_bus_delay();
+		gpio_clear(port, bus->sda_pin);
+		i2c_bus_delay();
+		gpio_set(port, bus->scl_pin);
+		i2c_bus_delay();
+		gpio_set(port, bus->sda_pin);
+		i2c_bus_delay();
+
+		GPIO_MODER(port) = moder;
+	}
+
+	I2C_CR1(bus->i2c) |= I2C_CR1_PE;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief I2C Initialise an Asynchronous Transaction Queue
+ *
+ * Transactions are run one after the other from the I2C interrupts, so the
+ * caller never waits on the bus. The peripheral must be configured for 7 bit
+ * addressing and enabled, and the event and error interrupt handlers (one
+ * shared handler on some parts) must call @ref i2c_async_isr. The blocking
+ * transfer functions must not be used on the same peripheral meanwhile.
+ *
+ * @param[in] bus Bus description, must stay valid while in use.
+ */
+void i2c_async_init(struct i2c_async *bus)
+{
+	bus->head = NULL;
+	bus->tail = NULL;
+	I2C_ICR(bus->i2c) = I2C_ICR_NACKCF | I2C_ICR_STOPCF |
+			    I2C_ICR_BERRCF | I2C_ICR_ARLOCF |
+			    I2C_ICR_OVRCF | I2C_ICR_TIMOUTCF;
+	i2c_enable_interrupt(bus->i2c, I2C_CR1_ERRIE | I2C_CR1_TCIE |
+			     I2C_CR1_STOPIE | I2C_CR1_NACKIE |
+			     I2C_CR1_RXIE | I2C_CR1_TXIE);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief I2C Queue a Transaction
+ *
+ * The transaction writes @c wn bytes from @c w, then reads @c rn bytes into
+ * @c r after a repeated start, and ends with a stop. With both counts 0 only
+ * the address is sent, which probes for a device. The callback reports how
+ * it ended; on anything but @ref I2C_ASYNC_OK the buffers may have been
+ * partly transferred. May be called from a callback.
+ *
+ * @param[in] bus Bus.
+ * @param[in] xfer Transaction, must not be changed or queued again until its
+ * callback has run.
+ * @returns int. 0 if queued, -1 if a buffer is missing.
+ */
+int i2c_async_submit(struct i2c_async *bus, struct i2c_async_xfer *xfer)
+{
+	if ((xfer->wn && !xfer->w) || (xfer->rn && !xfer->r)) {
+		return -1;
+	}
+
+	xfer->next = NULL;
+	CM_ATOMIC_BLOCK() {
+		if (bus->tail) {
+			bus->tail->next = xfer;
+			bus->tail = xfer;
+		} else {
+			bus->head = xfer;
+			bus->tail = xfer;
+			i2c_async_start(bus);
+		}
+	}
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief I2C Check for Pending Transactions
+ *
+ * @param[in] bus Bus.
+ * @returns bool. true while any queued transaction has not been completed.
+ */
+bool i2c_async_busy(const struct i2c_async *bus)
+{
+	return bus->head != NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief I2C Asynchronous Transaction Interrupt Handler
+ *
+ * Call from both the event and the error interrupt handler.
+ *
+ * @param[in] bus Bus.
+ */
+void i2c_async_isr(struct i2c_async *bus)
+{
+	uint32_t i2c = bus->i2c;
+	uint32_t isr = I2C_ISR(i2c);
+	struct i2c_async_xfer *x = bus->head;
+
+	if (isr & I2C_ASYNC_ERRORS) {
+		I2C_ICR(i2c) = I2C_ICR_BERRCF | I2C_ICR_ARLOCF |
+			       I2C_ICR_OVRCF | I2C_ICR_TIMOUTCF;
+		if (!x) {
+			return;
+		}
+		if (isr & I2C_ISR_ARLO) {
+			/* The peripheral has already let go of the bus. */
+			i2c_async_finish(bus, I2C_ASYNC_ARLO);
+		} else {
+			i2c_bus_recover(bus);
+			i2c_async_finish(bus, I2C_ASYNC_BUS_ERROR);
+		}
+		return;
+	}
+
+	if (!x) {
+		I2C_ICR(i2c) = I2C_ICR_NACKCF | I2C_ICR_STOPCF;
+		return;
+	}
+
+	if (isr & I2C_ISR_NACKF) {
+		I2C_ICR(i2c) = I2C_ICR_NACKCF;
+		bus->status = I2C_ASYNC_NACK;
+		/* Only a last chunk with AUTOEND stops by itself. */
+		if ((I2C_CR2(i2c) & (I2C_CR2_AUTOEND | I2C_CR2_RELOAD)) !=
+		    I2C_CR2_AUTOEND) {
+			i2c_send_stop(i2c);
+		}
+	}
+
+	if ((isr & I2C_ISR_TXIS) && bus->left) {
+		I2C_TXDR(i2c) = x->w[bus->pos++];
+		bus->left--;
+	}
+	if ((isr & I2C_ISR_RXNE) && bus->left) {
+		x->r[bus->pos++] = I2C_RXDR(i2c);
+		bus->left--;
+	}
+
+	if (isr & I2C_ISR_TCR) {
+		i2c_async_load(bus, false);
+	} else if (isr & I2C_ISR_TC) {
+		/* End of the write phase without AUTOEND. */
+		if (bus->status == I2C_ASYNC_OK && !bus->reading && x->rn) {
+			bus->reading = true;
+			bus->pos = 0;
+			bus->left = x->rn;
+			i2c_async_load(bus, true);
+		} else {
+			i2c_send_stop(i2c);
+		}
+	}
+
+	if (isr & I2C_ISR_STOPF) {
+		I2C_ICR(i2c) = I2C_ICR_STOPCF;
+		i2c_async_finish(bus, bus->status);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief I2C Asynchronous Transaction Timeout
+ *
+ * Call periodically, for instance from the SysTick handler, at the same
+ * priority as the I2C interrupts. A transaction running for longer than
+ * @c timeout is abandoned, the bus is recovered with @ref i2c_bus_recover and
+ * the transaction completes with @ref I2C_ASYNC_TIMEOUT. A @c timeout of 0
+ * disables the check.
+ *
+ * @param[in] bus Bus.
+ * @param[in] elapsed Time since the previous call.
+ */
+void i2c_async_tick(struct i2c_async *bus, uint16_t elapsed)
+{
+	if (!bus->head || !bus->timeout) {
+		return;
+	}
+
+	if (elapsed >= bus->timeout - bus->elapsed) {
+		i2c_bus_recover(bus);
+		i2c_async_finish(bus, I2C_ASYNC_TIMEOUT);
+	} else {
+		bus->elapsed += elapsed;
+	}
+}
+
 /**@}*/
@@ -0,0 +1,288 @@
+/** @addtogroup spi_file SPI peripheral API
+ * @ingroup peripheral_apis
+
+*/
+
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**@{*/
+
+#include <stddef.h>
+#include <libopencm3/stm32/spi.h>
+#include <libopencm3/stm32/dma.h>
+
+/* 8 bit frames must be accessed as bytes on the v2 block, or the FIFO packs
+ * two of them into each access.
+ */
+#ifdef SPI_DR8
+#define SPI_DMA_WRITE8(spi, v)		(SPI_DR8(spi) = (v))
+#define SPI_DMA_READ8(spi)		SPI_DR8(spi)
+#else
+#define SPI_DMA_WRITE8(spi, v)		(SPI_DR(spi) = (v))
+#define SPI_DMA_READ8(spi)		SPI_DR(spi)
+#endif
+
+static bool spi_dma_wide(uint32_t spi)
+{
+#ifdef SPI_CR2_DS_MASK
+	return (SPI_CR2(spi) & SPI_CR2_DS_MASK) > SPI_CR2_DS_8BIT;
+#else
+	return SPI_CR1(spi) & SPI_CR1_DFF;
+#endif
+}
+
+static void spi_cpu_transfer(uint32_t spi, const void *tx, void *rx,
+			     uint16_t frames, bool wide)
+{
+	uint16_t i;
+	uint16_t in;
+
+	for (i = 0; i < frames; i++) {
+		while (!(SPI_SR(spi) & SPI_SR_TXE));
+		if (wide) {
+			SPI_DR(spi) = tx ? ((const uint16_t *)tx)[i] : 0xffff;
+		} else {
+			SPI_DMA_WRITE8(spi, tx ? ((const uint8_t *)tx)[i] :
+				       0xff);
+		}
+
+		while (!(SPI_SR(spi) & SPI_SR_RXNE));
+		if (wide) {
+			in = SPI_DR(spi);
+			if (rx) {
+				((uint16_t *)rx)[i] = in;
+			}
+		} else {
+			in = SPI_DMA_READ8(spi);
+			if (rx) {
+				((uint8_t *)rx)[i] = in;
+			}
+		}
+	}
+}
+
+static void spi_dma_abort(uint32_t dma, uint8_t stream)
+{
+#ifdef DMA_SxCR_EN
+	dma_transfer_abort(dma, stream);
+#else
+	DMA_CCR(dma, stream) = 0;
+	dma_clear_interrupt_flags(dma, stream, DMA_FLAGS);
+#endif
+}
+
+static void spi_dma_stop(struct spi_dma *sd)
+{
+	spi_dma_abort(sd->dma, sd->rx_stream);
+	spi_dma_abort(sd->dma, sd->tx_stream);
+	spi_disable_tx_dma(sd->spi);
+	spi_disable_rx_dma(sd->spi);
+	sd->busy = false;
+}
+
+static void spi_dma_finish(struct spi_dma *sd, bool error)
+{
+	if (!sd->busy) {
+		return;
+	}
+	spi_dma_stop(sd);
+	if (sd->callback) {
+		sd->callback(sd, error);
+	}
+}
+
+#ifdef DMA_SxCR_EN
+static void spi_dma_event(uint32_t dma, uint8_t stream, uint32_t flags,
+			  void *user)
+{
+	struct spi_dma *sd = user;
+
+	(void)dma;
+
+	if (flags & (DMA_TEIF | DMA_DMEIF)) {
+		spi_dma_finish(sd, true);
+	} else if ((flags & DMA_TCIF) && stream == sd->rx_stream) {
+		spi_dma_finish(sd, false);
+	}
+}
+#endif
+
+static int spi_dma_start(struct spi_dma *sd, uint8_t stream, uint8_t channel,
+			 bool to_spi, uint32_t mem, bool minc, uint16_t frames,
+			 bool wide)
+{
+#ifdef DMA_SxCR_EN
+	struct dma_transfer xfer = {
+		.count = frames,
+		.cr = DMA_SxCR_CHSEL(channel) |
+		      (wide ? DMA_SxCR_PSIZE_16BIT | DMA_SxCR_MSIZE_16BIT :
+			      DMA_SxCR_PSIZE_8BIT | DMA_SxCR_MSIZE_8BIT) |
+		      (minc ? DMA_SxCR_MINC : 0) |
+		      (to_spi ?
+		       DMA_SxCR_DIR_MEM_TO_PERIPHERAL | DMA_SxCR_PL_HIGH :
+		       DMA_SxCR_DIR_PERIPHERAL_TO_MEM | DMA_SxCR_PL_VERY_HIGH),
+		.callback = spi_dma_event,
+		.user = sd,
+	};
+
+	if (to_spi) {
+		xfer.src = mem;
+		xfer.dst = (uint32_t) &SPI_DR(sd->spi);
+	} else {
+		xfer.src = (uint32_t) &SPI_DR(sd->spi);
+		xfer.dst = mem;
+	}
+	return dma_transfer_submit(sd->dma, stream, &xfer);
+#else
+	uint32_t ccr = DMA_CCR_TEIE;
+
+	(void)channel;
+
+	if (DMA_CCR(sd->dma, stream) & DMA_CCR_EN) {
+		return -1;
+	}
+	ccr |= wide ? DMA_CCR_PSIZE_16BIT | DMA_CCR_MSIZE_16BIT :
+		      DMA_CCR_PSIZE_8BIT | DMA_CCR_MSIZE_8BIT;
+	ccr |= minc ? DMA_CCR_MINC : 0;
+	ccr |= to_spi ? DMA_CCR_DIR | DMA_CCR_PL_HIGH :
+			DMA_CCR_TCIE | DMA_CCR_PL_VERY_HIGH;
+
+	dma_clear_interrupt_flags(sd->dma, stream, DMA_FLAGS);
+	DMA_CPAR(sd->dma, stream) = (uint32_t) &SPI_DR(sd->spi);
+	DMA_CMAR(sd->dma, stream) = mem;
+	DMA_CNDTR(sd->dma, stream) = frames;
+	DMA_CCR(sd->dma, stream) = ccr;
+	DMA_CCR(sd->dma, stream) = ccr | DMA_CCR_EN;
+	return 0;
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief SPI Full Duplex Bulk Transfer
+
+Clocks @p frames frames out of @p tx while storing the frames clocked in to
+@p rx. Either buffer may be NULL: a write-only transfer discards what is
+received and a read-only transfer sends all ones. The frame size, 8 or 16 bit,
+is taken from the SPI configuration and sets the element size of the
+buffers.
+
+Transfers of at least @c cpu_threshold frames run on the DMA. The receive
+stream/channel is started before the transmit one and always runs, so the
+receiver can never overrun, and the transfer ends when the last frame has been
+received, which is also when the bus goes idle. The RX and TX DMA interrupt
+handlers must call @ref spi_dma_isr (or, on f2/f4/f7, @ref dma_transfer_isr).
+
+Shorter transfers, where setting up the DMA costs more than it saves, are
+done by the CPU before the call returns. The callback is run in both cases.
+
+The SPI must be configured as master and enabled. Buffers must stay valid
+until the callback.
+
+@param[in] sd SPI and DMA description.
+@param[in] tx Frames to send, or NULL.
+@param[in] rx Buffer for the received frames, or NULL.
+@param[in] frames Number of frames.
+@returns int. 0 if the transfer was started or done, -1 if @p frames is 0 or
+a transfer is already running.
+*/
+int spi_transfer_dma(struct spi_dma *sd, const void *tx, void *rx,
+		     uint16_t frames)
+{
+	bool wide = spi_dma_wide(sd->spi);
+
+	if (!frames || sd->busy) {
+		return -1;
+	}
+
+	/* Drop anything left over from frame-by-frame use and the overrun it
+	 * may have caused, which would stop the receive requests.
+	 */
+	while (SPI_SR(sd->spi) & SPI_SR_RXNE) {
+		(void)SPI_DR(sd->spi);
+	}
+	(void)SPI_SR(sd->spi);
+#ifdef SPI_CR2_FRXTH
+	if (wide) {
+		spi_fifo_reception_threshold_16bit(sd->spi);
+	} else {
+		spi_fifo_reception_threshold_8bit(sd->spi);
+	}
+#endif
+
+	if (frames < sd->cpu_threshold) {
+		spi_cpu_transfer(sd->spi, tx, rx, frames, wide);
+		if (sd->callback) {
+			sd->callback(sd, false);
+		}
+		return 0;
+	}
+
+	sd->busy = true;
+	sd->dummy = 0xffff;
+	if (spi_dma_start(sd, sd->rx_stream, sd->rx_channel, false,
+			  rx ? (uint32_t) rx : (uint32_t) &sd->dummy,
+			  rx != NULL, frames, wide) < 0) {
+		sd->busy = false;
+		return -1;
+	}
+	if (spi_dma_start(sd, sd->tx_stream, sd->tx_channel, true,
+			  tx ? (uint32_t) tx : (uint32_t) &sd->dummy,
+			  tx != NULL, frames, wide) < 0) {
+		spi_dma_abort(sd->dma, sd->rx_stream);
+		sd->busy = false;
+		return -1;
+	}
+	spi_enable_rx_dma(sd->spi);
+	spi_enable_tx_dma(sd->spi);
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief SPI Check for a Running Bulk Transfer
+
+@param[in] sd SPI and DMA description.
+@returns bool. true until the callback of the current transfer has run.
+*/
+bool spi_dma_busy(const struct spi_dma *sd)
+{
+	return sd->busy;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief SPI Bulk Transfer Interrupt Handler
+
+Call from the interrupt handlers of both the receive and the transmit DMA
+stream or channel.
+
+@param[in] sd SPI and DMA description.
+*/
+void spi_dma_isr(struct spi_dma *sd)
+{
+	bool rx_done = dma_get_interrupt_flag(sd->dma, sd->rx_stream, DMA_TCIF);
+	bool error = dma_get_interrupt_flag(sd->dma, sd->rx_stream, DMA_TEIF) ||
+		     dma_get_interrupt_flag(sd->dma, sd->tx_stream, DMA_TEIF);
+
+	dma_clear_interrupt_flags(sd->dma, sd->rx_stream, DMA_TCIF | DMA_TEIF);
+	dma_clear_interrupt_flags(sd->dma, sd->tx_stream, DMA_TCIF | DMA_TEIF);
+
+	if (error || rx_done) {
+		spi_dma_finish(sd, error);
+	}
+}
+
+/**@}*/
@@ -30,6 +30,12 @@
 uint8_t st_usbfs_force_nak[8];
 struct _usbd_device st_usbfs_dev;
 
+/* Double-buffered IN endpoints with a packet queued behind the current one */
+static uint8_t st_usbfs_dbl_pending;
+
+/* Double-buffered OUT endpoints holding a buffer back while NAK is forced */
+static uint8_t st_usbfs_dbl_held;
+
 void st_usbfs_set_address(usbd_device *dev, uint8_t addr)
 {
 	(void)dev;
@@ -77,6 +83,78 @@ uint16_t st_usbfs_set_ep_rx_bufsize(usbd_device *dev, uint8_t ep, uint32_t size)
 	return realsize;
 }
 
+static bool st_usbfs_ep_is_dbl(uint8_t ep)
+{
+	uint16_t epreg = GET_REG(USB_EP_REG(ep));
+
+	return ((epreg & USB_EP_TYPE) == USB_EP_TYPE_ISO) ||
+	       ((epreg & (USB_EP_TYPE | USB_EP_KIND)) ==
+		(USB_EP_TYPE_BULK | USB_EP_KIND));
+}
+
+/*
+ * (Re)start the buffer ownership state machine of a double-buffered endpoint.
+ * Buffer 0 lives in the TX buffer descriptor and buffer 1 in the RX buffer
+ * descriptor, whatever the direction of the endpoint.
+ */
+static void st_usbfs_ep_dbl_reset(uint8_t ep, uint8_t dir)
+{
+	bool bulk = (GET_REG(USB_EP_REG(ep)) & USB_EP_TYPE) == USB_EP_TYPE_BULK;
+
+	USB_CLR_EP_TX_DTOG(ep);
+	USB_CLR_EP_RX_DTOG(ep);
+	st_usbfs_dbl_pending &= ~(1 << ep);
+	st_usbfs_dbl_held &= ~(1 << ep);
+
+	if (dir) {
+		USB_SET_EP_RX_STAT(ep, USB_EP_RX_STAT_DISABLED);
+		USB_SET_EP_TX_STAT(ep, USB_EP_TX_STAT_VALID);
+	} else {
+		/* Let the USB fill buffer 0 while the application owns 1. */
+		if (bulk) {
+			USB_TOG_EP_RX_SW_BUF(ep);
+		}
+		USB_SET_EP_TX_STAT(ep, USB_EP_TX_STAT_DISABLED);
+		USB_SET_EP_RX_STAT(ep, st_usbfs_force_nak[ep] ?
+				   USB_EP_RX_STAT_NAK : USB_EP_RX_STAT_VALID);
+	}
+}
+
+static void st_usbfs_ep_setup_dbl(usbd_device *dev, uint8_t addr,
+		uint8_t dir, uint16_t max_size,
+		usbd_endpoint_callback callback)
+{
+	uint16_t bufsize;
+
+	if ((GET_REG(USB_EP_REG(addr)) & USB_EP_TYPE) == USB_EP_TYPE_BULK) {
+		USB_SET_EP_DBL_BUF(addr);
+	}
+
+	if (dir) {
+		bufsize = (max_size + 1) & ~1;
+		USB_SET_EP_TX_COUNT(addr, 0);
+		USB_SET_EP_RX_COUNT(addr, 0);
+		if (callback) {
+			dev->user_callback_ctr[addr][USB_TRANSACTION_IN] =
+			    (void *)callback;
+		}
+	} else {
+		/* Both descriptors need the RX block size of the buffer. */
+		bufsize = st_usbfs_set_ep_rx_bufsize(dev, addr, max_size);
+		USB_SET_EP_TX_COUNT(addr, USB_GET_EP_RX_COUNT(addr) & ~0x3ff);
+		if (callback) {
+			dev->user_callback_ctr[addr][USB_TRANSACTION_OUT] =
+			    (void *)callback;
+		}
+	}
+
+	USB_SET_EP_TX_ADDR(addr, dev->pm_top);
+	USB_SET_EP_RX_ADDR(addr, dev->pm_top + bufsize);
+	dev->pm_top += 2 * bufsize;
+
+	st_usbfs_ep_dbl_reset(addr, dir);
+}
+
 void st_usbfs_ep_setup(usbd_device *dev, uint8_t addr, uint8_t type,
 		uint16_t max_size,
 		void (*callback) (usbd_device *usbd_dev,
@@ -90,12 +168,25 @@ void st_usbfs_ep_setup(usbd_device *dev, uint8_t addr, uint8_t type,
 		[USB_ENDPOINT_ATTR_INTERRUPT] = USB_EP_TYPE_INTERRUPT,
 	};
 	uint8_t dir = addr & 0x80;
+	bool dbl = type & USBD_EP_DOUBLEBUF;
 	addr &= 0x7f;
+	type &= USB_ENDPOINT_ATTR_TYPE;
 
 	/* Assign address. */
 	USB_SET_EP_ADDR(addr, addr);
 	USB_SET_EP_TYPE(addr, typelookup[type]);
 
+	/* Isochronous endpoints are always double-buffered by the hardware. */
+	if (type == USB_ENDPOINT_ATTR_ISOCHRONOUS ||
+	    (dbl && type == USB_ENDPOINT_ATTR_BULK)) {
+		st_usbfs_ep_setup_dbl(dev, addr, dir, max_size, callback);
+		return;
+	}
+
+	if (type == USB_ENDPOINT_ATTR_BULK) {
+		USB_CLR_EP_DBL_BUF(addr);
+	}
+
 	if (dir || (addr == 0)) {
 		USB_SET_EP_TX_ADDR(addr, dev->pm_top);
 		if (callback) {
@@ -130,6 +221,8 @@ void st_usbfs_endpoints_reset(usbd_device *dev)
 		USB_SET_EP_TX_STAT(i, USB_EP_TX_STAT_DISABLED);
 		USB_SET_EP_RX_STAT(i, USB_EP_RX_STAT_DISABLED);
 	}
+	st_usbfs_dbl_pending = 0;
+	st_usbfs_dbl_held = 0;
 	dev->pm_top = USBD_PM_TOP + (2 * dev->desc->bMaxPacketSize0);
 }
 
@@ -137,6 +230,12 @@ void st_usbfs_ep_stall_set(usbd_device *dev, uint8_t addr,
 				   uint8_t stall)
 {
 	(void)dev;
+	if (!stall && (addr & 0x7F) && st_usbfs_ep_is_dbl(addr & 0x7F)) {
+		/* Clearing the stall restarts from DATA0 and buffer 0. */
+		st_usbfs_ep_dbl_reset(addr & 0x7F, addr & 0x80);
+		return;
+	}
+
 	if (addr == 0) {
 		USB_SET_EP_TX_STAT(addr, stall ? USB_EP_TX_STAT_STALL :
 				   USB_EP_TX_STAT_NAK);
@@ -193,16 +292,69 @@ void st_usbfs_ep_nak_set(usbd_device *dev, uint8_t addr, uint8_t nak)
 	if (nak) {
 		USB_SET_EP_RX_STAT(addr, USB_EP_RX_STAT_NAK);
 	} else {
+		if (st_usbfs_dbl_held & (1 << addr)) {
+			/* Hand back the buffer the last read kept. */
+			st_usbfs_dbl_held &= ~(1 << addr);
+			USB_TOG_EP_RX_SW_BUF(addr);
+		}
 		USB_SET_EP_RX_STAT(addr, USB_EP_RX_STAT_VALID);
 	}
 }
 
+static void st_usbfs_dbl_copy_to_pm(uint8_t ep, bool n, const void *buf,
+				    uint16_t len)
+{
+	if (n) {
+		st_usbfs_copy_to_pm(USB_GET_EP_RX_BUFF(ep), buf, len);
+		USB_SET_EP_RX_COUNT(ep, len);
+	} else {
+		st_usbfs_copy_to_pm(USB_GET_EP_TX_BUFF(ep), buf, len);
+		USB_SET_EP_TX_COUNT(ep, len);
+	}
+}
+
+static uint16_t st_usbfs_ep_write_packet_dbl(uint8_t addr, const void *buf,
+					     uint16_t len)
+{
+	uint16_t epreg = GET_REG(USB_EP_REG(addr));
+	bool sw_buf;
+
+	if ((epreg & USB_EP_TYPE) == USB_EP_TYPE_ISO) {
+		/* The USB sends buffer DTOG, we own the other one. */
+		st_usbfs_dbl_copy_to_pm(addr, !(epreg & USB_EP_TX_DTOG),
+					buf, len);
+		return len;
+	}
+
+	/* Only one packet may wait behind the one being sent. */
+	if (st_usbfs_dbl_pending & (1 << addr)) {
+		return 0;
+	}
+
+	sw_buf = epreg & USB_EP_TX_SW_BUF;
+	st_usbfs_dbl_copy_to_pm(addr, sw_buf, buf, len);
+
+	if (!(epreg & USB_EP_TX_DTOG) == !sw_buf) {
+		/* The USB is idle, hand the buffer over straight away. */
+		USB_TOG_EP_TX_SW_BUF(addr);
+	} else {
+		/* Handed over by st_usbfs_poll() once the current one is sent. */
+		st_usbfs_dbl_pending |= 1 << addr;
+	}
+
+	return len;
+}
+
 uint16_t st_usbfs_ep_write_packet(usbd_device *dev, uint8_t addr,
 				     const void *buf, uint16_t len)
 {
 	(void)dev;
 	addr &= 0x7F;
 
+	if (st_usbfs_ep_is_dbl(addr)) {
+		return st_usbfs_ep_write_packet_dbl(addr, buf, len);
+	}
+
 	if ((*USB_EP_REG(addr) & USB_EP_TX_STAT) == USB_EP_TX_STAT_VALID) {
 		return 0;
 	}
@@ -214,10 +366,57 @@ uint16_t st_usbfs_ep_write_packet(usbd_device *dev, uint8_t addr,
 	return len;
 }
 
+static uint16_t st_usbfs_ep_read_packet_dbl(uint8_t addr, void *buf,
+					    uint16_t len)
+{
+	uint16_t epreg = GET_REG(USB_EP_REG(addr));
+	bool n;
+
+	if ((epreg & USB_EP_TYPE) == USB_EP_TYPE_ISO) {
+		if (!(epreg & USB_EP_RX_CTR)) {
+			return 0;
+		}
+		/* The USB has already moved on to the other buffer. */
+		n = !(epreg & USB_EP_RX_DTOG);
+		USB_CLR_EP_RX_CTR(addr);
+	} else {
+		/* A buffer is only full when the USB waits for us to free one. */
+		if ((st_usbfs_dbl_held & (1 << addr)) ||
+		    !(epreg & USB_EP_RX_DTOG) != !(epreg & USB_EP_RX_SW_BUF)) {
+			return 0;
+		}
+		n = !(epreg & USB_EP_RX_SW_BUF);
+		USB_CLR_EP_RX_CTR(addr);
+		/*
+		 * Take the full buffer and let the USB fill the other one,
+		 * unless NAK is forced: then keep it until that is cleared.
+		 */
+		if (st_usbfs_force_nak[addr]) {
+			st_usbfs_dbl_held |= 1 << addr;
+		} else {
+			USB_TOG_EP_RX_SW_BUF(addr);
+		}
+	}
+
+	if (n) {
+		len = MIN(USB_GET_EP_RX_COUNT(addr) & 0x3ff, len);
+		st_usbfs_copy_from_pm(buf, USB_GET_EP_RX_BUFF(addr), len);
+	} else {
+		len = MIN(USB_GET_EP_TX_COUNT(addr) & 0x3ff, len);
+		st_usbfs_copy_from_pm(buf, USB_GET_EP_TX_BUFF(addr), len);
+	}
+
+	return len;
+}
+
 uint16_t st_usbfs_ep_read_packet(usbd_device *dev, uint8_t addr,
 					 void *buf, uint16_t len)
 {
 	(void)dev;
+	if (st_usbfs_ep_is_dbl(addr)) {
+		return st_usbfs_ep_read_packet_dbl(addr, buf, len);
+	}
+
 	if ((*USB_EP_REG(addr) & USB_EP_RX_STAT) == USB_EP_RX_STAT_VALID) {
 		return 0;
 	}
@@ -233,39 +432,67 @@ uint16_t st_usbfs_ep_read_packet(usbd_device *dev, uint8_t addr,
 	return len;
 }
 
+static void st_usbfs_handle_ctr(usbd_device *dev, uint16_t istr)
+{
+	uint8_t ep = istr & USB_ISTR_EP_ID;
+	uint8_t type;
+
+	if (istr & USB_ISTR_DIR) {
+		/* OUT or SETUP? */
+		if (*USB_EP_REG(ep) & USB_EP_SETUP) {
+			type = USB_TRANSACTION_SETUP;
+			st_usbfs_ep_read_packet(dev, ep, &dev->control_state.req, 8);
+		} else {
+			type = USB_TRANSACTION_OUT;
+		}
+	} else {
+		type = USB_TRANSACTION_IN;
+		USB_CLR_EP_TX_CTR(ep);
+		if (st_usbfs_dbl_pending & (1 << ep)) {
+			/* Release the packet queued behind this one. */
+			st_usbfs_dbl_pending &= ~(1 << ep);
+			USB_TOG_EP_TX_SW_BUF(ep);
+		}
+	}
+
+	if (dev->user_callback_ctr[ep][type]) {
+		dev->user_callback_ctr[ep][type] (dev, ep);
+	} else {
+		USB_CLR_EP_RX_CTR(ep);
+	}
+}
+
 void st_usbfs_poll(usbd_device *dev)
 {
 	uint16_t istr = *USB_ISTR_REG;
+	uint16_t handled = 0;
+	uint16_t bit;
 
 	if (istr & USB_ISTR_RESET) {
 		USB_CLR_ISTR_RESET();
 		dev->pm_top = USBD_PM_TOP;
+		st_usbfs_dbl_pending = 0;
+		st_usbfs_dbl_held = 0;
 		_usbd_reset(dev);
 		return;
 	}
 
-	if (istr & USB_ISTR_CTR) {
-		uint8_t ep = istr & USB_ISTR_EP_ID;
-		uint8_t type;
-
-		if (istr & USB_ISTR_DIR) {
-			/* OUT or SETUP? */
-			if (*USB_EP_REG(ep) & USB_EP_SETUP) {
-				type = USB_TRANSACTION_SETUP;
-				st_usbfs_ep_read_packet(dev, ep, &dev->control_state.req, 8);
-			} else {
-				type = USB_TRANSACTION_OUT;
-			}
-		} else {
-			type = USB_TRANSACTION_IN;
-			USB_CLR_EP_TX_CTR(ep);
-		}
-
-		if (dev->user_callback_ctr[ep][type]) {
-			dev->user_callback_ctr[ep][type] (dev, ep);
-		} else {
-			USB_CLR_EP_RX_CTR(ep);
+	/*
+	 * ISTR always reports the highest priority pending CTR, so keep
+	 * handling them until none is left or the budget is spent. A
+	 * callback may leave CTR set, so each endpoint direction is only
+	 * handled once per call.
+	 */
+	while ((istr & USB_ISTR_CTR) && dev->poll_events < dev->poll_budget) {
+		bit = 1 << ((istr & USB_ISTR_EP_ID) +
+			    ((istr & USB_ISTR_DIR) ? 8 : 0));
+		if (handled & bit) {
+			break;
 		}
+		handled |= bit;
+		st_usbfs_handle_ctr(dev, istr);
+		dev->poll_events++;
+		istr = *USB_ISTR_REG;
 	}
 
 	if (istr & USB_ISTR_SUSP) {
@@ -295,3 +522,10 @@ void st_usbfs_poll(usbd_device *dev)
 		*USB_CNTR_REG &= ~USB_CNTR_SOFM;
 	}
 }
+
+uint16_t st_usbfs_get_frame_number(usbd_device *dev)
+{
+	(void)dev;
+
+	return *USB_FNR_REG & USB_FNR_FN;
+}
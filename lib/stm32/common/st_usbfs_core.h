@@ -49,6 +49,7 @@ uint16_t st_usbfs_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
 uint16_t st_usbfs_ep_read_packet(usbd_device *usbd_dev, uint8_t addr,
 				 void *buf, uint16_t len);
 void st_usbfs_poll(usbd_device *usbd_dev);
+uint16_t st_usbfs_get_frame_number(usbd_device *usbd_dev);
 
 /* These must be implemented by the device specific driver */
 
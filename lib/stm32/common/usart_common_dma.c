@@ -0,0 +1,353 @@
+/** @addtogroup usart_file
+@ingroup peripheral_apis
+
+ */
+
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**@{*/
+
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/stm32/usart.h>
+#include <libopencm3/stm32/dma.h>
+
+/* The v1 block has one data register, the v2 block split receive and
+ * transmit data and gained a flag clear register.
+ */
+#ifdef USART_ISR
+#define USART_RX_DATA(usart)		USART_RDR(usart)
+#define USART_TX_DATA(usart)		USART_TDR(usart)
+#else
+#define USART_RX_DATA(usart)		USART_DR(usart)
+#define USART_TX_DATA(usart)		USART_DR(usart)
+#endif
+
+/* Hand everything between the last read position and the DMA write position
+ * to the callback, in two pieces if it wraps.
+ */
+static void usart_rx_drain(struct usart_rx *rx, bool idle)
+{
+	uint16_t head = rx->size - dma_get_number_of_data(rx->dma, rx->stream);
+	uint16_t tail = rx->tail;
+
+	if (head >= rx->size) {
+		head = 0;
+	}
+	if (head == tail) {
+		return;
+	}
+	rx->tail = head;
+
+	if (!rx->callback) {
+		return;
+	}
+	if (head > tail) {
+		rx->callback(rx, rx->buffer + tail, head - tail, idle);
+	} else {
+		rx->callback(rx, rx->buffer + tail, rx->size - tail,
+			     idle && !head);
+		if (head) {
+			rx->callback(rx, rx->buffer, head, idle);
+		}
+	}
+}
+
+#ifdef DMA_SxCR_EN
+static void usart_rx_dma(uint32_t dma, uint8_t stream, uint32_t flags,
+			 void *user)
+{
+	(void)dma;
+	(void)stream;
+	(void)flags;
+
+	usart_rx_drain(user, false);
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+/** @brief USART Start the DMA Receive Engine
+
+The receiver runs a circular DMA transfer into the ring buffer and never
+takes a per-byte interrupt. Data is handed to the callback when the line goes
+idle, which delimits frames, and at every half and full buffer, so that a
+continuous stream is delivered before the DMA can wrap round onto it.
+
+The USART must be configured for 8 bit frames and enabled, and the USART and
+DMA interrupts must both call @ref usart_rx_isr and be at the same priority.
+On f2/f4/f7 the DMA interrupt may instead call @ref dma_transfer_isr.
+
+@param[in] rx Receiver description, must stay valid until stopped.
+@returns int. 0 on success, -1 if the DMA stream or channel is busy.
+*/
+int usart_rx_start(struct usart_rx *rx)
+{
+#ifdef DMA_SxCR_EN
+	const struct dma_transfer xfer = {
+		.src = (uint32_t) &USART_RX_DATA(rx->usart),
+		.dst = (uint32_t) rx->buffer,
+		.count = rx->size,
+		.cr = DMA_SxCR_CHSEL(rx->dma_channel) |
+		      DMA_SxCR_DIR_PERIPHERAL_TO_MEM |
+		      DMA_SxCR_PSIZE_8BIT | DMA_SxCR_MSIZE_8BIT |
+		      DMA_SxCR_MINC | DMA_SxCR_CIRC | DMA_SxCR_HTIE |
+		      DMA_SxCR_PL_HIGH,
+		.callback = usart_rx_dma,
+		.user = rx,
+	};
+
+	rx->tail = 0;
+	if (dma_transfer_submit(rx->dma, rx->stream, &xfer) < 0) {
+		return -1;
+	}
+#else
+	if (DMA_CCR(rx->dma, rx->stream) & DMA_CCR_EN) {
+		return -1;
+	}
+	rx->tail = 0;
+	dma_clear_interrupt_flags(rx->dma, rx->stream, DMA_FLAGS);
+	DMA_CPAR(rx->dma, rx->stream) = (uint32_t) &USART_RX_DATA(rx->usart);
+	DMA_CMAR(rx->dma, rx->stream) = (uint32_t) rx->buffer;
+	DMA_CNDTR(rx->dma, rx->stream) = rx->size;
+	DMA_CCR(rx->dma, rx->stream) = DMA_CCR_PSIZE_8BIT |
+				       DMA_CCR_MSIZE_8BIT | DMA_CCR_MINC |
+				       DMA_CCR_CIRC | DMA_CCR_HTIE |
+				       DMA_CCR_TCIE | DMA_CCR_PL_HIGH;
+	DMA_CCR(rx->dma, rx->stream) |= DMA_CCR_EN;
+#endif
+
+	usart_enable_rx_dma(rx->usart);
+	usart_enable_idle_interrupt(rx->usart);
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief USART Stop the DMA Receive Engine
+
+Anything received but not yet delivered is dropped.
+
+@param[in] rx Receiver description.
+*/
+void usart_rx_stop(struct usart_rx *rx)
+{
+	usart_disable_idle_interrupt(rx->usart);
+	usart_disable_rx_dma(rx->usart);
+#ifdef DMA_SxCR_EN
+	dma_transfer_abort(rx->dma, rx->stream);
+#else
+	DMA_CCR(rx->dma, rx->stream) &= ~(DMA_CCR_EN | DMA_CCR_HTIE |
+					  DMA_CCR_TCIE);
+	dma_clear_interrupt_flags(rx->dma, rx->stream, DMA_FLAGS);
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief USART DMA Receive Engine Interrupt Handler
+
+Call from both the USART and the DMA interrupt handlers. Clears the idle line
+and DMA half/full flags and delivers what has arrived.
+
+@param[in] rx Receiver description.
+*/
+void usart_rx_isr(struct usart_rx *rx)
+{
+	bool idle = usart_get_flag(rx->usart, USART_FLAG_IDLE);
+
+	if (idle) {
+#ifdef USART_ISR
+		USART_ICR(rx->usart) = USART_ICR_IDLECF | USART_ICR_ORECF;
+#else
+		/* Cleared by a status read followed by a data read. */
+		(void)USART_DR(rx->usart);
+#endif
+	}
+	dma_clear_interrupt_flags(rx->dma, rx->stream, DMA_HTIF | DMA_TCIF);
+
+	usart_rx_drain(rx, idle);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Transmit queue. */
+
+static void usart_tx_complete(struct usart_tx *tx);
+
+#ifdef DMA_SxCR_EN
+static void usart_tx_dma(uint32_t dma, uint8_t stream, uint32_t flags,
+			 void *user)
+{
+	(void)dma;
+	(void)stream;
+
+	if (flags & (DMA_TCIF | DMA_TEIF)) {
+		usart_tx_complete(user);
+	}
+}
+#endif
+
+static int usart_tx_start_dma(struct usart_tx *tx, const uint8_t *data,
+			      uint16_t len)
+{
+#ifdef DMA_SxCR_EN
+	const struct dma_transfer xfer = {
+		.src = (uint32_t) data,
+		.dst = (uint32_t) &USART_TX_DATA(tx->usart),
+		.count = len,
+		.cr = DMA_SxCR_CHSEL(tx->dma_channel) |
+		      DMA_SxCR_DIR_MEM_TO_PERIPHERAL |
+		      DMA_SxCR_PSIZE_8BIT | DMA_SxCR_MSIZE_8BIT |
+		      DMA_SxCR_MINC | DMA_SxCR_PL_MEDIUM,
+		.callback = usart_tx_dma,
+		.user = tx,
+	};
+
+	return dma_transfer_submit(tx->dma, tx->stream, &xfer);
+#else
+	/* The channel stays enabled after completing. */
+	DMA_CCR(tx->dma, tx->stream) = 0;
+	dma_clear_interrupt_flags(tx->dma, tx->stream, DMA_FLAGS);
+	DMA_CPAR(tx->dma, tx->stream) = (uint32_t) &USART_TX_DATA(tx->usart);
+	DMA_CMAR(tx->dma, tx->stream) = (uint32_t) data;
+	DMA_CNDTR(tx->dma, tx->stream) = len;
+	DMA_CCR(tx->dma, tx->stream) = DMA_CCR_DIR | DMA_CCR_PSIZE_8BIT |
+				       DMA_CCR_MSIZE_8BIT | DMA_CCR_MINC |
+				       DMA_CCR_TCIE | DMA_CCR_TEIE |
+				       DMA_CCR_PL_MEDIUM;
+	DMA_CCR(tx->dma, tx->stream) |= DMA_CCR_EN;
+	return 0;
+#endif
+}
+
+/* Start the oldest queued buffer if the DMA is idle. Called from the DMA
+ * interrupt or with interrupts masked. Returns -1 if the DMA refused it.
+ */
+static int usart_tx_kick(struct usart_tx *tx)
+{
+	if (tx->active || tx->head == tx->tail) {
+		return 0;
+	}
+	tx->active = true;
+	if (usart_tx_start_dma(tx,
+			       tx->queue[tx->tail % USART_TX_QUEUE_SIZE].data,
+			       tx->queue[tx->tail % USART_TX_QUEUE_SIZE].len)) {
+		tx->active = false;
+		return -1;
+	}
+	return 0;
+}
+
+static void usart_tx_complete(struct usart_tx *tx)
+{
+	const uint8_t *data = tx->queue[tx->tail % USART_TX_QUEUE_SIZE].data;
+	uint16_t len = tx->queue[tx->tail % USART_TX_QUEUE_SIZE].len;
+
+	tx->tail++;
+	tx->active = false;
+	usart_tx_kick(tx);
+
+	if (tx->callback) {
+		tx->callback(tx, data, len);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief USART Initialise a Transmit Queue
+
+The queue hands each buffer to the DMA in turn and reports it back through
+the callback once the last byte has been written to the USART, so nothing in
+the caller waits on the line. The USART must be configured and enabled, and
+the DMA interrupt handler must call @ref usart_tx_isr (or, on f2/f4/f7,
+@ref dma_transfer_isr).
+
+@param[in] tx Queue, must stay valid while in use.
+*/
+void usart_tx_init(struct usart_tx *tx)
+{
+	tx->head = 0;
+	tx->tail = 0;
+	tx->active = false;
+	usart_enable_tx_dma(tx->usart);
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief USART Queue a Buffer for Transmission
+
+The buffer is not copied and must not be changed until the callback returns
+it. May be called from the callback to keep the queue fed. Buffers left
+queued by a failed start are retried by the next call.
+
+@param[in] tx Queue.
+@param[in] data Bytes to send.
+@param[in] len Number of bytes, 1 to 65535.
+@returns int. 0 if queued, -1 if the queue is full, @p len is 0 or the DMA
+stream could not be started.
+*/
+int usart_tx_submit(struct usart_tx *tx, const uint8_t *data, uint16_t len)
+{
+	int ret = -1;
+
+	if (!len) {
+		return -1;
+	}
+	CM_ATOMIC_BLOCK() {
+		if ((uint8_t)(tx->head - tx->tail) < USART_TX_QUEUE_SIZE) {
+			tx->queue[tx->head % USART_TX_QUEUE_SIZE].data = data;
+			tx->queue[tx->head % USART_TX_QUEUE_SIZE].len = len;
+			tx->head++;
+			if (usart_tx_kick(tx)) {
+				/* Take the new buffer back, keep older ones. */
+				tx->head--;
+			} else {
+				ret = 0;
+			}
+		}
+	}
+	return ret;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief USART Check for Pending Transmissions
+
+@param[in] tx Queue.
+@returns bool. true while any queued buffer has not been completed.
+*/
+bool usart_tx_busy(const struct usart_tx *tx)
+{
+	return tx->head != tx->tail;
+}
+
+/*---------------------------------------------------------------------------*/
+/** @brief USART Transmit Queue Interrupt Handler
+
+Call from the DMA stream or channel interrupt handler.
+
+@param[in] tx Queue.
+*/
+void usart_tx_isr(struct usart_tx *tx)
+{
+	bool done = dma_get_interrupt_flag(tx->dma, tx->stream, DMA_TCIF) ||
+		    dma_get_interrupt_flag(tx->dma, tx->stream, DMA_TEIF);
+
+	if (!done) {
+		return;
+	}
+	dma_clear_interrupt_flags(tx->dma, tx->stream, DMA_TCIF | DMA_TEIF);
+	if (tx->active) {
+		usart_tx_complete(tx);
+	}
+}
+
+/**@}*/
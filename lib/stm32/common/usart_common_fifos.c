@@ -15,6 +15,7 @@
  * along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <libopencm3/cm3/cortex.h>
 #include <libopencm3/stm32/usart.h>
 
 void usart_enable_fifos(uint32_t usart) {
@@ -70,3 +71,71 @@ void usart_set_rx_fifo_threshold(uint32_t usart,
 		       ~(USART_FIFO_THRESH_MASK << USART_CR3_RXFTCFG_SHIFT);
 	USART_CR3(usart) = cr3 | (threshold << USART_CR3_RXFTCFG_SHIFT);
 }
+
+/* Transmit queue, fed from the TX FIFO threshold interrupt on parts without
+ * a DMA driver. The FIFOs must have been enabled before the USART, and the
+ * USART interrupt handler must call usart_tx_isr().
+ */
+
+static void usart_tx_kick(struct usart_tx *tx) {
+	if (tx->active || tx->head == tx->tail) {
+		return;
+	}
+	tx->active = true;
+	tx->pos = 0;
+	usart_enable_tx_fifo_threshold_interrupt(tx->usart);
+}
+
+void usart_tx_init(struct usart_tx *tx) {
+	tx->head = 0;
+	tx->tail = 0;
+	tx->active = false;
+	usart_set_tx_fifo_threshold(tx->usart, USART_FIFO_THRESH_HALF);
+}
+
+int usart_tx_submit(struct usart_tx *tx, const uint8_t *data, uint16_t len) {
+	int ret = -1;
+
+	if (!len) {
+		return -1;
+	}
+	CM_ATOMIC_BLOCK() {
+		if ((uint8_t)(tx->head - tx->tail) < USART_TX_QUEUE_SIZE) {
+			tx->queue[tx->head % USART_TX_QUEUE_SIZE].data = data;
+			tx->queue[tx->head % USART_TX_QUEUE_SIZE].len = len;
+			tx->head++;
+			usart_tx_kick(tx);
+			ret = 0;
+		}
+	}
+	return ret;
+}
+
+bool usart_tx_busy(const struct usart_tx *tx) {
+	return tx->head != tx->tail;
+}
+
+void usart_tx_isr(struct usart_tx *tx) {
+	/* With the FIFO enabled TXE reads as "TX FIFO not full". */
+	while (tx->active && (USART_ISR(tx->usart) & USART_ISR_TXE)) {
+		const uint8_t *data;
+		uint16_t len;
+
+		data = tx->queue[tx->tail % USART_TX_QUEUE_SIZE].data;
+		len = tx->queue[tx->tail % USART_TX_QUEUE_SIZE].len;
+		USART_TDR(tx->usart) = data[tx->pos++];
+		if (tx->pos < len) {
+			continue;
+		}
+
+		tx->tail++;
+		tx->active = false;
+		usart_tx_kick(tx);
+		if (tx->callback) {
+			tx->callback(tx, data, len);
+		}
+	}
+	if (!tx->active) {
+		usart_disable_tx_fifo_threshold_interrupt(tx->usart);
+	}
+}
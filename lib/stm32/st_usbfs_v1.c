@@ -38,6 +38,7 @@ const struct _usbd_driver st_usbfs_v1_usb_driver = {
 	.ep_write_packet = st_usbfs_ep_write_packet,
 	.ep_read_packet = st_usbfs_ep_read_packet,
 	.poll = st_usbfs_poll,
+	.get_frame_number = st_usbfs_get_frame_number,
 };
 
 /** Initialize the USB device controller hardware of the STM32. */
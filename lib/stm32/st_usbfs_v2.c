@@ -108,4 +108,5 @@ const struct _usbd_driver st_usbfs_v2_usb_driver = {
 	.ep_read_packet = st_usbfs_ep_read_packet,
 	.disconnect = st_usbfs_v2_disconnect,
 	.poll = st_usbfs_poll,
+	.get_frame_number = st_usbfs_get_frame_number,
 };
@@ -52,12 +52,18 @@ usbd_device *usbd_init(const usbd_driver *driver,
 	usbd_dev->driver = driver;
 	usbd_dev->desc = dev;
 	usbd_dev->config = conf;
+	usbd_dev->config_blobs = NULL;
 	usbd_dev->strings = strings;
 	usbd_dev->num_strings = num_strings;
 	usbd_dev->extra_string_idx = 0;
 	usbd_dev->extra_string = NULL;
 	usbd_dev->ctrl_buf = control_buffer;
 	usbd_dev->ctrl_buf_len = control_buffer_size;
+	usbd_dev->poll_budget = 1;
+	usbd_dev->poll_events = 0;
+#ifdef USBD_STATS
+	_usbd_stats_init();
+#endif
 
 	usbd_dev->user_callback_ctr[0][USB_TRANSACTION_SETUP] =
 	    _usbd_control_setup;
@@ -66,10 +72,15 @@ usbd_device *usbd_init(const usbd_driver *driver,
 	usbd_dev->user_callback_ctr[0][USB_TRANSACTION_IN] =
 	    _usbd_control_in;
 
+	_usbd_control_callbacks_reset(usbd_dev);
+
 	int i;
 	for (i = 0; i < MAX_USER_SET_CONFIG_CALLBACK; i++) {
 		usbd_dev->user_callback_set_config[i] = NULL;
 	}
+	for (i = 0; i < MAX_USBD_TRANSFER; i++) {
+		usbd_dev->transfer[i].addr = 0;
+	}
 
 	return usbd_dev;
 }
@@ -114,18 +125,38 @@ void _usbd_reset(usbd_device *usbd_dev)
 {
 	usbd_dev->current_address = 0;
 	usbd_dev->current_config = 0;
+	_usbd_transfer_reset(usbd_dev);
 	usbd_ep_setup(usbd_dev, 0, USB_ENDPOINT_ATTR_CONTROL, usbd_dev->desc->bMaxPacketSize0, NULL);
 	usbd_dev->driver->set_address(usbd_dev, 0);
+	USBD_STATS_EVENT(USBD_TRACE_RESET, 0, 0);
 
 	if (usbd_dev->user_callback_reset) {
 		usbd_dev->user_callback_reset();
 	}
 }
 
+void usbd_set_poll_budget(usbd_device *usbd_dev, uint8_t budget)
+{
+	usbd_dev->poll_budget = budget ? budget : 1;
+}
+
+uint8_t usbd_poll_event_count(usbd_device *usbd_dev)
+{
+	return usbd_dev->poll_events;
+}
+
 /* Functions to wrap the low-level driver */
 void usbd_poll(usbd_device *usbd_dev)
 {
+#ifdef USBD_STATS
+	uint32_t start = _usbd_stats_poll_begin();
+#endif
+
+	usbd_dev->poll_events = 0;
 	usbd_dev->driver->poll(usbd_dev);
+#ifdef USBD_STATS
+	_usbd_stats_poll_end(start);
+#endif
 }
 
 __attribute__((weak)) void usbd_disconnect(usbd_device *usbd_dev,
@@ -140,24 +171,189 @@ __attribute__((weak)) void usbd_disconnect(usbd_device *usbd_dev,
 void usbd_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
 		   uint16_t max_size, usbd_endpoint_callback callback)
 {
+	usbd_dev->ep_max_size[addr & (MAX_USBD_ENDPOINT - 1)]
+			     [!!(addr & 0x80)] = max_size;
 	usbd_dev->driver->ep_setup(usbd_dev, addr, type, max_size, callback);
 }
 
 uint16_t usbd_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
 			 const void *buf, uint16_t len)
 {
-	return usbd_dev->driver->ep_write_packet(usbd_dev, addr, buf, len);
+	uint16_t ret = usbd_dev->driver->ep_write_packet(usbd_dev, addr, buf,
+							 len);
+
+	USBD_STATS_EVENT(ret || !len ? USBD_TRACE_IN : USBD_TRACE_BUSY,
+			 addr | 0x80, len);
+	return ret;
 }
 
 uint16_t usbd_ep_read_packet(usbd_device *usbd_dev, uint8_t addr, void *buf,
 			     uint16_t len)
 {
-	return usbd_dev->driver->ep_read_packet(usbd_dev, addr, buf, len);
+	uint16_t ret = usbd_dev->driver->ep_read_packet(usbd_dev, addr, buf,
+							len);
+
+	USBD_STATS_EVENT(USBD_TRACE_OUT, addr, ret);
+	return ret;
+}
+
+struct usbd_transfer *_usbd_transfer_find(usbd_device *usbd_dev, uint8_t addr)
+{
+	int i;
+
+	for (i = 0; i < MAX_USBD_TRANSFER; i++) {
+		if (usbd_dev->transfer[i].addr == addr) {
+			return &usbd_dev->transfer[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void usbd_transfer_release(usbd_device *usbd_dev,
+				  struct usbd_transfer *xfer)
+{
+	if (!usbd_dev->driver->ep_transfer) {
+		usbd_dev->user_callback_ctr[xfer->addr & 0x7f]
+			[(xfer->addr & 0x80) ? USB_TRANSACTION_IN :
+			 USB_TRANSACTION_OUT] = xfer->saved_cb;
+	}
+	xfer->addr = 0;
+}
+
+void _usbd_transfer_complete(usbd_device *usbd_dev,
+			     struct usbd_transfer *xfer)
+{
+	usbd_transfer_callback complete = xfer->complete;
+	uint8_t addr = xfer->addr;
+	uint32_t done = xfer->done;
+
+	USBD_STATS_EVENT(USBD_TRACE_TRANSFER, addr, done);
+
+	/* Free the slot first, so the callback can queue the next one. */
+	usbd_transfer_release(usbd_dev, xfer);
+
+	if (complete) {
+		complete(usbd_dev, addr, done);
+	}
+}
+
+/* Drop all transfers, their owners reset themselves in set config. */
+void _usbd_transfer_reset(usbd_device *usbd_dev)
+{
+	int i;
+
+	for (i = 0; i < MAX_USBD_TRANSFER; i++) {
+		if (usbd_dev->transfer[i].addr) {
+			usbd_transfer_release(usbd_dev, &usbd_dev->transfer[i]);
+		}
+	}
+}
+
+/* Packet by packet transfer emulation for drivers without ep_transfer */
+static void usbd_transfer_in(usbd_device *usbd_dev, uint8_t ep)
+{
+	struct usbd_transfer *xfer = _usbd_transfer_find(usbd_dev, ep | 0x80);
+
+	if (!xfer) {
+		return;
+	}
+
+	xfer->done += xfer->chunk;
+	if (xfer->done < xfer->len ||
+	    (xfer->zlp && xfer->chunk == xfer->max_size)) {
+		xfer->chunk = MIN(xfer->len - xfer->done, xfer->max_size);
+		usbd_ep_write_packet(usbd_dev, ep, xfer->buf + xfer->done,
+				     xfer->chunk);
+		return;
+	}
+
+	_usbd_transfer_complete(usbd_dev, xfer);
+}
+
+static void usbd_transfer_out(usbd_device *usbd_dev, uint8_t ep)
+{
+	struct usbd_transfer *xfer = _usbd_transfer_find(usbd_dev, ep);
+
+	if (!xfer) {
+		return;
+	}
+
+	xfer->chunk = usbd_ep_read_packet(usbd_dev, ep, xfer->buf + xfer->done,
+			MIN(xfer->len - xfer->done, xfer->max_size));
+	xfer->done += xfer->chunk;
+
+	if (xfer->chunk < xfer->max_size || xfer->done >= xfer->len) {
+		_usbd_transfer_complete(usbd_dev, xfer);
+	}
+}
+
+int usbd_ep_transfer(usbd_device *usbd_dev, uint8_t addr, void *buf,
+		     uint32_t len, bool zlp, usbd_transfer_callback callback)
+{
+	struct usbd_transfer *xfer;
+	uint8_t ep = addr & 0x7f;
+	uint8_t type = (addr & 0x80) ? USB_TRANSACTION_IN : USB_TRANSACTION_OUT;
+
+	if (ep == 0 || ep >= MAX_USBD_ENDPOINT ||
+	    _usbd_transfer_find(usbd_dev, addr)) {
+		return -1;
+	}
+
+	xfer = _usbd_transfer_find(usbd_dev, 0);
+	if (!xfer) {
+		return -1;
+	}
+
+	xfer->addr = addr;
+	xfer->max_size = usbd_dev->ep_max_size[ep][!!(addr & 0x80)];
+	xfer->zlp = zlp && (addr & 0x80) && len && xfer->max_size &&
+		!(len % xfer->max_size);
+	xfer->chunk = xfer->max_size;
+	xfer->buf = buf;
+	xfer->len = len;
+	xfer->done = 0;
+	xfer->complete = callback;
+
+	if (usbd_dev->driver->ep_transfer) {
+		if (usbd_dev->driver->ep_transfer(usbd_dev, xfer) < 0) {
+			xfer->addr = 0;
+			return -1;
+		}
+		return 0;
+	}
+
+	xfer->saved_cb = usbd_dev->user_callback_ctr[ep][type];
+	usbd_dev->user_callback_ctr[ep][type] = (type == USB_TRANSACTION_IN) ?
+		usbd_transfer_in : usbd_transfer_out;
+
+	if (type == USB_TRANSACTION_IN) {
+		xfer->chunk = MIN(len, xfer->max_size);
+		if (usbd_ep_write_packet(usbd_dev, ep, buf, xfer->chunk) !=
+		    xfer->chunk) {
+			usbd_transfer_release(usbd_dev, xfer);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+uint16_t usbd_get_frame_number(usbd_device *usbd_dev)
+{
+	if (usbd_dev->driver->get_frame_number) {
+		return usbd_dev->driver->get_frame_number(usbd_dev);
+	}
+
+	return 0;
 }
 
 void usbd_ep_stall_set(usbd_device *usbd_dev, uint8_t addr, uint8_t stall)
 {
 	usbd_dev->driver->ep_stall_set(usbd_dev, addr, stall);
+	if (stall) {
+		USBD_STATS_EVENT(USBD_TRACE_STALL, addr, 0);
+	}
 }
 
 uint8_t usbd_ep_stall_get(usbd_device *usbd_dev, uint8_t addr)
@@ -168,6 +364,9 @@ uint8_t usbd_ep_stall_get(usbd_device *usbd_dev, uint8_t addr)
 void usbd_ep_nak_set(usbd_device *usbd_dev, uint8_t addr, uint8_t nak)
 {
 	usbd_dev->driver->ep_nak_set(usbd_dev, addr, nak);
+	if (nak) {
+		USBD_STATS_EVENT(USBD_TRACE_NAK, addr, 0);
+	}
 }
 
 /**@}*/
@@ -1,3 +1,12 @@
+/** @defgroup usb_audio_file USB Audio helpers
+
+@ingroup USB
+
+@brief <b>Helpers for USB Audio class devices</b>
+
+LGPL License Terms @ref lgpl_license
+*/
+
 /*
  * This file is part of the libopencm3 project.
  *
@@ -15,6 +24,82 @@
  * along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/**@{*/
+
 #include <libopencm3/usb/audio.h>
 
-/* This stub exists just to trick doxygen. */
+static uint8_t feedback_frac_bits(const struct usb_audio_feedback *fb)
+{
+	return fb->high_speed ? 16 : 14;
+}
+
+/** Initialise an explicit feedback generator
+ *
+ * The value starts out at the nominal rate, so the host has something
+ * sensible to work with before the first measurement period completes.
+ * @param fb feedback state
+ * @param rate_hz nominal sample rate
+ * @param period_log2 measurement period, in log2 (micro)frames
+ * @param high_speed true for 16.16 per microframe, false for 10.14 per frame
+ */
+void usb_audio_feedback_init(struct usb_audio_feedback *fb, uint32_t rate_hz,
+			     uint8_t period_log2, bool high_speed)
+{
+	fb->high_speed = high_speed;
+	fb->period_log2 = period_log2;
+	/* Keep both the frame counter and the final shift in range. */
+	if (fb->period_log2 > feedback_frac_bits(fb)) {
+		fb->period_log2 = feedback_frac_bits(fb);
+	}
+	if (fb->period_log2 > 15) {
+		fb->period_log2 = 15;
+	}
+	fb->samples = 0;
+	fb->frames = 0;
+
+	if (high_speed) {
+		fb->value = ((uint64_t)rate_hz << 16) / 8000;
+	} else {
+		fb->value = ((uint64_t)rate_hz << 14) / 1000;
+	}
+}
+
+/** Account one (micro)frame of samples
+ *
+ * Call from the SOF callback with the number of samples the audio clock
+ * moved since the previous SOF.
+ * @param fb feedback state
+ * @param samples samples consumed (or produced) during the last frame
+ */
+void usb_audio_feedback_sof(struct usb_audio_feedback *fb, uint32_t samples)
+{
+	fb->samples += samples;
+	if (++fb->frames < (1U << fb->period_log2)) {
+		return;
+	}
+
+	fb->value = fb->samples << (feedback_frac_bits(fb) - fb->period_log2);
+	fb->samples = 0;
+	fb->frames = 0;
+}
+
+/** Serialise the feedback value for the feedback endpoint
+ * @param fb feedback state
+ * @param buf at least 4 bytes
+ * @return number of bytes to send, 3 at full speed and 4 at high speed
+ */
+uint8_t usb_audio_feedback_pack(const struct usb_audio_feedback *fb,
+				uint8_t *buf)
+{
+	buf[0] = fb->value;
+	buf[1] = fb->value >> 8;
+	buf[2] = fb->value >> 16;
+	if (!fb->high_speed) {
+		return 3;
+	}
+
+	buf[3] = fb->value >> 24;
+	return 4;
+}
+
+/**@}*/
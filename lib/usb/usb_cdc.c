@@ -15,6 +15,465 @@
  * along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * CDC-ACM (virtual COM port) function.
+ *
+ * Received and transmitted data go through two single producer, single
+ * consumer rings. Each side only ever writes its own index, so the
+ * application can produce and consume from the main loop while the stack
+ * runs from the USB interrupt, without locking. Packets are read into and
+ * sent from the ring memory directly whenever they do not wrap around.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <libopencm3/usb/usbd.h>
 #include <libopencm3/usb/cdc.h>
+#include "usb_private.h"
+
+/* Order ring data accesses against the index update publishing them. */
+#define CDCACM_BARRIER()	__asm__ __volatile__("" : : : "memory")
+
+struct usb_cdcacm_ring {
+	uint8_t *buf;
+	uint16_t mask;
+	volatile uint16_t head;		/* Only written by the producer */
+	volatile uint16_t tail;		/* Only written by the consumer */
+};
+
+struct _usbd_cdcacm {
+	usbd_device *usbd_dev;
+	uint8_t comm_iface;
+	uint8_t ep_in;
+	uint8_t ep_out;
+	uint8_t ep_notif;
+	uint16_t max_packet;
+	bool configured;
+
+	struct usb_cdcacm_ring rx;
+	struct usb_cdcacm_ring tx;
+	volatile bool rx_blocked;	/* OUT endpoint NAKed, ring was full */
+	volatile bool tx_busy;		/* A packet is on the IN endpoint */
+	uint16_t tx_inflight;		/* Size of that packet */
+
+	struct usb_cdc_line_coding line_coding;
+	uint16_t line_state;
+	int (*line_coding_cb)(usbd_cdcacm *acm,
+			      const struct usb_cdc_line_coding *coding);
+	void (*line_state_cb)(usbd_cdcacm *acm, uint16_t state);
+
+	/* Packets which wrap around the end of the RX ring land here first */
+	uint8_t bounce[USB_CDCACM_MAX_PACKET];
+	uint8_t notification[sizeof(struct usb_cdc_notification) + 2];
+};
+
+static usbd_cdcacm _cdcacm;
+
+static uint16_t ring_used(const struct usb_cdcacm_ring *r)
+{
+	return (uint16_t)(r->head - r->tail);
+}
+
+static uint16_t ring_free(const struct usb_cdcacm_ring *r)
+{
+	return r->mask + 1 - ring_used(r);
+}
+
+static void ring_init(struct usb_cdcacm_ring *r, uint8_t *buf, uint16_t size)
+{
+	r->buf = buf;
+	r->mask = size - 1;
+	r->head = 0;
+	r->tail = 0;
+}
+
+/* Start sending the oldest data of the TX ring, or a ZLP if @a zlp. */
+static void cdcacm_tx_kick(usbd_cdcacm *acm, bool zlp)
+{
+	struct usb_cdcacm_ring *r = &acm->tx;
+	uint16_t idx = r->tail & r->mask;
+	uint16_t len;
+
+	len = MIN(ring_used(r), acm->max_packet);
+	len = MIN(len, r->mask + 1 - idx);
+	if (!len && !zlp) {
+		return;
+	}
+
+	if (usbd_ep_write_packet(acm->usbd_dev, acm->ep_in,
+				 &r->buf[idx], len) != len) {
+		/* Endpoint still busy, its completion will pick it up. */
+		return;
+	}
+	acm->tx_inflight = len;
+	acm->tx_busy = true;
+}
+
+static void cdcacm_tx_cb(usbd_device *usbd_dev, uint8_t ep)
+{
+	usbd_cdcacm *acm = &_cdcacm;
+	uint16_t sent = acm->tx_inflight;
+
+	(void)usbd_dev;
+	(void)ep;
+
+	acm->tx.tail += sent;
+	acm->tx_inflight = 0;
+	acm->tx_busy = false;
+
+	/* Terminate a transfer ending on a full packet. */
+	cdcacm_tx_kick(acm, sent == acm->max_packet && !ring_used(&acm->tx));
+}
+
+static void cdcacm_rx_cb(usbd_device *usbd_dev, uint8_t ep)
+{
+	usbd_cdcacm *acm = &_cdcacm;
+	struct usb_cdcacm_ring *r = &acm->rx;
+	uint16_t idx = r->head & r->mask;
+	uint16_t contig = r->mask + 1 - idx;
+	uint16_t len;
+	uint16_t first;
+
+	if (contig >= acm->max_packet) {
+		len = usbd_ep_read_packet(usbd_dev, ep, &r->buf[idx],
+					  acm->max_packet);
+	} else {
+		len = usbd_ep_read_packet(usbd_dev, ep, acm->bounce,
+					  acm->max_packet);
+		first = MIN(len, contig);
+		memcpy(&r->buf[idx], acm->bounce, first);
+		memcpy(r->buf, &acm->bounce[first], len - first);
+	}
+	CDCACM_BARRIER();
+	r->head += len;
+
+	/* Hold off the host until the next packet is sure to fit. */
+	if (ring_free(r) < acm->max_packet) {
+		acm->rx_blocked = true;
+		usbd_ep_nak_set(usbd_dev, ep, 1);
+	}
+}
+
+static void cdcacm_rx_rearm(usbd_cdcacm *acm)
+{
+	if (acm->rx_blocked && ring_free(&acm->rx) >= acm->max_packet) {
+		acm->rx_blocked = false;
+		usbd_ep_nak_set(acm->usbd_dev, acm->ep_out, 0);
+	}
+}
+
+static enum usbd_request_return_codes cdcacm_control_request(
+	usbd_device *usbd_dev, struct usb_setup_data *req, uint8_t **buf,
+	uint16_t *len, usbd_control_complete_callback *complete)
+{
+	usbd_cdcacm *acm = &_cdcacm;
+	struct usb_cdc_line_coding coding;
+
+	(void)usbd_dev;
+	(void)complete;
+
+	if (req->wIndex != acm->comm_iface) {
+		return USBD_REQ_NEXT_CALLBACK;
+	}
+
+	switch (req->bRequest) {
+	case USB_CDC_REQ_SET_CONTROL_LINE_STATE:
+		acm->line_state = req->wValue;
+		if (acm->line_state_cb) {
+			acm->line_state_cb(acm, req->wValue);
+		}
+		return USBD_REQ_HANDLED;
+	case USB_CDC_REQ_SET_LINE_CODING:
+		if (*len < sizeof(coding)) {
+			return USBD_REQ_NOTSUPP;
+		}
+		memcpy(&coding, *buf, sizeof(coding));
+		if (acm->line_coding_cb && acm->line_coding_cb(acm, &coding)) {
+			return USBD_REQ_NOTSUPP;
+		}
+		acm->line_coding = coding;
+		return USBD_REQ_HANDLED;
+	case USB_CDC_REQ_GET_LINE_CODING:
+		*buf = (uint8_t *)&acm->line_coding;
+		*len = MIN(*len, sizeof(acm->line_coding));
+		return USBD_REQ_HANDLED;
+	}
+
+	return USBD_REQ_NEXT_CALLBACK;
+}
+
+static void cdcacm_set_config(usbd_device *usbd_dev, uint16_t wValue)
+{
+	usbd_cdcacm *acm = &_cdcacm;
+
+	(void)wValue;
+
+	usbd_ep_setup(usbd_dev, acm->ep_out, USB_ENDPOINT_ATTR_BULK,
+		      acm->max_packet, cdcacm_rx_cb);
+	usbd_ep_setup(usbd_dev, acm->ep_in, USB_ENDPOINT_ATTR_BULK,
+		      acm->max_packet, cdcacm_tx_cb);
+	if (acm->ep_notif) {
+		usbd_ep_setup(usbd_dev, acm->ep_notif,
+			      USB_ENDPOINT_ATTR_INTERRUPT,
+			      sizeof(acm->notification), NULL);
+	}
+
+	usbd_register_control_callback(
+				usbd_dev,
+				USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				cdcacm_control_request);
+
+	/* Anything still queued from an earlier session goes out now. */
+	acm->rx_blocked = false;
+	acm->tx_busy = false;
+	acm->tx_inflight = 0;
+	acm->configured = true;
+	if (ring_free(&acm->rx) < acm->max_packet) {
+		acm->rx_blocked = true;
+		usbd_ep_nak_set(usbd_dev, acm->ep_out, 1);
+	}
+	cdcacm_tx_kick(acm, false);
+}
+
+/** @addtogroup usb_cdc */
+/** @{ */
+
+/** @brief Initializes the CDC-ACM function.
+
+@note Only one CDC-ACM function can be active.
+
+@param[in] usbd_dev The USB device to add the function to.
+@param[in] comm_iface Number of the communication interface.
+@param[in] ep_in The bulk IN data endpoint.
+@param[in] ep_out The bulk OUT data endpoint.
+@param[in] ep_notif The interrupt notification endpoint, 0 if there is none.
+@param[in] max_packet Max packet size of the data endpoints, at most
+		USB_CDCACM_MAX_PACKET.
+@param[in] rx_buf Memory for received data.
+@param[in] rx_size Size of @a rx_buf, a power of two of at least two packets.
+@param[in] tx_buf Memory for data to transmit.
+@param[in] tx_size Size of @a tx_buf, a power of two.
+
+@return The CDC-ACM function, or NULL if the parameters are not usable.
+*/
+usbd_cdcacm *usb_cdcacm_init(usbd_device *usbd_dev, uint8_t comm_iface,
+			     uint8_t ep_in, uint8_t ep_out, uint8_t ep_notif,
+			     uint16_t max_packet,
+			     uint8_t *rx_buf, uint16_t rx_size,
+			     uint8_t *tx_buf, uint16_t tx_size)
+{
+	usbd_cdcacm *acm = &_cdcacm;
+
+	if (max_packet == 0 || max_packet > USB_CDCACM_MAX_PACKET ||
+	    rx_size < 2 * max_packet || (rx_size & (rx_size - 1)) ||
+	    tx_size == 0 || (tx_size & (tx_size - 1))) {
+		return NULL;
+	}
+
+	acm->usbd_dev = usbd_dev;
+	acm->comm_iface = comm_iface;
+	acm->ep_in = ep_in;
+	acm->ep_out = ep_out;
+	acm->ep_notif = ep_notif;
+	acm->max_packet = max_packet;
+	acm->configured = false;
+	ring_init(&acm->rx, rx_buf, rx_size);
+	ring_init(&acm->tx, tx_buf, tx_size);
+	acm->rx_blocked = false;
+	acm->tx_busy = false;
+	acm->tx_inflight = 0;
+
+	acm->line_coding.dwDTERate = 115200;
+	acm->line_coding.bCharFormat = USB_CDC_1_STOP_BITS;
+	acm->line_coding.bParityType = USB_CDC_NO_PARITY;
+	acm->line_coding.bDataBits = 8;
+	acm->line_state = 0;
+	acm->line_coding_cb = NULL;
+	acm->line_state_cb = NULL;
+
+	usbd_register_set_config_callback(usbd_dev, cdcacm_set_config);
+
+	return acm;
+}
+
+/** @brief Register a callback for SET_LINE_CODING.
+
+The callback can reject a coding it cannot honour by returning non-zero,
+which stalls the request. Otherwise the coding becomes the current one.
+*/
+void usb_cdcacm_register_line_coding_callback(usbd_cdcacm *acm,
+	int (*callback)(usbd_cdcacm *acm,
+			const struct usb_cdc_line_coding *coding))
+{
+	acm->line_coding_cb = callback;
+}
+
+/** @brief Register a callback for SET_CONTROL_LINE_STATE.
+
+@a state holds USB_CDC_CONTROL_LINE_DTR and USB_CDC_CONTROL_LINE_RTS.
+*/
+void usb_cdcacm_register_line_state_callback(usbd_cdcacm *acm,
+	void (*callback)(usbd_cdcacm *acm, uint16_t state))
+{
+	acm->line_state_cb = callback;
+}
+
+/** @brief Current line coding, as last set by the host. */
+const struct usb_cdc_line_coding *usb_cdcacm_line_coding(usbd_cdcacm *acm)
+{
+	return &acm->line_coding;
+}
+
+/** @brief Current DTR/RTS state, as last set by the host. */
+uint16_t usb_cdcacm_line_state(usbd_cdcacm *acm)
+{
+	return acm->line_state;
+}
+
+/** @brief Send a SERIAL_STATE notification.
+
+@param[in] acm The CDC-ACM function.
+@param[in] state USB_CDC_SERIAL_STATE_* bits.
+@return 0 if the notification was queued, -1 if there is no notification
+	endpoint or the previous notification is still pending.
+*/
+int usb_cdcacm_notify_serial_state(usbd_cdcacm *acm, uint16_t state)
+{
+	struct usb_cdc_notification *notif =
+		(struct usb_cdc_notification *)acm->notification;
+
+	if (!acm->ep_notif || !acm->configured) {
+		return -1;
+	}
+
+	notif->bmRequestType = 0xA1;
+	notif->bNotification = USB_CDC_NOTIFY_SERIAL_STATE;
+	notif->wValue = 0;
+	notif->wIndex = acm->comm_iface;
+	notif->wLength = 2;
+	acm->notification[sizeof(*notif)] = state & 0xff;
+	acm->notification[sizeof(*notif) + 1] = state >> 8;
+
+	if (usbd_ep_write_packet(acm->usbd_dev, acm->ep_notif,
+				 acm->notification,
+				 sizeof(acm->notification)) == 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/** @brief Get the oldest contiguous received data.
+
+The data stays in the ring, and valid, until released with
+usb_cdcacm_rx_consume().
+
+@param[in] acm The CDC-ACM function.
+@param[out] data Set to the start of the data.
+@return Number of bytes available at @a data, 0 if nothing was received.
+*/
+uint16_t usb_cdcacm_rx_span(usbd_cdcacm *acm, const uint8_t **data)
+{
+	struct usb_cdcacm_ring *r = &acm->rx;
+	uint16_t idx = r->tail & r->mask;
+	uint16_t used = ring_used(r);
+
+	cdcacm_rx_rearm(acm);
+	CDCACM_BARRIER();
+	*data = &r->buf[idx];
+	return MIN(used, r->mask + 1 - idx);
+}
+
+/** @brief Release received data.
+
+@param[in] acm The CDC-ACM function.
+@param[in] len Number of bytes processed, at most what usb_cdcacm_rx_span()
+	returned.
+*/
+void usb_cdcacm_rx_consume(usbd_cdcacm *acm, uint16_t len)
+{
+	CDCACM_BARRIER();
+	acm->rx.tail += len;
+	cdcacm_rx_rearm(acm);
+}
+
+/** @brief Copy received data out of the ring.
+
+@return Number of bytes copied to @a buf.
+*/
+uint16_t usb_cdcacm_read(usbd_cdcacm *acm, void *buf, uint16_t len)
+{
+	const uint8_t *data;
+	uint16_t done = 0;
+	uint16_t n;
+
+	while (done < len) {
+		n = MIN(usb_cdcacm_rx_span(acm, &data), len - done);
+		if (!n) {
+			break;
+		}
+		memcpy((uint8_t *)buf + done, data, n);
+		usb_cdcacm_rx_consume(acm, n);
+		done += n;
+	}
+	return done;
+}
+
+/** @brief Get contiguous free space of the transmit ring.
+
+Data written there is sent once handed over with usb_cdcacm_tx_commit().
+
+@param[in] acm The CDC-ACM function.
+@param[out] data Set to the start of the free space.
+@return Number of bytes that can be written at @a data.
+*/
+uint16_t usb_cdcacm_tx_span(usbd_cdcacm *acm, uint8_t **data)
+{
+	struct usb_cdcacm_ring *r = &acm->tx;
+	uint16_t idx = r->head & r->mask;
+
+	*data = &r->buf[idx];
+	return MIN(ring_free(r), r->mask + 1 - idx);
+}
+
+/** @brief Queue data written into the span from usb_cdcacm_tx_span().
+
+@note Starting an idle IN endpoint goes through the usbd driver, so when
+usbd_poll() runs from the USB interrupt, that interrupt must not preempt
+this function, nor usb_cdcacm_rx_consume() which re-enables reception
+after the RX ring filled up.
+*/
+void usb_cdcacm_tx_commit(usbd_cdcacm *acm, uint16_t len)
+{
+	CDCACM_BARRIER();
+	acm->tx.head += len;
+	if (acm->configured && !acm->tx_busy) {
+		cdcacm_tx_kick(acm, false);
+	}
+}
+
+/** @brief Copy data into the transmit ring and queue it.
+
+@return Number of bytes queued, less than @a len if the ring is full.
+*/
+uint16_t usb_cdcacm_write(usbd_cdcacm *acm, const void *buf, uint16_t len)
+{
+	uint8_t *data;
+	uint16_t done = 0;
+	uint16_t n;
+
+	while (done < len) {
+		n = MIN(usb_cdcacm_tx_span(acm, &data), len - done);
+		if (!n) {
+			break;
+		}
+		memcpy(data, (const uint8_t *)buf + done, n);
+		done += n;
+		/* Publish each chunk, so the second one can reuse its space. */
+		usb_cdcacm_tx_commit(acm, n);
+	}
+	return done;
+}
 
-/* This stub exists just to trick doxygen. */
+/** @} */
@@ -0,0 +1,683 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * CDC-NCM (Ethernet over USB) function, with 16-bit NTBs only.
+ *
+ * Datagrams are aggregated into NTBs (transfer blocks) in both directions,
+ * so that many small Ethernet frames share one bulk transfer. There are two
+ * NTB buffers per direction: one is on the bus while the application fills
+ * or drains the other. Datagrams are written to and read from the NTB
+ * memory directly.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/cdc.h>
+#include "usb_private.h"
+
+/* Smallest dwNtbInMaxSize allowed by the specification */
+#define NCM_MIN_NTB_SIZE	2048
+#define NCM_MAX_NTB_SIZE	0xfffc
+#define NCM_ALIGN		4
+#define NCM_ALIGNED(x)		(((x) + NCM_ALIGN - 1) & ~(NCM_ALIGN - 1))
+/* NDP16 holding n datagrams, plus its terminating null entry */
+#define NCM_NDP_SIZE(n)		\
+	(sizeof(struct usb_cdc_ncm_ndp16) + 4 * ((n) + 1))
+
+#define NCM_BARRIER()		__asm__ __volatile__("" : : : "memory")
+
+enum ncm_rx_state {
+	NCM_RX_FREE,
+	NCM_RX_ARMED,
+	NCM_RX_FULL,
+};
+
+struct ncm_tx_ntb {
+	uint8_t *buf;
+	uint16_t end;			/* End of the last datagram */
+	uint8_t count;
+	uint16_t index[USB_NCM_MAX_DATAGRAMS];
+	uint16_t len[USB_NCM_MAX_DATAGRAMS];
+};
+
+struct _usbd_ncm {
+	usbd_device *usbd_dev;
+	uint8_t comm_iface;
+	uint8_t data_iface;
+	uint8_t ep_in;
+	uint8_t ep_out;
+	uint8_t ep_notif;
+	uint16_t max_packet;
+	uint16_t ntb_size;
+	volatile bool active;		/* Data interface in altsetting 1 */
+	bool link_up;
+
+	struct ncm_tx_ntb tx[2];
+	uint16_t tx_max;		/* dwNtbInMaxSize, host may lower it */
+	uint16_t tx_seq;
+	uint8_t tx_fill;		/* NTB datagrams are appended to */
+	volatile bool tx_busy;		/* The other NTB is on the bus */
+	volatile bool tx_reserved;	/* A datagram is being written */
+	uint16_t tx_resv_len;
+
+	uint8_t *rx_buf[2];
+	volatile uint16_t rx_len[2];
+	volatile uint8_t rx_state[2];
+	uint8_t rx_arm;			/* Next NTB to receive into */
+	uint8_t rx_read;		/* Next NTB to parse */
+	uint16_t rx_ndp;		/* NDP being parsed, 0 if none */
+	uint16_t rx_entry;		/* Offset of its next datagram entry */
+
+	volatile bool notif_busy;
+	bool notify_speed;
+	bool notify_link;
+	uint8_t notification[sizeof(struct usb_cdc_notification) + 8];
+	struct usb_cdc_ncm_ntb_parameters params;
+};
+
+static usbd_ncm _ncm;
+
+static uint16_t get_le16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	put_le16(p, v);
+	put_le16(p + 2, v >> 16);
+}
+
+/* ---- notifications ---- */
+
+static void ncm_notify(usbd_ncm *ncm)
+{
+	struct usb_cdc_notification *notif =
+		(struct usb_cdc_notification *)ncm->notification;
+	uint32_t speed;
+	uint16_t len = sizeof(*notif);
+
+	if (ncm->notif_busy || !ncm->ep_notif) {
+		return;
+	}
+
+	notif->bmRequestType = 0xA1;
+	notif->wIndex = ncm->comm_iface;
+	if (ncm->notify_speed) {
+		speed = ncm->max_packet > 64 ? 480000000 : 12000000;
+		notif->bNotification = USB_CDC_NOTIFY_SPEED_CHANGE;
+		notif->wValue = 0;
+		notif->wLength = 8;
+		put_le32(&ncm->notification[sizeof(*notif)], speed);
+		put_le32(&ncm->notification[sizeof(*notif) + 4], speed);
+		len += 8;
+	} else if (ncm->notify_link) {
+		notif->bNotification = USB_CDC_NOTIFY_NETWORK_CONNECTION;
+		notif->wValue = ncm->link_up;
+		notif->wLength = 0;
+	} else {
+		return;
+	}
+
+	if (usbd_ep_write_packet(ncm->usbd_dev, ncm->ep_notif,
+				 ncm->notification, len) != len) {
+		return;
+	}
+	ncm->notif_busy = true;
+	if (ncm->notify_speed) {
+		ncm->notify_speed = false;
+	} else {
+		ncm->notify_link = false;
+	}
+}
+
+static void ncm_notif_cb(usbd_device *usbd_dev, uint8_t ep)
+{
+	(void)usbd_dev;
+	(void)ep;
+
+	_ncm.notif_busy = false;
+	ncm_notify(&_ncm);
+}
+
+/* ---- transmission ---- */
+
+static void ncm_tx_reset(struct ncm_tx_ntb *ntb)
+{
+	ntb->end = sizeof(struct usb_cdc_ncm_nth16);
+	ntb->count = 0;
+}
+
+/* Does a datagram of @a len fit in @a ntb, along with the grown NDP? */
+static bool ncm_tx_fits(usbd_ncm *ncm, struct ncm_tx_ntb *ntb, uint16_t len)
+{
+	uint32_t end = NCM_ALIGNED(ntb->end) + len;
+
+	return ntb->count < USB_NCM_MAX_DATAGRAMS &&
+	       NCM_ALIGNED(end) + NCM_NDP_SIZE(ntb->count + 1) <= ncm->tx_max;
+}
+
+static void ncm_tx_done(usbd_device *usbd_dev, uint8_t addr, uint32_t len);
+
+/* Finish the NTB being filled and put it on the bus. */
+static void ncm_tx_send(usbd_ncm *ncm)
+{
+	struct ncm_tx_ntb *ntb = &ncm->tx[ncm->tx_fill];
+	uint16_t ndp = NCM_ALIGNED(ntb->end);
+	uint16_t block = ndp + NCM_NDP_SIZE(ntb->count);
+	uint8_t *p = &ntb->buf[ndp];
+	uint8_t i;
+
+	put_le32(&ntb->buf[0], USB_CDC_NCM_NTH16_SIGNATURE);
+	put_le16(&ntb->buf[4], sizeof(struct usb_cdc_ncm_nth16));
+	put_le16(&ntb->buf[6], ncm->tx_seq++);
+	put_le16(&ntb->buf[8], block);
+	put_le16(&ntb->buf[10], ndp);
+
+	put_le32(p, USB_CDC_NCM_NDP16_NOCRC_SIGNATURE);
+	put_le16(p + 4, NCM_NDP_SIZE(ntb->count));
+	put_le16(p + 6, 0);
+	p += sizeof(struct usb_cdc_ncm_ndp16);
+	for (i = 0; i < ntb->count; i++, p += 4) {
+		put_le16(p, ntb->index[i]);
+		put_le16(p + 2, ntb->len[i]);
+	}
+	put_le32(p, 0);
+
+	/* A block shorter than dwNtbInMaxSize needs a short packet. */
+	if (usbd_ep_transfer(ncm->usbd_dev, ncm->ep_in, ntb->buf, block,
+			     block != ncm->tx_max, ncm_tx_done) < 0) {
+		return;
+	}
+	ncm->tx_busy = true;
+	ncm->tx_fill ^= 1;
+	ncm_tx_reset(&ncm->tx[ncm->tx_fill]);
+}
+
+static void ncm_tx_done(usbd_device *usbd_dev, uint8_t addr, uint32_t len)
+{
+	usbd_ncm *ncm = &_ncm;
+
+	(void)usbd_dev;
+	(void)addr;
+	(void)len;
+
+	ncm->tx_busy = false;
+	/* What was queued meanwhile goes out now, unless being written. */
+	if (ncm->active && !ncm->tx_reserved && ncm->tx[ncm->tx_fill].count) {
+		ncm_tx_send(ncm);
+	}
+}
+
+/* ---- reception ---- */
+
+static void ncm_rx_done(usbd_device *usbd_dev, uint8_t addr, uint32_t len);
+
+static void ncm_rx_arm(usbd_ncm *ncm)
+{
+	uint8_t b = ncm->rx_arm;
+
+	if (!ncm->active || ncm->rx_state[b] != NCM_RX_FREE) {
+		return;
+	}
+	if (usbd_ep_transfer(ncm->usbd_dev, ncm->ep_out, ncm->rx_buf[b],
+			     ncm->ntb_size, false, ncm_rx_done) == 0) {
+		ncm->rx_state[b] = NCM_RX_ARMED;
+	}
+}
+
+static void ncm_rx_done(usbd_device *usbd_dev, uint8_t addr, uint32_t len)
+{
+	usbd_ncm *ncm = &_ncm;
+	uint8_t b = ncm->rx_arm;
+
+	(void)usbd_dev;
+	(void)addr;
+
+	ncm->rx_len[b] = len;
+	NCM_BARRIER();
+	ncm->rx_state[b] = NCM_RX_FULL;
+	ncm->rx_arm ^= 1;
+	ncm_rx_arm(ncm);
+}
+
+/* Check an NDP16 of the NTB @a buf of @a len bytes. */
+static bool ncm_rx_ndp_valid(const uint8_t *buf, uint16_t len, uint16_t ndp)
+{
+	uint16_t ndp_len;
+
+	if (ndp < sizeof(struct usb_cdc_ncm_nth16) || ndp % NCM_ALIGN ||
+	    ndp + sizeof(struct usb_cdc_ncm_ndp16) > len) {
+		return false;
+	}
+	ndp_len = get_le16(&buf[ndp + 4]);
+	return get_le32(&buf[ndp]) == USB_CDC_NCM_NDP16_NOCRC_SIGNATURE &&
+	       ndp_len >= NCM_NDP_SIZE(1) && ndp + ndp_len <= len;
+}
+
+/* Validate the NTH16 of a received NTB and locate its first NDP. */
+static bool ncm_rx_begin(usbd_ncm *ncm, uint8_t b)
+{
+	const uint8_t *buf = ncm->rx_buf[b];
+	uint16_t len = ncm->rx_len[b];
+	uint16_t block;
+
+	if (len < sizeof(struct usb_cdc_ncm_nth16) ||
+	    get_le32(buf) != USB_CDC_NCM_NTH16_SIGNATURE ||
+	    get_le16(&buf[4]) != sizeof(struct usb_cdc_ncm_nth16)) {
+		return false;
+	}
+	block = get_le16(&buf[8]);
+	if (block > len) {
+		return false;
+	}
+	ncm->rx_len[b] = block;
+	ncm->rx_ndp = get_le16(&buf[10]);
+	if (!ncm_rx_ndp_valid(buf, block, ncm->rx_ndp)) {
+		return false;
+	}
+	ncm->rx_entry = ncm->rx_ndp + sizeof(struct usb_cdc_ncm_ndp16);
+	return true;
+}
+
+/* Next datagram of the NTB being parsed, following chained NDPs. */
+static uint16_t ncm_rx_next(usbd_ncm *ncm, uint8_t b, const uint8_t **data)
+{
+	const uint8_t *buf = ncm->rx_buf[b];
+	uint16_t len = ncm->rx_len[b];
+	uint16_t index;
+	uint16_t dg_len;
+	uint16_t next;
+	uint32_t end;
+
+	while (ncm->rx_ndp) {
+		end = ncm->rx_ndp + get_le16(&buf[ncm->rx_ndp + 4]);
+		if ((uint32_t)ncm->rx_entry + 4 <= end) {
+			index = get_le16(&buf[ncm->rx_entry]);
+			dg_len = get_le16(&buf[ncm->rx_entry + 2]);
+			ncm->rx_entry += 4;
+			if (index && dg_len) {
+				if ((uint32_t)index + dg_len > len) {
+					continue;
+				}
+				*data = &buf[index];
+				return dg_len;
+			}
+		}
+
+		/* End of this NDP, move on to the next one if any. */
+		next = get_le16(&buf[ncm->rx_ndp + 6]);
+		/* Only forward links, so a looping chain cannot hang us. */
+		if (next <= ncm->rx_ndp ||
+		    !ncm_rx_ndp_valid(buf, len, next)) {
+			break;
+		}
+		ncm->rx_ndp = next;
+		ncm->rx_entry = next + sizeof(struct usb_cdc_ncm_ndp16);
+	}
+
+	ncm->rx_ndp = 0;
+	return 0;
+}
+
+static void ncm_rx_release(usbd_ncm *ncm, uint8_t b)
+{
+	ncm->rx_ndp = 0;
+	ncm->rx_entry = 0;
+	NCM_BARRIER();
+	ncm->rx_state[b] = NCM_RX_FREE;
+	ncm->rx_read ^= 1;
+	/* Nothing is pending when both NTBs were waiting to be parsed. */
+	if (ncm->rx_state[b ^ 1] != NCM_RX_ARMED) {
+		ncm_rx_arm(ncm);
+	}
+}
+
+/* ---- control ---- */
+
+static enum usbd_request_return_codes ncm_control_request(
+	usbd_device *usbd_dev, struct usb_setup_data *req, uint8_t **buf,
+	uint16_t *len, usbd_control_complete_callback *complete)
+{
+	usbd_ncm *ncm = &_ncm;
+	uint32_t size;
+
+	(void)usbd_dev;
+	(void)complete;
+
+	if (req->wIndex != ncm->comm_iface) {
+		return USBD_REQ_NEXT_CALLBACK;
+	}
+
+	switch (req->bRequest) {
+	case USB_CDC_REQ_SET_ETHERNET_PACKET_FILTER:
+		/* Everything is forwarded, filtering is left to the stack. */
+		return USBD_REQ_HANDLED;
+	case USB_CDC_REQ_GET_NTB_PARAMETERS:
+		*buf = (uint8_t *)&ncm->params;
+		*len = MIN(*len, sizeof(ncm->params));
+		return USBD_REQ_HANDLED;
+	case USB_CDC_REQ_GET_NTB_FORMAT:
+		(*buf)[0] = 0;
+		(*buf)[1] = 0;
+		*len = MIN(*len, 2);
+		return USBD_REQ_HANDLED;
+	case USB_CDC_REQ_SET_NTB_FORMAT:
+		/* Only NTB16 is supported. */
+		return req->wValue ? USBD_REQ_NOTSUPP : USBD_REQ_HANDLED;
+	case USB_CDC_REQ_GET_NTB_INPUT_SIZE:
+		put_le32(*buf, ncm->tx_max);
+		*len = MIN(*len, 4);
+		return USBD_REQ_HANDLED;
+	case USB_CDC_REQ_SET_NTB_INPUT_SIZE:
+		if (*len < 4) {
+			return USBD_REQ_NOTSUPP;
+		}
+		size = get_le32(*buf);
+		if (size < NCM_MIN_NTB_SIZE || size > ncm->ntb_size) {
+			return USBD_REQ_NOTSUPP;
+		}
+		ncm->tx_max = size;
+		return USBD_REQ_HANDLED;
+	}
+
+	return USBD_REQ_NEXT_CALLBACK;
+}
+
+static void ncm_set_altsetting(usbd_device *usbd_dev, uint16_t wIndex,
+			       uint16_t wValue)
+{
+	usbd_ncm *ncm = &_ncm;
+	uint8_t b;
+
+	(void)usbd_dev;
+
+	if (wIndex != ncm->data_iface) {
+		return;
+	}
+
+	ncm->active = false;
+	if (wValue != 1) {
+		return;
+	}
+
+	/*
+	 * Alternate setting 1 starts a new data session. SET_INTERFACE does
+	 * not cancel transfers, so an NTB still on the bus and a reception
+	 * still armed are kept, and complete as usual; only data queued or
+	 * received in the previous session is dropped.
+	 */
+	ncm_tx_reset(&ncm->tx[ncm->tx_fill]);
+	if (!ncm->tx_busy) {
+		ncm_tx_reset(&ncm->tx[ncm->tx_fill ^ 1]);
+	}
+	ncm->tx_seq = 0;
+	for (b = 0; b < 2; b++) {
+		if (ncm->rx_state[b] == NCM_RX_FULL) {
+			ncm->rx_state[b] = NCM_RX_FREE;
+		}
+	}
+	/* Only rx_arm can be armed, so it is the next NTB to complete. */
+	ncm->rx_read = ncm->rx_arm;
+	ncm->rx_ndp = 0;
+	ncm->rx_entry = 0;
+	ncm->active = true;
+	ncm_rx_arm(ncm);
+
+	ncm->notify_speed = true;
+	ncm->notify_link = true;
+	ncm_notify(ncm);
+}
+
+static void ncm_set_config(usbd_device *usbd_dev, uint16_t wValue)
+{
+	usbd_ncm *ncm = &_ncm;
+
+	(void)wValue;
+
+	ncm->active = false;
+	ncm->notif_busy = false;
+	ncm->tx_max = ncm->ntb_size;
+
+	/* All transfers were dropped along with the old configuration. */
+	ncm_tx_reset(&ncm->tx[0]);
+	ncm_tx_reset(&ncm->tx[1]);
+	ncm->tx_fill = 0;
+	ncm->tx_busy = false;
+	ncm->rx_state[0] = NCM_RX_FREE;
+	ncm->rx_state[1] = NCM_RX_FREE;
+	ncm->rx_arm = 0;
+
+	usbd_ep_setup(usbd_dev, ncm->ep_in, USB_ENDPOINT_ATTR_BULK,
+		      ncm->max_packet, NULL);
+	usbd_ep_setup(usbd_dev, ncm->ep_out, USB_ENDPOINT_ATTR_BULK,
+		      ncm->max_packet, NULL);
+	if (ncm->ep_notif) {
+		usbd_ep_setup(usbd_dev, ncm->ep_notif,
+			      USB_ENDPOINT_ATTR_INTERRUPT,
+			      sizeof(ncm->notification), ncm_notif_cb);
+	}
+
+	usbd_register_control_callback(
+				usbd_dev,
+				USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				ncm_control_request);
+}
+
+/** @addtogroup usb_cdc */
+/** @{ */
+
+/** @brief Initializes the CDC-NCM function.
+
+The data interface must have an alternate setting 0 without endpoints and
+an alternate setting 1 with the bulk endpoints, as required by NCM. This
+registers the device's set altsetting callback.
+
+@note Only one CDC-NCM function can be active.
+
+@param[in] usbd_dev The USB device to add the function to.
+@param[in] comm_iface Number of the communication interface.
+@param[in] data_iface Number of the data interface.
+@param[in] ep_in The bulk IN endpoint.
+@param[in] ep_out The bulk OUT endpoint.
+@param[in] ep_notif The interrupt notification endpoint, 0 if there is none.
+@param[in] max_packet Max packet size of the bulk endpoints.
+@param[in] arena Memory for two NTBs per direction, must be 32-bit aligned.
+@param[in] arena_size Size of @a arena, the NTB size is a quarter of it, at
+	most 64 KiB and at least 2 KiB.
+
+@return The CDC-NCM function, or NULL if @a arena is too small.
+*/
+usbd_ncm *usb_ncm_init(usbd_device *usbd_dev, uint8_t comm_iface,
+		       uint8_t data_iface, uint8_t ep_in, uint8_t ep_out,
+		       uint8_t ep_notif, uint16_t max_packet,
+		       void *arena, uint32_t arena_size)
+{
+	usbd_ncm *ncm = &_ncm;
+	uint8_t *mem = arena;
+	uint32_t size = (arena_size / 4) & ~(NCM_ALIGN - 1);
+
+	if (size < NCM_MIN_NTB_SIZE) {
+		return NULL;
+	}
+	if (size > NCM_MAX_NTB_SIZE) {
+		size = NCM_MAX_NTB_SIZE;
+	}
+
+	ncm->usbd_dev = usbd_dev;
+	ncm->comm_iface = comm_iface;
+	ncm->data_iface = data_iface;
+	ncm->ep_in = ep_in;
+	ncm->ep_out = ep_out;
+	ncm->ep_notif = ep_notif;
+	ncm->max_packet = max_packet;
+	ncm->ntb_size = size;
+	ncm->tx_max = size;
+	ncm->active = false;
+	ncm->link_up = true;
+	ncm->tx_reserved = false;
+	ncm->notif_busy = false;
+	ncm->notify_speed = false;
+	ncm->notify_link = false;
+
+	ncm->tx[0].buf = mem;
+	ncm->tx[1].buf = mem + size;
+	ncm->rx_buf[0] = mem + 2 * size;
+	ncm->rx_buf[1] = mem + 3 * size;
+
+	ncm->params.wLength = sizeof(ncm->params);
+	ncm->params.bmNtbFormatsSupported = 1;
+	ncm->params.dwNtbInMaxSize = size;
+	ncm->params.wNdpInDivisor = NCM_ALIGN;
+	ncm->params.wNdpInPayloadRemainder = 0;
+	ncm->params.wNdpInAlignment = NCM_ALIGN;
+	ncm->params.wReserved = 0;
+	ncm->params.dwNtbOutMaxSize = size;
+	ncm->params.wNdpOutDivisor = NCM_ALIGN;
+	ncm->params.wNdpOutPayloadRemainder = 0;
+	ncm->params.wNdpOutAlignment = NCM_ALIGN;
+	ncm->params.wNtbOutMaxDatagrams = 0;
+
+	usbd_register_set_config_callback(usbd_dev, ncm_set_config);
+	usbd_register_set_altsetting_callback(usbd_dev, ncm_set_altsetting);
+
+	return ncm;
+}
+
+/** @brief Report the network link state to the host. */
+void usb_ncm_set_link(usbd_ncm *ncm, bool up)
+{
+	ncm->link_up = up;
+	if (ncm->active) {
+		ncm->notify_link = true;
+		ncm_notify(ncm);
+	}
+}
+
+/** @brief Reserve room for a datagram in the NTB being filled.
+
+The datagram is written at the returned address, then appended with
+usb_ncm_tx_commit(). Only one datagram can be reserved at a time.
+
+@param[in] ncm The CDC-NCM function.
+@param[in] len Size of the Ethernet frame.
+@return Where to write the frame, NULL if the data interface is not active
+	or there is no room until the NTB on the bus is done.
+*/
+uint8_t *usb_ncm_tx_alloc(usbd_ncm *ncm, uint16_t len)
+{
+	struct ncm_tx_ntb *ntb;
+
+	ncm->tx_reserved = true;
+	NCM_BARRIER();
+	ntb = &ncm->tx[ncm->tx_fill];
+
+	if (ncm->active && ntb->count && !ncm->tx_busy &&
+	    !ncm_tx_fits(ncm, ntb, len)) {
+		/* Full, but the bus is idle: send it and fill the other one. */
+		ncm_tx_send(ncm);
+		ntb = &ncm->tx[ncm->tx_fill];
+	}
+	if (!ncm->active || !ncm_tx_fits(ncm, ntb, len)) {
+		ncm->tx_reserved = false;
+		return NULL;
+	}
+
+	ncm->tx_resv_len = len;
+	return &ntb->buf[NCM_ALIGNED(ntb->end)];
+}
+
+/** @brief Append the datagram reserved with usb_ncm_tx_alloc().
+
+It is sent right away if the bus is idle, otherwise along with the other
+datagrams appended meanwhile once the previous NTB is done.
+
+@param[in] ncm The CDC-NCM function.
+@param[in] len Final size of the frame, at most the reserved size, 0 to
+	drop the reservation.
+*/
+void usb_ncm_tx_commit(usbd_ncm *ncm, uint16_t len)
+{
+	struct ncm_tx_ntb *ntb = &ncm->tx[ncm->tx_fill];
+	uint16_t index = NCM_ALIGNED(ntb->end);
+
+	if (!ncm->tx_reserved) {
+		return;
+	}
+
+	if (len) {
+		len = MIN(len, ncm->tx_resv_len);
+		ntb->index[ntb->count] = index;
+		ntb->len[ntb->count] = len;
+		ntb->count++;
+		ntb->end = index + len;
+	}
+
+	NCM_BARRIER();
+	ncm->tx_reserved = false;
+	if (!ncm->tx_busy && ntb->count && ncm->active) {
+		ncm_tx_send(ncm);
+	}
+}
+
+/** @brief Get the next received datagram.
+
+The datagram is read in place in the NTB, and stays valid until the next
+call, which also gives its NTB back for reception once it is exhausted.
+
+@param[in] ncm The CDC-NCM function.
+@param[out] data Set to the start of the Ethernet frame.
+@return Size of the frame, 0 if there is none.
+*/
+uint16_t usb_ncm_rx_datagram(usbd_ncm *ncm, const uint8_t **data)
+{
+	uint8_t b;
+	uint16_t len;
+
+	for (;;) {
+		b = ncm->rx_read;
+		if (ncm->rx_state[b] != NCM_RX_FULL) {
+			return 0;
+		}
+		NCM_BARRIER();
+
+		if (ncm->rx_entry || ncm_rx_begin(ncm, b)) {
+			len = ncm_rx_next(ncm, b, data);
+			if (len) {
+				return len;
+			}
+		}
+		ncm_rx_release(ncm, b);
+	}
+}
+
+/** @} */
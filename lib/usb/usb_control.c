@@ -74,24 +74,81 @@ int usbd_register_control_callback(usbd_device *usbd_dev, uint8_t type,
 				   uint8_t type_mask,
 				   usbd_control_callback callback)
 {
-	int i;
+	int i = usbd_dev->num_control_callback;
+	int route;
 
-	for (i = 0; i < MAX_USER_CONTROL_CALLBACK; i++) {
-		if (usbd_dev->user_control_callback[i].cb) {
-			continue;
+	if (i >= MAX_USER_CONTROL_CALLBACK) {
+		return -1;
+	}
+
+	usbd_dev->user_control_callback[i].type = type;
+	usbd_dev->user_control_callback[i].type_mask = type_mask;
+	usbd_dev->user_control_callback[i].cb = callback;
+	usbd_dev->num_control_callback++;
+
+	/* Add the callback to every route whose requests it can match. */
+	for (route = 0; route < USBD_CONTROL_ROUTES; route++) {
+		uint8_t bmRequestType = ((route & 0x10) << 3) |
+					((route & 0x0c) << 3) |
+					(route & 0x03);
+
+		if ((bmRequestType & type_mask) == type) {
+			usbd_dev->control_route[route] |=
+				(usbd_control_mask)1 << i;
 		}
+	}
 
-		usbd_dev->user_control_callback[i].type = type;
-		usbd_dev->user_control_callback[i].type_mask = type_mask;
-		usbd_dev->user_control_callback[i].cb = callback;
-		return 0;
+	return 0;
+}
+
+void _usbd_control_callbacks_reset(usbd_device *usbd_dev)
+{
+	int i;
+
+	for (i = 0; i < MAX_USER_CONTROL_CALLBACK; i++) {
+		usbd_dev->user_control_callback[i].cb = NULL;
 	}
+	for (i = 0; i < USBD_CONTROL_ROUTES; i++) {
+		usbd_dev->control_route[i] = 0;
+	}
+	usbd_dev->num_control_callback = 0;
+}
 
-	return -1;
+void usbd_control_set_generator(usbd_device *usbd_dev,
+				usbd_control_generator generator)
+{
+	usbd_dev->control_state.generator = generator;
+	usbd_dev->control_state.gen_offset = 0;
+}
+
+/* Have the generator fill the control buffer with the next packet. */
+static void usb_control_generate_chunk(usbd_device *usbd_dev)
+{
+	uint16_t size = MIN(usbd_dev->desc->bMaxPacketSize0,
+			    usbd_dev->control_state.ctrl_len);
+	uint16_t n = 0;
+
+	if (size) {
+		n = usbd_dev->control_state.generator(usbd_dev,
+					&usbd_dev->control_state.req,
+					usbd_dev->control_state.gen_offset,
+					usbd_dev->ctrl_buf, size);
+	}
+	if (n < size) {
+		/* Out of data: this short packet ends the data stage. */
+		usbd_dev->control_state.ctrl_len = n;
+		usbd_dev->control_state.needs_zlp = false;
+	}
+	usbd_dev->control_state.gen_offset += n;
+	usbd_dev->control_state.ctrl_buf = usbd_dev->ctrl_buf;
 }
 
 static void usb_control_send_chunk(usbd_device *usbd_dev)
 {
+	if (usbd_dev->control_state.generator) {
+		usb_control_generate_chunk(usbd_dev);
+	}
+
 	if (usbd_dev->desc->bMaxPacketSize0 <
 			usbd_dev->control_state.ctrl_len) {
 		/* Data stage, normal transmission */
@@ -144,12 +201,20 @@ usb_control_request_dispatch(usbd_device *usbd_dev,
 {
 	int i, result = 0;
 	struct user_control_callback *cb = usbd_dev->user_control_callback;
+	uint32_t candidates;
 
-	/* Call user command hook function. */
-	for (i = 0; i < MAX_USER_CONTROL_CALLBACK; i++) {
-		if (cb[i].cb == NULL) {
-			break;
-		}
+	if (req->bmRequestType & 0x1c) {
+		/* Reserved recipient, not routed: try every callback. */
+		candidates = (1ULL << usbd_dev->num_control_callback) - 1;
+	} else {
+		candidates = usbd_dev->control_route[
+				USBD_CONTROL_ROUTE(req->bmRequestType)];
+	}
+
+	/* Call user command hook function, in registration order. */
+	while (candidates) {
+		i = __builtin_ctz(candidates);
+		candidates &= candidates - 1;
 
 		if ((req->bmRequestType & cb[i].type_mask) == cb[i].type) {
 			result = cb[i].cb(usbd_dev, req,
@@ -225,6 +290,8 @@ void _usbd_control_setup(usbd_device *usbd_dev, uint8_t ea)
 	(void)ea;
 
 	usbd_dev->control_state.complete = NULL;
+	usbd_dev->control_state.generator = NULL;
+	USBD_STATS_EVENT(USBD_TRACE_SETUP, 0, req->bRequest);
 
 	usbd_ep_nak_set(usbd_dev, 0, 1);
 
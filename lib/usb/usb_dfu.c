@@ -0,0 +1,634 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * DFU 1.1 class, with the DfuSe addressing extension.
+ *
+ * Downloaded blocks are not programmed from the control request. They are
+ * queued in one of two slots and programmed by usb_dfu_poll(), so the next
+ * block is received while the previous one is written: the device only
+ * reports dfuDNBUSY when both slots are taken. A programming error is
+ * reported on the GETSTATUS that follows it.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/dfu.h>
+#include "usb_private.h"
+
+#define DFU_SLOTS		2
+
+#define DFU_BARRIER()		__asm__ __volatile__("" : : : "memory")
+
+enum dfu_slot_state {
+	DFU_SLOT_FREE,
+	DFU_SLOT_FULL,
+};
+
+enum dfu_slot_kind {
+	DFU_SLOT_PROGRAM,
+	DFU_SLOT_ERASE,
+};
+
+struct dfu_slot {
+	volatile uint8_t state;
+	uint8_t kind;
+	bool first;			/* First block of a plain download */
+	uint16_t len;
+	uint16_t done;			/* Bytes programmed so far */
+	uint32_t address;
+	uint8_t *data;
+};
+
+struct _usbd_dfu {
+	usbd_device *usbd_dev;
+	const struct usb_dfu_memory *mem;
+	uint8_t iface;
+	uint8_t attributes;
+	bool dfuse;
+	uint16_t transfer_size;
+
+	uint8_t state;
+	volatile uint8_t status;
+	bool manifested;
+	uint32_t offset;		/* Next plain download address */
+	uint32_t dfuse_address;		/* Set by DFUSE_CMD_SET_ADDRESS */
+
+	struct dfu_slot slot[DFU_SLOTS];
+	uint8_t fill;			/* Slot the next request goes to */
+	uint8_t prog;			/* Slot being programmed */
+	uint32_t erased_end;		/* Auto-erase progress, main context */
+};
+
+static usbd_dfu _dfu;
+
+static const uint8_t dfuse_commands[] = {
+	DFUSE_CMD_GET_COMMANDS,
+	DFUSE_CMD_SET_ADDRESS,
+	DFUSE_CMD_ERASE,
+};
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool dfu_idle(usbd_dfu *dfu)
+{
+	return dfu->slot[0].state == DFU_SLOT_FREE &&
+	       dfu->slot[1].state == DFU_SLOT_FREE;
+}
+
+/* Enter dfuERROR, the host has to send CLRSTATUS. */
+static enum usbd_request_return_codes dfu_error(usbd_dfu *dfu, uint8_t status)
+{
+	dfu->status = status;
+	dfu->state = STATE_DFU_ERROR;
+	return USBD_REQ_NOTSUPP;
+}
+
+static bool dfu_in_range(usbd_dfu *dfu, uint32_t address, uint16_t len)
+{
+	const struct usb_dfu_memory *mem = dfu->mem;
+
+	return address >= mem->base &&
+	       address - mem->base <= mem->size &&
+	       len <= mem->size - (address - mem->base);
+}
+
+static struct dfu_slot *dfu_queue(usbd_dfu *dfu, uint8_t kind,
+				  uint32_t address)
+{
+	struct dfu_slot *slot = &dfu->slot[dfu->fill];
+
+	if (slot->state != DFU_SLOT_FREE) {
+		return NULL;
+	}
+	slot->kind = kind;
+	slot->address = address;
+	slot->len = 0;
+	slot->done = 0;
+	slot->first = false;
+	return slot;
+}
+
+static void dfu_queue_commit(usbd_dfu *dfu, struct dfu_slot *slot)
+{
+	DFU_BARRIER();
+	slot->state = DFU_SLOT_FULL;
+	dfu->fill = (dfu->fill + 1) % DFU_SLOTS;
+}
+
+static enum usbd_request_return_codes dfu_dfuse_command(usbd_dfu *dfu,
+		const uint8_t *buf, uint16_t len)
+{
+	struct dfu_slot *slot;
+	uint32_t address;
+
+	if (len == 1 && buf[0] == DFUSE_CMD_GET_COMMANDS) {
+		return USBD_REQ_HANDLED;
+	}
+	if (len != 5) {
+		/* Mass erase and read unprotect are not supported. */
+		return dfu_error(dfu, DFU_STATUS_ERR_STALLEDPKT);
+	}
+
+	address = get_le32(&buf[1]);
+	if (!dfu_in_range(dfu, address, 1)) {
+		return dfu_error(dfu, DFU_STATUS_ERR_ADDRESS);
+	}
+
+	switch (buf[0]) {
+	case DFUSE_CMD_SET_ADDRESS:
+		dfu->dfuse_address = address;
+		return USBD_REQ_HANDLED;
+	case DFUSE_CMD_ERASE:
+		slot = dfu_queue(dfu, DFU_SLOT_ERASE, address);
+		if (!slot) {
+			return dfu_error(dfu, DFU_STATUS_ERR_NOTDONE);
+		}
+		dfu_queue_commit(dfu, slot);
+		return USBD_REQ_HANDLED;
+	}
+
+	return dfu_error(dfu, DFU_STATUS_ERR_STALLEDPKT);
+}
+
+static enum usbd_request_return_codes dfu_dnload(usbd_dfu *dfu,
+		struct usb_setup_data *req, const uint8_t *buf, uint16_t len)
+{
+	struct dfu_slot *slot;
+	enum usbd_request_return_codes ret;
+	uint32_t address;
+	bool first = dfu->state == STATE_DFU_IDLE;
+
+	if (!(dfu->attributes & USB_DFU_CAN_DOWNLOAD) ||
+	    (dfu->state != STATE_DFU_IDLE &&
+	     dfu->state != STATE_DFU_DNLOAD_IDLE)) {
+		return dfu_error(dfu, DFU_STATUS_ERR_STALLEDPKT);
+	}
+
+	if (len == 0) {
+		if (first) {
+			return dfu_error(dfu, DFU_STATUS_ERR_STALLEDPKT);
+		}
+		dfu->manifested = false;
+		dfu->state = STATE_DFU_MANIFEST_SYNC;
+		return USBD_REQ_HANDLED;
+	}
+
+	if (dfu->dfuse && req->wValue < 2) {
+		if (req->wValue == 1) {
+			return dfu_error(dfu, DFU_STATUS_ERR_STALLEDPKT);
+		}
+		ret = dfu_dfuse_command(dfu, buf, len);
+		if (ret == USBD_REQ_HANDLED) {
+			dfu->state = STATE_DFU_DNLOAD_SYNC;
+		}
+		return ret;
+	}
+
+	if (dfu->dfuse) {
+		address = dfu->dfuse_address +
+			  (uint32_t)(req->wValue - 2) * dfu->transfer_size;
+	} else {
+		if (first) {
+			dfu->offset = dfu->mem->base;
+		}
+		address = dfu->offset;
+	}
+	if (!dfu_in_range(dfu, address, len)) {
+		return dfu_error(dfu, DFU_STATUS_ERR_ADDRESS);
+	}
+
+	slot = dfu_queue(dfu, DFU_SLOT_PROGRAM, address);
+	if (!slot) {
+		return dfu_error(dfu, DFU_STATUS_ERR_NOTDONE);
+	}
+	memcpy(slot->data, buf, len);
+	slot->len = len;
+	slot->first = !dfu->dfuse && first;
+	dfu_queue_commit(dfu, slot);
+
+	dfu->offset = address + len;
+	dfu->state = STATE_DFU_DNLOAD_SYNC;
+	return USBD_REQ_HANDLED;
+}
+
+static enum usbd_request_return_codes dfu_upload(usbd_dfu *dfu,
+		struct usb_setup_data *req, uint8_t **buf, uint16_t *len)
+{
+	const struct usb_dfu_memory *mem = dfu->mem;
+	uint32_t address;
+	uint32_t left;
+	uint16_t n;
+
+	if (!(dfu->attributes & USB_DFU_CAN_UPLOAD) || !mem->read ||
+	    (dfu->state != STATE_DFU_IDLE &&
+	     dfu->state != STATE_DFU_UPLOAD_IDLE)) {
+		return dfu_error(dfu, DFU_STATUS_ERR_STALLEDPKT);
+	}
+
+	if (dfu->dfuse && req->wValue == 0) {
+		*buf = (uint8_t *)dfuse_commands;
+		*len = MIN(*len, sizeof(dfuse_commands));
+		dfu->state = STATE_DFU_UPLOAD_IDLE;
+		return USBD_REQ_HANDLED;
+	}
+	if (dfu->dfuse && req->wValue == 1) {
+		return dfu_error(dfu, DFU_STATUS_ERR_STALLEDPKT);
+	}
+
+	if (dfu->dfuse) {
+		address = dfu->dfuse_address +
+			  (uint32_t)(req->wValue - 2) * dfu->transfer_size;
+	} else {
+		address = mem->base + (uint32_t)req->wValue *
+			  dfu->transfer_size;
+	}
+
+	n = MIN(*len, dfu->transfer_size);
+	if (address < mem->base || address - mem->base >= mem->size) {
+		left = 0;
+	} else {
+		left = mem->size - (address - mem->base);
+	}
+	if (n > left) {
+		n = left;
+	}
+
+	if (n && mem->read(address, *buf, n)) {
+		return dfu_error(dfu, DFU_STATUS_ERR_FILE);
+	}
+	/* A short block ends the upload. */
+	dfu->state = n < *len ? STATE_DFU_IDLE : STATE_DFU_UPLOAD_IDLE;
+	*len = n;
+	return USBD_REQ_HANDLED;
+}
+
+static void dfu_manifest_complete(usbd_device *usbd_dev,
+				  struct usb_setup_data *req)
+{
+	(void)usbd_dev;
+	(void)req;
+
+	if (_dfu.mem->manifest) {
+		_dfu.mem->manifest();
+	}
+}
+
+static enum usbd_request_return_codes dfu_getstatus(usbd_dfu *dfu,
+		uint8_t **buf, uint16_t *len, usbd_control_complete_callback *complete)
+{
+	uint8_t state;
+	uint32_t poll = 0;
+
+	if (dfu->status != DFU_STATUS_OK) {
+		dfu->state = STATE_DFU_ERROR;
+	}
+	state = dfu->state;
+
+	switch (dfu->state) {
+	case STATE_DFU_DNLOAD_SYNC:
+		/* Ready for the next block as soon as a slot is free. */
+		if (dfu->slot[dfu->fill].state == DFU_SLOT_FREE) {
+			dfu->state = STATE_DFU_DNLOAD_IDLE;
+			state = dfu->state;
+		} else {
+			state = STATE_DFU_DNBUSY;
+			poll = dfu->mem->poll_timeout;
+		}
+		break;
+	case STATE_DFU_MANIFEST_SYNC:
+		if (!dfu_idle(dfu)) {
+			state = STATE_DFU_MANIFEST;
+			poll = dfu->mem->poll_timeout;
+		} else if (!dfu->manifested) {
+			dfu->manifested = true;
+			state = STATE_DFU_MANIFEST;
+			*complete = dfu_manifest_complete;
+			if (!(dfu->attributes & USB_DFU_MANIFEST_TOLERANT)) {
+				dfu->state = STATE_DFU_MANIFEST_WAIT_RESET;
+			}
+		} else {
+			dfu->state = STATE_DFU_IDLE;
+			state = dfu->state;
+		}
+		break;
+	case STATE_DFU_ERROR:
+		/* Have the host wait before CLRSTATUS while blocks drain. */
+		if (!dfu_idle(dfu)) {
+			poll = dfu->mem->poll_timeout;
+		}
+		break;
+	default:
+		break;
+	}
+
+	(*buf)[0] = dfu->status;
+	(*buf)[1] = poll & 0xff;
+	(*buf)[2] = (poll >> 8) & 0xff;
+	(*buf)[3] = (poll >> 16) & 0xff;
+	(*buf)[4] = state;
+	(*buf)[5] = 0;
+	*len = MIN(*len, 6);
+	return USBD_REQ_HANDLED;
+}
+
+static enum usbd_request_return_codes dfu_control_request(
+	usbd_device *usbd_dev, struct usb_setup_data *req, uint8_t **buf,
+	uint16_t *len, usbd_control_complete_callback *complete)
+{
+	usbd_dfu *dfu = &_dfu;
+
+	(void)usbd_dev;
+
+	if (req->wIndex != dfu->iface) {
+		return USBD_REQ_NEXT_CALLBACK;
+	}
+
+	switch (req->bRequest) {
+	case DFU_DNLOAD:
+		return dfu_dnload(dfu, req, *buf, *len);
+	case DFU_UPLOAD:
+		return dfu_upload(dfu, req, buf, len);
+	case DFU_GETSTATUS:
+		return dfu_getstatus(dfu, buf, len, complete);
+	case DFU_GETSTATE:
+		(*buf)[0] = dfu->state;
+		*len = MIN(*len, 1);
+		return USBD_REQ_HANDLED;
+	case DFU_CLRSTATUS:
+		if (dfu->state != STATE_DFU_ERROR) {
+			return dfu_error(dfu, DFU_STATUS_ERR_STALLEDPKT);
+		}
+		/*
+		 * usb_dfu_poll() only discards queued blocks while the
+		 * error is set, stay in dfuERROR until they are gone.
+		 */
+		if (!dfu_idle(dfu)) {
+			return USBD_REQ_NOTSUPP;
+		}
+		dfu->status = DFU_STATUS_OK;
+		dfu->state = STATE_DFU_IDLE;
+		return USBD_REQ_HANDLED;
+	case DFU_ABORT:
+		switch (dfu->state) {
+		case STATE_DFU_IDLE:
+		case STATE_DFU_DNLOAD_SYNC:
+		case STATE_DFU_DNLOAD_IDLE:
+		case STATE_DFU_MANIFEST_SYNC:
+		case STATE_DFU_UPLOAD_IDLE:
+			/* Queued blocks are still programmed. */
+			dfu->state = STATE_DFU_IDLE;
+			return USBD_REQ_HANDLED;
+		}
+		return dfu_error(dfu, DFU_STATUS_ERR_STALLEDPKT);
+	}
+
+	return dfu_error(dfu, DFU_STATUS_ERR_STALLEDPKT);
+}
+
+static void dfu_set_config(usbd_device *usbd_dev, uint16_t wValue)
+{
+	(void)wValue;
+
+	usbd_register_control_callback(
+				usbd_dev,
+				USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				dfu_control_request);
+}
+
+/* ---- runtime ---- */
+
+static struct {
+	uint8_t iface;
+	void (*detach)(void);
+} _dfu_runtime;
+
+static void dfu_detach_complete(usbd_device *usbd_dev,
+				struct usb_setup_data *req)
+{
+	(void)usbd_dev;
+	(void)req;
+
+	_dfu_runtime.detach();
+}
+
+static enum usbd_request_return_codes dfu_runtime_request(
+	usbd_device *usbd_dev, struct usb_setup_data *req, uint8_t **buf,
+	uint16_t *len, usbd_control_complete_callback *complete)
+{
+	(void)usbd_dev;
+
+	if (req->wIndex != _dfu_runtime.iface) {
+		return USBD_REQ_NEXT_CALLBACK;
+	}
+
+	switch (req->bRequest) {
+	case DFU_DETACH:
+		*complete = dfu_detach_complete;
+		return USBD_REQ_HANDLED;
+	case DFU_GETSTATUS:
+		memset(*buf, 0, 6);
+		(*buf)[4] = STATE_APP_IDLE;
+		*len = MIN(*len, 6);
+		return USBD_REQ_HANDLED;
+	case DFU_GETSTATE:
+		(*buf)[0] = STATE_APP_IDLE;
+		*len = MIN(*len, 1);
+		return USBD_REQ_HANDLED;
+	}
+
+	return USBD_REQ_NOTSUPP;
+}
+
+static void dfu_runtime_set_config(usbd_device *usbd_dev, uint16_t wValue)
+{
+	(void)wValue;
+
+	usbd_register_control_callback(
+				usbd_dev,
+				USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				dfu_runtime_request);
+}
+
+/** @addtogroup usb_dfu */
+/** @{ */
+
+/** @brief Initializes the DFU mode interface and its download engine.
+
+Blocks received with DFU_DNLOAD are copied to one of two slots of @a arena
+and written by usb_dfu_poll(), which the application calls from its main
+loop. The USB stack must keep running meanwhile, either from an interrupt
+or from the same loop, as usb_dfu_poll() programs at most
+@a mem->program_size bytes or erases one page per call.
+
+In plain DFU mode the image is written from @a mem->base onwards, and each
+page is erased before it is first programmed. In DfuSe mode block 0 carries
+the SET_ADDRESS and ERASE commands, block n >= 2 is written at the last
+address set plus (n - 2) * @a transfer_size, and nothing is erased unless
+the host asks for it.
+
+On STM32F4 for instance, @a mem->program would call flash_program() and
+@a mem->erase flash_erase_sector() for the sector holding the address.
+
+@note Only one DFU interface can be active.
+
+@param[in] usbd_dev The USB device to add the interface to.
+@param[in] iface Number of the DFU mode interface.
+@param[in] attributes bmAttributes of the functional descriptor.
+@param[in] transfer_size wTransferSize of the functional descriptor. It
+	must not be larger than the control buffer given to usbd_init().
+@param[in] dfuse Use the DfuSe addressing extension.
+@param[in] mem Memory to write to, must stay valid.
+@param[in] arena Memory for the two slots, two @a transfer_size blocks.
+@param[in] arena_size Size of @a arena.
+
+@return The DFU interface, or NULL if @a arena is too small.
+*/
+usbd_dfu *usb_dfu_init(usbd_device *usbd_dev, uint8_t iface,
+		       uint8_t attributes, uint16_t transfer_size, bool dfuse,
+		       const struct usb_dfu_memory *mem,
+		       void *arena, uint32_t arena_size)
+{
+	usbd_dfu *dfu = &_dfu;
+	uint8_t *data = arena;
+	int i;
+
+	if (!transfer_size || transfer_size > usbd_dev->ctrl_buf_len ||
+	    arena_size < (uint32_t)DFU_SLOTS * transfer_size) {
+		return NULL;
+	}
+
+	dfu->usbd_dev = usbd_dev;
+	dfu->mem = mem;
+	dfu->iface = iface;
+	dfu->attributes = attributes;
+	dfu->dfuse = dfuse;
+	dfu->transfer_size = transfer_size;
+	dfu->state = STATE_DFU_IDLE;
+	dfu->status = DFU_STATUS_OK;
+	dfu->dfuse_address = mem->base;
+	dfu->fill = 0;
+	dfu->prog = 0;
+	for (i = 0; i < DFU_SLOTS; i++) {
+		dfu->slot[i].state = DFU_SLOT_FREE;
+		dfu->slot[i].data = data + i * transfer_size;
+	}
+
+	usbd_register_set_config_callback(usbd_dev, dfu_set_config);
+
+	return dfu;
+}
+
+/** @brief Erase or program the next piece of the downloaded image.
+
+Call this from the main loop, it returns quickly when there is nothing to
+do. Failures move the interface to dfuERROR and discard the queued blocks.
+*/
+void usb_dfu_poll(usbd_dfu *dfu)
+{
+	const struct usb_dfu_memory *mem = dfu->mem;
+	struct dfu_slot *slot = &dfu->slot[dfu->prog];
+	uint32_t address;
+	uint16_t n;
+	int32_t erased;
+
+	if (slot->state != DFU_SLOT_FULL) {
+		return;
+	}
+	DFU_BARRIER();
+
+	if (dfu->status != DFU_STATUS_OK) {
+		goto release;
+	}
+
+	if (slot->kind == DFU_SLOT_ERASE) {
+		if (mem->erase(slot->address) <= 0) {
+			dfu->status = DFU_STATUS_ERR_ERASE;
+		}
+		goto release;
+	}
+
+	if (slot->first) {
+		slot->first = false;
+		dfu->erased_end = slot->address;
+	}
+
+	address = slot->address + slot->done;
+	n = slot->len - slot->done;
+	if (mem->program_size && n > mem->program_size) {
+		n = mem->program_size;
+	}
+
+	/* Plain DFU erases each page just before it is first written. */
+	if (!dfu->dfuse && dfu->erased_end < address + n) {
+		erased = mem->erase(dfu->erased_end);
+		if (erased <= 0) {
+			dfu->status = DFU_STATUS_ERR_ERASE;
+			goto release;
+		}
+		dfu->erased_end += erased;
+		return;
+	}
+
+	if (mem->program(address, slot->data + slot->done, n)) {
+		dfu->status = DFU_STATUS_ERR_PROG;
+		goto release;
+	}
+	slot->done += n;
+	if (slot->done < slot->len) {
+		return;
+	}
+
+release:
+	DFU_BARRIER();
+	slot->state = DFU_SLOT_FREE;
+	dfu->prog = (dfu->prog + 1) % DFU_SLOTS;
+}
+
+/** @brief Are downloaded blocks still waiting to be programmed? */
+bool usb_dfu_busy(usbd_dfu *dfu)
+{
+	return !dfu_idle(dfu);
+}
+
+/** @brief Initializes a DFU runtime interface.
+
+The runtime interface is part of the application firmware and only
+answers DFU_DETACH, DFU_GETSTATUS and DFU_GETSTATE.
+
+@param[in] usbd_dev The USB device to add the interface to.
+@param[in] iface Number of the DFU runtime interface.
+@param[in] detach Called after the DFU_DETACH request completes, usually
+	to reboot into the DFU mode firmware.
+*/
+void usb_dfu_runtime_init(usbd_device *usbd_dev, uint8_t iface,
+			  void (*detach)(void))
+{
+	_dfu_runtime.iface = iface;
+	_dfu_runtime.detach = detach;
+
+	usbd_register_set_config_callback(usbd_dev, dfu_runtime_set_config);
+}
+
+/** @} */
@@ -30,11 +30,88 @@
 #define dev_base_address (usbd_dev->driver->base_address)
 #define REBASE(x)        MMIO32((x) + (dev_base_address))
 
+/* Register polls in the interrupt path give up after this many reads. */
+#define DWC_WAIT_LOOPS	10000
+
 void dwc_set_address(usbd_device *usbd_dev, uint8_t addr)
 {
 	REBASE(OTG_DCFG) = (REBASE(OTG_DCFG) & ~OTG_DCFG_DAD) | (addr << 4);
 }
 
+static bool dwc_ep_is_iso(uint32_t epctl)
+{
+	return (epctl & OTG_DIEPCTL0_EPTYP_MASK) == OTG_DIEPCTLX_EPTYP_ISO;
+}
+
+/* DxEPCTL bit scheduling an isochronous transfer for the next frame. */
+static uint32_t dwc_next_frame(usbd_device *usbd_dev)
+{
+	if (REBASE(OTG_DSTS) & (1 << OTG_DSTS_FNSOF_SHIFT)) {
+		return OTG_DIEPCTLX_SEVNFRM;
+	}
+	return OTG_DIEPCTLX_SODDFRM;
+}
+
+/*
+ * Program an OUT endpoint for its next reception: what is left of a queued
+ * transfer, else a single packet. In DMA mode the data goes straight into
+ * the transfer buffer while at least one whole packet fits in it, and into
+ * the endpoint's rx buffer otherwise.
+ */
+static void dwc_out_arm(usbd_device *usbd_dev, uint8_t ep)
+{
+	struct usbd_transfer *xfer = NULL;
+	uint32_t doeptsiz = usbd_dev->doeptsiz[ep];
+	uint32_t addr = 0;
+	uint32_t pktcnt = 0;
+
+	if (ep) {
+		xfer = _usbd_transfer_find(usbd_dev, ep);
+	}
+
+	if (xfer) {
+		uint32_t left = xfer->len - xfer->done;
+
+		pktcnt = left / xfer->max_size;
+		if (!usbd_dev->dma && (left % xfer->max_size)) {
+			/* dwc_poll() clips the last packet to the buffer. */
+			pktcnt++;
+		}
+	}
+
+	if (pktcnt) {
+		pktcnt = MIN(pktcnt, OTG_DIEPSIZX_PKTCNT_MASK >>
+				     OTG_DIEPSIZX_PKTCNT_SHIFT);
+		pktcnt = MIN(pktcnt, OTG_DIEPSIZX_XFRSIZ_MASK / xfer->max_size);
+		doeptsiz = (pktcnt << OTG_DIEPSIZX_PKTCNT_SHIFT) |
+			   (pktcnt * xfer->max_size);
+		addr = (uint32_t)(xfer->buf + xfer->done);
+	} else if (usbd_dev->dma) {
+		addr = (uint32_t)usbd_dev->dma->rx[ep];
+	}
+
+	REBASE(OTG_DOEPTSIZ(ep)) = doeptsiz;
+	if (usbd_dev->dma) {
+		REBASE(OTG_DOEPDMA(ep)) = addr;
+		usbd_dev->dma->out_addr[ep] = addr;
+		usbd_dev->dma->out_size[ep] = doeptsiz &
+					      OTG_DIEPSIZX_XFRSIZ_MASK;
+	}
+}
+
+static void dwc_out_enable(usbd_device *usbd_dev, uint8_t ep)
+{
+	uint32_t ctl = OTG_DOEPCTL0_EPENA;
+
+	dwc_out_arm(usbd_dev, ep);
+	if (dwc_ep_is_iso(REBASE(OTG_DOEPCTL(ep)))) {
+		ctl |= dwc_next_frame(usbd_dev);
+	}
+	REBASE(OTG_DOEPCTL(ep)) |= ctl |
+		(usbd_dev->force_nak[ep] ?
+		 OTG_DOEPCTL0_SNAK : OTG_DOEPCTL0_CNAK);
+}
+
 void dwc_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
 			uint16_t max_size,
 			void (*callback) (usbd_device *usbd_dev, uint8_t ep))
@@ -45,6 +122,13 @@ void dwc_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
 	 */
 	uint8_t dir = addr & 0x80;
 	addr &= 0x7f;
+	type &= USB_ENDPOINT_ATTR_TYPE;
+
+	/* In DMA mode every OUT packet must fit the endpoint's rx buffer. */
+	if (usbd_dev->dma && ((addr >= DWC_DMA_EP_COUNT) ||
+			      (!dir && (max_size > DWC_DMA_RX_BUF_SIZE)))) {
+		return;
+	}
 
 	if (addr == 0) { /* For the default control endpoint */
 		/* Configure IN part. */
@@ -67,7 +151,7 @@ void dwc_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
 		usbd_dev->doeptsiz[0] = OTG_DIEPSIZ0_STUPCNT_1 |
 			OTG_DIEPSIZ0_PKTCNT |
 			(max_size & OTG_DIEPSIZ0_XFRSIZ_MASK);
-		REBASE(OTG_DOEPTSIZ(0)) = usbd_dev->doeptsiz[0];
+		dwc_out_arm(usbd_dev, 0);
 		REBASE(OTG_DOEPCTL(0)) |=
 		    OTG_DOEPCTL0_EPENA | OTG_DIEPCTL0_SNAK;
 
@@ -95,12 +179,16 @@ void dwc_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
 			usbd_dev->user_callback_ctr[addr][USB_TRANSACTION_IN] =
 			    (void *)callback;
 		}
+
+		if (type == USB_ENDPOINT_ATTR_ISOCHRONOUS) {
+			REBASE(OTG_GINTMSK) |= OTG_GINTMSK_IISOIXFRM;
+		}
 	}
 
 	if (!dir) {
 		usbd_dev->doeptsiz[addr] = OTG_DIEPSIZ0_PKTCNT |
-				 (max_size & OTG_DIEPSIZ0_XFRSIZ_MASK);
-		REBASE(OTG_DOEPTSIZ(addr)) = usbd_dev->doeptsiz[addr];
+				 (max_size & OTG_DIEPSIZX_XFRSIZ_MASK);
+		dwc_out_arm(usbd_dev, addr);
 		REBASE(OTG_DOEPCTL(addr)) |= OTG_DOEPCTL0_EPENA |
 		    OTG_DOEPCTL0_USBAEP | OTG_DIEPCTL0_CNAK |
 		    OTG_DOEPCTLX_SD0PID | (type << 18) | max_size;
@@ -109,6 +197,10 @@ void dwc_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
 			usbd_dev->user_callback_ctr[addr][USB_TRANSACTION_OUT] =
 			    (void *)callback;
 		}
+
+		if (type == USB_ENDPOINT_ATTR_ISOCHRONOUS) {
+			REBASE(OTG_GINTMSK) |= OTG_GINTMSK_IISOOXFRM;
+		}
 	}
 }
 
@@ -190,8 +282,8 @@ void dwc_ep_nak_set(usbd_device *usbd_dev, uint8_t addr, uint8_t nak)
 	}
 }
 
-uint16_t dwc_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
-			      const void *buf, uint16_t len)
+static void dwc_fifo_write(usbd_device *usbd_dev, uint8_t addr,
+			   const void *buf, uint16_t len)
 {
 	const uint32_t *buf32 = buf;
 #if defined(__ARM_ARCH_6M__)
@@ -200,18 +292,6 @@ uint16_t dwc_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
 #endif /* defined(__ARM_ARCH_6M__) */
 	int i;
 
-	addr &= 0x7F;
-
-	/* Return if endpoint is already enabled. */
-	if (REBASE(OTG_DIEPTSIZ(addr)) & OTG_DIEPSIZ0_PKTCNT) {
-		return 0;
-	}
-
-	/* Enable endpoint for transmission. */
-	REBASE(OTG_DIEPTSIZ(addr)) = OTG_DIEPSIZ0_PKTCNT | len;
-	REBASE(OTG_DIEPCTL(addr)) |= OTG_DIEPCTL0_EPENA |
-				     OTG_DIEPCTL0_CNAK;
-
 	/* Copy buffer to endpoint FIFO, note - memcpy does not work.
 	 * ARMv7M supports non-word-aligned accesses, ARMv6M does not. */
 #if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
@@ -234,6 +314,45 @@ uint16_t dwc_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
 		}
 	}
 #endif /* defined(__ARM_ARCH_6M__) */
+}
+
+uint16_t dwc_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
+			      const void *buf, uint16_t len)
+{
+	uint32_t tsiz = OTG_DIEPSIZ0_PKTCNT | len;
+	uint32_t ctl = OTG_DIEPCTL0_EPENA | OTG_DIEPCTL0_CNAK;
+
+	addr &= 0x7F;
+
+	/* Return if endpoint is already enabled. */
+	if (REBASE(OTG_DIEPTSIZ(addr)) & OTG_DIEPSIZ0_PKTCNT) {
+		return 0;
+	}
+
+	if (usbd_dev->dma) {
+		/* The core fetches the data itself once enabled. */
+		if (addr == 0) {
+			memcpy(usbd_dev->dma->ep0_tx, buf, len);
+			buf = usbd_dev->dma->ep0_tx;
+		} else if ((uint32_t)buf & 0x3) {
+			return 0;
+		}
+		REBASE(OTG_DIEPDMA(addr)) = (uint32_t)buf;
+	}
+
+	if (dwc_ep_is_iso(REBASE(OTG_DIEPCTL(addr)))) {
+		/* One packet, sent in the frame following this one. */
+		tsiz |= OTG_DIEPSIZX_MCNT_1;
+		ctl |= dwc_next_frame(usbd_dev);
+	}
+
+	/* Enable endpoint for transmission. */
+	REBASE(OTG_DIEPTSIZ(addr)) = tsiz;
+	REBASE(OTG_DIEPCTL(addr)) |= ctl;
+
+	if (!usbd_dev->dma) {
+		dwc_fifo_write(usbd_dev, addr, buf, len);
+	}
 
 	return len;
 }
@@ -249,11 +368,18 @@ uint16_t dwc_ep_read_packet(usbd_device *usbd_dev, uint8_t addr,
 #endif /* defined(__ARM_ARCH_6M__) */
 	uint32_t extra;
 
+	len = MIN(len, usbd_dev->rxbcnt);
+
+	if (usbd_dev->dma) {
+		/* The packet has already been stored by the core. */
+		memcpy(buf, usbd_dev->dma->rx[addr & 0x7f], len);
+		usbd_dev->rxbcnt = 0;
+		return len;
+	}
+
 	/* We do not need to know the endpoint address since there is only one
 	 * receive FIFO for all endpoints.
 	 */
-	(void) addr;
-	len = MIN(len, usbd_dev->rxbcnt);
 
 	/* ARMv7M supports non-word-aligned accesses, ARMv6M does not. */
 #if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
@@ -297,35 +423,278 @@ uint16_t dwc_ep_read_packet(usbd_device *usbd_dev, uint8_t addr,
 	return len;
 }
 
+/* Wait for an IN endpoint event without hanging the poll on a stuck core. */
+static bool dwc_in_wait(usbd_device *usbd_dev, int ep, uint32_t event)
+{
+	uint32_t i;
+
+	for (i = 0; i < DWC_WAIT_LOOPS; i++) {
+		if (REBASE(OTG_DIEPINT(ep)) & event) {
+			return true;
+		}
+	}
+	return false;
+}
+
 static void dwc_flush_txfifo(usbd_device *usbd_dev, int ep)
 {
 	uint32_t fifo;
+	uint32_t i;
 	/* set IN endpoint NAK */
 	REBASE(OTG_DIEPCTL(ep)) |= OTG_DIEPCTL0_SNAK;
 	/* wait for core to respond */
-	while (!(REBASE(OTG_DIEPINT(ep)) & OTG_DIEPINTX_INEPNE)) {
-		/* idle */
+	if (!dwc_in_wait(usbd_dev, ep, OTG_DIEPINTX_INEPNE)) {
+		return;
 	}
 	/* get fifo for this endpoint */
 	fifo = (REBASE(OTG_DIEPCTL(ep)) & OTG_DIEPCTL0_TXFNUM_MASK) >> 22;
 	/* wait for core to idle */
-	while (!(REBASE(OTG_GRSTCTL) & OTG_GRSTCTL_AHBIDL)) {
-		/* idle */
+	for (i = 0; !(REBASE(OTG_GRSTCTL) & OTG_GRSTCTL_AHBIDL); i++) {
+		if (i == DWC_WAIT_LOOPS) {
+			return;
+		}
 	}
 	/* flush tx fifo */
 	REBASE(OTG_GRSTCTL) = (fifo << 6) | OTG_GRSTCTL_TXFFLSH;
 	/* reset packet counter */
 	REBASE(OTG_DIEPTSIZ(ep)) = 0;
-	while ((REBASE(OTG_GRSTCTL) & OTG_GRSTCTL_TXFFLSH)) {
+	for (i = 0; (REBASE(OTG_GRSTCTL) & OTG_GRSTCTL_TXFFLSH) &&
+	     i < DWC_WAIT_LOOPS; i++) {
 		/* idle */
 	}
 }
 
+/*
+ * An isochronous IN packet was not fetched by the host in the frame it was
+ * scheduled for. Drop it, so that the endpoint callback can queue data for
+ * the coming frame instead of the stream stalling behind stale data.
+ * Only endpoints scheduled for the frame that just ended missed it; the
+ * others are armed for the next frame and must keep their packet.
+ */
+static void dwc_iso_in_incomplete(usbd_device *usbd_dev)
+{
+	bool odd_frame = REBASE(OTG_DSTS) & (1 << OTG_DSTS_FNSOF_SHIFT);
+	uint32_t ctl;
+	int i;
+
+	for (i = 1; i < 4; i++) {
+		ctl = REBASE(OTG_DIEPCTL(i));
+		if (!dwc_ep_is_iso(ctl) || !(ctl & OTG_DIEPCTL0_EPENA) ||
+		    (!!(ctl & OTG_DIEPCTLX_EONUM) != odd_frame)) {
+			continue;
+		}
+
+		REBASE(OTG_DIEPCTL(i)) |= OTG_DIEPCTL0_SNAK;
+		if (!dwc_in_wait(usbd_dev, i, OTG_DIEPINTX_INEPNE)) {
+			continue;
+		}
+		REBASE(OTG_DIEPCTL(i)) |= OTG_DIEPCTL0_EPDIS;
+		if (!dwc_in_wait(usbd_dev, i, OTG_DIEPINTX_EPDISD)) {
+			continue;
+		}
+		REBASE(OTG_DIEPINT(i)) = OTG_DIEPINTX_EPDISD;
+		dwc_flush_txfifo(usbd_dev, i);
+
+		if (usbd_dev->user_callback_ctr[i][USB_TRANSACTION_IN]) {
+			usbd_dev->user_callback_ctr[i]
+				[USB_TRANSACTION_IN](usbd_dev, i);
+		}
+	}
+}
+
+/* Nothing arrived in the frame an isochronous OUT was armed for. */
+static void dwc_iso_out_incomplete(usbd_device *usbd_dev)
+{
+	uint32_t ctl;
+	int i;
+
+	for (i = 1; i < 4; i++) {
+		ctl = REBASE(OTG_DOEPCTL(i));
+		if (dwc_ep_is_iso(ctl) && (ctl & OTG_DOEPCTL0_EPENA)) {
+			REBASE(OTG_DOEPCTL(i)) |= dwc_next_frame(usbd_dev);
+		}
+	}
+}
+
+/* Fill the TX FIFO with as many packets of an IN transfer as fit. */
+static void dwc_transfer_fill(usbd_device *usbd_dev,
+			      struct usbd_transfer *xfer)
+{
+	uint8_t ep = xfer->addr & 0x7f;
+	uint16_t len;
+
+	while (xfer->done < xfer->end) {
+		len = MIN(xfer->end - xfer->done, xfer->max_size);
+		if ((REBASE(OTG_DTXFSTS(ep)) & 0xffff) < (len + 3U) / 4) {
+			break;
+		}
+		dwc_fifo_write(usbd_dev, ep, xfer->buf + xfer->done, len);
+		xfer->done += len;
+	}
+
+	/* Get a TXFE event to continue once the FIFO has drained. */
+	if (xfer->done < xfer->end) {
+		REBASE(OTG_DIEPEMPMSK) |= 1 << ep;
+	} else {
+		REBASE(OTG_DIEPEMPMSK) &= ~(1 << ep);
+	}
+}
+
+static void dwc_transfer_in_start(usbd_device *usbd_dev,
+				  struct usbd_transfer *xfer, uint32_t len)
+{
+	uint8_t ep = xfer->addr & 0x7f;
+	uint32_t pktcnt = 1;
+	uint32_t max_pkts;
+
+	/* Longer transfers go in chunks of whole packets, see XFRC. */
+	max_pkts = MIN(OTG_DIEPSIZX_PKTCNT_MASK >> OTG_DIEPSIZX_PKTCNT_SHIFT,
+		       OTG_DIEPSIZX_XFRSIZ_MASK / xfer->max_size);
+	len = MIN(len, max_pkts * xfer->max_size);
+	if (len) {
+		pktcnt = (len + xfer->max_size - 1) / xfer->max_size;
+	}
+	xfer->end = xfer->done + len;
+
+	if (usbd_dev->dma) {
+		REBASE(OTG_DIEPDMA(ep)) = (uint32_t)(xfer->buf + xfer->done);
+	}
+	REBASE(OTG_DIEPTSIZ(ep)) = (pktcnt << OTG_DIEPSIZX_PKTCNT_SHIFT) | len;
+	REBASE(OTG_DIEPCTL(ep)) |= OTG_DIEPCTL0_EPENA | OTG_DIEPCTL0_CNAK;
+
+	if (usbd_dev->dma) {
+		xfer->done += len;
+	} else {
+		dwc_transfer_fill(usbd_dev, xfer);
+	}
+}
+
+static void dwc_transfer_in_done(usbd_device *usbd_dev,
+				 struct usbd_transfer *xfer)
+{
+	if (xfer->done < xfer->len) {
+		dwc_transfer_in_start(usbd_dev, xfer, xfer->len - xfer->done);
+		return;
+	}
+
+	if (xfer->zlp) {
+		xfer->zlp = false;
+		dwc_transfer_in_start(usbd_dev, xfer, 0);
+		return;
+	}
+
+	_usbd_transfer_complete(usbd_dev, xfer);
+}
+
+/*
+ * The core splits the whole transfer into packets by itself, so there is
+ * one XFRC event per transfer, or per chunk of a transfer too long for
+ * DIEPTSIZ, rather than one per packet. Only the FIFO refills are left to
+ * software when not running in DMA mode.
+ */
+int dwc_ep_transfer(usbd_device *usbd_dev, struct usbd_transfer *xfer)
+{
+	uint8_t ep = xfer->addr & 0x7f;
+
+	if (!xfer->max_size || ep > 3) {
+		return -1;
+	}
+
+	if (usbd_dev->dma && (((uint32_t)xfer->buf & 0x3) ||
+			      (xfer->max_size & 0x3))) {
+		return -1;
+	}
+
+	if (xfer->addr & 0x80) {
+		if (REBASE(OTG_DIEPTSIZ(ep)) & OTG_DIEPSIZX_PKTCNT_MASK) {
+			return -1;
+		}
+		dwc_transfer_in_start(usbd_dev, xfer, xfer->len);
+	}
+
+	/*
+	 * An OUT endpoint is always armed for one packet. The transfer takes
+	 * that packet over and the endpoint is then re-armed for the rest.
+	 */
+	return 0;
+}
+
+/* Account for an OUT transfer's data after XFRC in DMA mode. */
+static void dwc_dma_transfer_out(usbd_device *usbd_dev,
+				 struct usbd_transfer *xfer)
+{
+	uint8_t ep = xfer->addr;
+	uint32_t len = MIN(usbd_dev->rxbcnt, xfer->len - xfer->done);
+
+	if (usbd_dev->dma->out_addr[ep] == (uint32_t)usbd_dev->dma->rx[ep]) {
+		memcpy(xfer->buf + xfer->done, usbd_dev->dma->rx[ep], len);
+	}
+	xfer->done += len;
+
+	if (usbd_dev->rxbcnt < usbd_dev->dma->out_size[ep] ||
+	    xfer->done >= xfer->len) {
+		_usbd_transfer_complete(usbd_dev, xfer);
+	}
+}
+
+/*
+ * In DMA mode the receive FIFO is drained by the core, which reports
+ * completed SETUP and OUT transactions through the OUT endpoint interrupts.
+ */
+static void dwc_dma_poll_out(usbd_device *usbd_dev)
+{
+	struct usbd_transfer *xfer;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		uint32_t doepint = REBASE(OTG_DOEPINT(i));
+
+		if (doepint & OTG_DOEPINTX_STUP) {
+			/* DOEPDMA has been advanced past the SETUP packet. */
+			const void *setup =
+			    (const uint8_t *)REBASE(OTG_DOEPDMA(i)) - 8;
+
+			REBASE(OTG_DOEPINT(i)) = OTG_DOEPINTX_STUP |
+						 OTG_DOEPINTX_XFRC;
+			if (REBASE(OTG_DIEPTSIZ(i)) & OTG_DIEPSIZ0_PKTCNT) {
+				/* Drop IN data left over from the last request. */
+				dwc_flush_txfifo(usbd_dev, i);
+			}
+			memcpy(&usbd_dev->control_state.req, setup, 8);
+			dwc_out_enable(usbd_dev, i);
+
+			if (usbd_dev->user_callback_ctr[i]
+						[USB_TRANSACTION_SETUP]) {
+				usbd_dev->user_callback_ctr[i]
+					[USB_TRANSACTION_SETUP](usbd_dev, i);
+			}
+		} else if (doepint & OTG_DOEPINTX_XFRC) {
+			REBASE(OTG_DOEPINT(i)) = OTG_DOEPINTX_XFRC;
+			usbd_dev->rxbcnt = usbd_dev->dma->out_size[i] -
+					   (REBASE(OTG_DOEPTSIZ(i)) &
+					    OTG_DIEPSIZX_XFRSIZ_MASK);
+
+			xfer = i ? _usbd_transfer_find(usbd_dev, i) : NULL;
+			if (xfer) {
+				dwc_dma_transfer_out(usbd_dev, xfer);
+			} else if (usbd_dev->user_callback_ctr[i]
+						[USB_TRANSACTION_OUT]) {
+				usbd_dev->user_callback_ctr[i]
+					[USB_TRANSACTION_OUT](usbd_dev, i);
+			}
+
+			usbd_dev->rxbcnt = 0;
+			dwc_out_enable(usbd_dev, i);
+		}
+	}
+}
+
 void dwc_poll(usbd_device *usbd_dev)
 {
 	/* Read interrupt status register. */
 	uint32_t intsts = REBASE(OTG_GINTSTS);
-	int i;
+	struct usbd_transfer *xfer;
+	uint32_t i;
 
 	if (intsts & OTG_GINTSTS_ENUMDNE) {
 		/* Handle USB RESET condition. */
@@ -340,7 +709,21 @@ void dwc_poll(usbd_device *usbd_dev)
 	 * The XFRC bit must be checked in each OTG_DIEPINT(x).
 	 */
 	for (i = 0; i < 4; i++) { /* Iterate over endpoints. */
-		if (REBASE(OTG_DIEPINT(i)) & OTG_DIEPINTX_XFRC) {
+		xfer = i ? _usbd_transfer_find(usbd_dev, i | 0x80) : NULL;
+
+		if ((REBASE(OTG_DIEPEMPMSK) & (1 << i)) &&
+		    (REBASE(OTG_DIEPINT(i)) & OTG_DIEPINTX_TXFE)) {
+			if (xfer) {
+				dwc_transfer_fill(usbd_dev, xfer);
+			} else {
+				REBASE(OTG_DIEPEMPMSK) &= ~(1 << i);
+			}
+		}
+
+		if (xfer && (REBASE(OTG_DIEPINT(i)) & OTG_DIEPINTX_XFRC)) {
+			REBASE(OTG_DIEPINT(i)) = OTG_DIEPINTX_XFRC;
+			dwc_transfer_in_done(usbd_dev, xfer);
+		} else if (REBASE(OTG_DIEPINT(i)) & OTG_DIEPINTX_XFRC) {
 			/* Transfer complete. */
 			if (usbd_dev->user_callback_ctr[i]
 						       [USB_TRANSACTION_IN]) {
@@ -352,6 +735,20 @@ void dwc_poll(usbd_device *usbd_dev)
 		}
 	}
 
+	if (intsts & OTG_GINTSTS_IISOIXFR) {
+		REBASE(OTG_GINTSTS) = OTG_GINTSTS_IISOIXFR;
+		dwc_iso_in_incomplete(usbd_dev);
+	}
+
+	if (intsts & OTG_GINTSTS_INCOMPISOOUT) {
+		REBASE(OTG_GINTSTS) = OTG_GINTSTS_INCOMPISOOUT;
+		dwc_iso_out_incomplete(usbd_dev);
+	}
+
+	if (usbd_dev->dma) {
+		dwc_dma_poll_out(usbd_dev);
+	}
+
 	/* Note: RX and TX handled differently in this device. */
 	if (intsts & OTG_GINTSTS_RXFLVL) {
 		/* Receive FIFO non-empty. */
@@ -365,10 +762,12 @@ void dwc_poll(usbd_device *usbd_dev)
 
 		if (pktsts == OTG_GRXSTSP_PKTSTS_OUT_COMP
 			|| pktsts == OTG_GRXSTSP_PKTSTS_SETUP_COMP)  {
-			REBASE(OTG_DOEPTSIZ(ep)) = usbd_dev->doeptsiz[ep];
-			REBASE(OTG_DOEPCTL(ep)) |= OTG_DOEPCTL0_EPENA |
-				(usbd_dev->force_nak[ep] ?
-				 OTG_DOEPCTL0_SNAK : OTG_DOEPCTL0_CNAK);
+			xfer = ep ? _usbd_transfer_find(usbd_dev, ep) : NULL;
+			if (xfer && (xfer->chunk < xfer->max_size ||
+				     xfer->done >= xfer->len)) {
+				_usbd_transfer_complete(usbd_dev, xfer);
+			}
+			dwc_out_enable(usbd_dev, ep);
 			return;
 		}
 
@@ -395,8 +794,17 @@ void dwc_poll(usbd_device *usbd_dev)
 		/* Save packet size for dwc_ep_read_packet(). */
 		usbd_dev->rxbcnt = (rxstsp & OTG_GRXSTSP_BCNT_MASK) >> 4;
 
+		xfer = ep ? _usbd_transfer_find(usbd_dev, ep) : NULL;
+
 		if (type == USB_TRANSACTION_SETUP) {
 			dwc_ep_read_packet(usbd_dev, ep, &usbd_dev->control_state.req, 8);
+		} else if (xfer) {
+			/* Store the packet straight into the transfer buffer. */
+			xfer->chunk = usbd_dev->rxbcnt;
+			xfer->done += dwc_ep_read_packet(usbd_dev, ep,
+					xfer->buf + xfer->done,
+					MIN(xfer->len - xfer->done,
+					    xfer->max_size));
 		} else if (usbd_dev->user_callback_ctr[ep][type]) {
 			usbd_dev->user_callback_ctr[ep][type] (usbd_dev, ep);
 		}
@@ -438,6 +846,11 @@ void dwc_poll(usbd_device *usbd_dev)
 	}
 }
 
+uint16_t dwc_get_frame_number(usbd_device *usbd_dev)
+{
+	return (REBASE(OTG_DSTS) & OTG_DSTS_FNSOF_MASK) >> OTG_DSTS_FNSOF_SHIFT;
+}
+
 void dwc_disconnect(usbd_device *usbd_dev, bool disconnected)
 {
 	if (disconnected) {
@@ -20,6 +20,24 @@
 #ifndef __USB_DWC_COMMON_H_
 #define __USB_DWC_COMMON_H_
 
+/* Size in bytes of the per endpoint OUT buffers used in DMA mode. */
+#define DWC_DMA_RX_BUF_SIZE	512
+/* Endpoints, including 0, the DMA mode buffers are kept for. */
+#define DWC_DMA_EP_COUNT	4
+
+/*
+ * Memory the core's internal DMA transfers to and from when the driver runs
+ * in DMA mode. OUT packets always land in the per endpoint rx buffers, while
+ * ep0_tx bounces control IN data, which may live anywhere (e.g. flash).
+ */
+struct dwc_dma_bufs {
+	uint32_t rx[DWC_DMA_EP_COUNT][DWC_DMA_RX_BUF_SIZE / 4];
+	uint32_t ep0_tx[64 / 4];
+	/* Address and size each OUT endpoint was last armed with. */
+	uint32_t out_addr[DWC_DMA_EP_COUNT];
+	uint32_t out_size[DWC_DMA_EP_COUNT];
+};
+
 void dwc_set_address(usbd_device *usbd_dev, uint8_t addr);
 void dwc_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
 			uint16_t max_size,
@@ -32,7 +50,9 @@ uint16_t dwc_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
 				   const void *buf, uint16_t len);
 uint16_t dwc_ep_read_packet(usbd_device *usbd_dev, uint8_t addr,
 				  void *buf, uint16_t len);
+int dwc_ep_transfer(usbd_device *usbd_dev, struct usbd_transfer *xfer);
 void dwc_poll(usbd_device *usbd_dev);
+uint16_t dwc_get_frame_number(usbd_device *usbd_dev);
 void dwc_disconnect(usbd_device *usbd_dev, bool disconnected);
 
 
@@ -114,6 +114,7 @@ static void efm32lg_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
 	 */
 	uint8_t dir = addr & 0x80;
 	addr &= 0x7f;
+	type &= USB_ENDPOINT_ATTR_TYPE;
 
 	if (addr == 0) { /* For the default control endpoint */
 		/* Configure IN part. */
@@ -308,7 +309,7 @@ static void efm32lg_poll(usbd_device *usbd_dev)
 {
 	/* Read interrupt status register. */
 	uint32_t intsts = USB_GINTSTS;
-	int i;
+	uint32_t i;
 
 	if (intsts & USB_GINTSTS_ENUMDNE) {
 		/* Handle USB RESET condition. */
@@ -43,8 +43,10 @@ const struct _usbd_driver stm32f107_usb_driver = {
 	.ep_nak_set = dwc_ep_nak_set,
 	.ep_write_packet = dwc_ep_write_packet,
 	.ep_read_packet = dwc_ep_read_packet,
+	.ep_transfer = dwc_ep_transfer,
 	.poll = dwc_poll,
 	.disconnect = dwc_disconnect,
+	.get_frame_number = dwc_get_frame_number,
 	.base_address = USB_OTG_FS_BASE,
 	.set_address_before_status = 1,
 	.rx_fifo_size = RX_FIFO_SIZE,
@@ -30,8 +30,10 @@
 #define RX_FIFO_SIZE 512
 
 static usbd_device *stm32f207_usbd_init(void);
+static usbd_device *stm32f207_dma_usbd_init(void);
 
 static struct _usbd_device usbd_dev;
+static struct dwc_dma_bufs dma_bufs;
 
 const struct _usbd_driver stm32f207_usb_driver = {
 	.init = stm32f207_usbd_init,
@@ -43,8 +45,29 @@ const struct _usbd_driver stm32f207_usb_driver = {
 	.ep_nak_set = dwc_ep_nak_set,
 	.ep_write_packet = dwc_ep_write_packet,
 	.ep_read_packet = dwc_ep_read_packet,
+	.ep_transfer = dwc_ep_transfer,
 	.poll = dwc_poll,
 	.disconnect = dwc_disconnect,
+	.get_frame_number = dwc_get_frame_number,
+	.base_address = USB_OTG_HS_BASE,
+	.set_address_before_status = 1,
+	.rx_fifo_size = RX_FIFO_SIZE,
+};
+
+const struct _usbd_driver stm32f207_dma_usb_driver = {
+	.init = stm32f207_dma_usbd_init,
+	.set_address = dwc_set_address,
+	.ep_setup = dwc_ep_setup,
+	.ep_reset = dwc_endpoints_reset,
+	.ep_stall_set = dwc_ep_stall_set,
+	.ep_stall_get = dwc_ep_stall_get,
+	.ep_nak_set = dwc_ep_nak_set,
+	.ep_write_packet = dwc_ep_write_packet,
+	.ep_read_packet = dwc_ep_read_packet,
+	.ep_transfer = dwc_ep_transfer,
+	.poll = dwc_poll,
+	.disconnect = dwc_disconnect,
+	.get_frame_number = dwc_get_frame_number,
 	.base_address = USB_OTG_HS_BASE,
 	.set_address_before_status = 1,
 	.rx_fifo_size = RX_FIFO_SIZE,
@@ -77,6 +100,7 @@ static usbd_device *stm32f207_usbd_init(void)
 
 	OTG_HS_GRXFSIZ = stm32f207_usb_driver.rx_fifo_size;
 	usbd_dev.fifo_mem_top = stm32f207_usb_driver.rx_fifo_size;
+	usbd_dev.dma = NULL;
 
 	/* Unmask interrupts for TX and RX. */
 	OTG_HS_GAHBCFG |= OTG_GAHBCFG_GINT;
@@ -90,3 +114,20 @@ static usbd_device *stm32f207_usbd_init(void)
 
 	return &usbd_dev;
 }
+
+/** Initialize the USB device controller hardware of the STM32 for DMA mode. */
+static usbd_device *stm32f207_dma_usbd_init(void)
+{
+	stm32f207_usbd_init();
+	usbd_dev.dma = &dma_bufs;
+
+	OTG_HS_GAHBCFG |= OTG_GAHBCFG_DMAEN | OTG_GAHBCFG_HBSTLEN_INCR4;
+
+	/* Received packets are reported per endpoint, not by the RX FIFO. */
+	OTG_HS_GINTMSK = (OTG_HS_GINTMSK & ~OTG_GINTMSK_RXFLVLM) |
+			 OTG_GINTMSK_OEPINT;
+	OTG_HS_DAINTMSK |= 0xF << 16;
+	OTG_HS_DOEPMSK = OTG_DOEPMSK_XFRCM | OTG_DOEPMSK_STUPM;
+
+	return &usbd_dev;
+}
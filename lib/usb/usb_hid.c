@@ -15,6 +15,372 @@
  * along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * HID function with a queue of input reports.
+ *
+ * Reports are queued by the application and released to the interrupt IN
+ * endpoint at most once per polling interval, counted in SOFs. A report
+ * stays in the queue until the interval it is due in, so a newer report
+ * with the same ID can still replace it instead of taking another slot.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <libopencm3/usb/usbd.h>
 #include <libopencm3/usb/hid.h>
+#include "usb_private.h"
+
+#define HID_BARRIER()		__asm__ __volatile__("" : : : "memory")
+
+/* No slot is being rewritten by usb_hid_send() */
+#define HID_SLOT_NONE		0xff
+
+struct _usbd_hid {
+	usbd_device *usbd_dev;
+	uint8_t iface;
+	uint8_t ep_in;
+	uint16_t max_packet;
+	uint8_t interval;		/* In SOFs, 0 to send when idle */
+	bool report_ids;
+	const uint8_t *report_desc;
+	uint16_t report_desc_len;
+	usb_hid_report_callback report_cb;
+
+	uint8_t *buf;
+	uint8_t count;			/* Number of slots */
+	uint16_t len[USB_HID_MAX_QUEUE];
+	volatile uint8_t head;		/* Written by the application */
+	volatile uint8_t tail;		/* Released once sent */
+	volatile uint8_t writing;	/* Slot being coalesced into */
+	volatile bool busy;		/* The tail slot is on the bus */
+	volatile bool configured;
+	uint8_t frames;			/* SOFs since the last release */
+
+	uint8_t idle_rate;
+	uint8_t protocol;
+};
+
+static usbd_hid _hid;
+
+static uint8_t *hid_slot(usbd_hid *hid, uint8_t seq)
+{
+	return &hid->buf[(seq % hid->count) * hid->max_packet];
+}
+
+/* Put the oldest queued report on the bus, if the endpoint is free. */
+static void hid_kick(usbd_hid *hid)
+{
+	uint8_t seq = hid->tail;
+
+	if (hid->busy || seq == hid->head ||
+	    seq % hid->count == hid->writing) {
+		return;
+	}
+	if (usbd_ep_write_packet(hid->usbd_dev, hid->ep_in, hid_slot(hid, seq),
+				 hid->len[seq % hid->count]) == 0) {
+		return;
+	}
+	hid->busy = true;
+}
+
+static void hid_in_cb(usbd_device *usbd_dev, uint8_t ep)
+{
+	usbd_hid *hid = &_hid;
+
+	(void)usbd_dev;
+	(void)ep;
+
+	hid->tail++;
+	hid->busy = false;
+	if (!hid->interval) {
+		hid_kick(hid);
+	}
+}
+
+static void hid_sof_cb(void)
+{
+	usb_hid_sof(&_hid);
+}
+
+static enum usbd_request_return_codes hid_descriptor_request(
+	usbd_device *usbd_dev, struct usb_setup_data *req, uint8_t **buf,
+	uint16_t *len, usbd_control_complete_callback *complete)
+{
+	usbd_hid *hid = &_hid;
+
+	(void)usbd_dev;
+	(void)complete;
+
+	if (req->wIndex != hid->iface ||
+	    req->bRequest != USB_REQ_GET_DESCRIPTOR ||
+	    req->wValue >> 8 != USB_HID_DT_REPORT) {
+		return USBD_REQ_NEXT_CALLBACK;
+	}
+
+	*buf = (uint8_t *)hid->report_desc;
+	*len = MIN(*len, hid->report_desc_len);
+	return USBD_REQ_HANDLED;
+}
+
+static enum usbd_request_return_codes hid_class_request(
+	usbd_device *usbd_dev, struct usb_setup_data *req, uint8_t **buf,
+	uint16_t *len, usbd_control_complete_callback *complete)
+{
+	usbd_hid *hid = &_hid;
+	bool get = req->bRequest == USB_HID_REQ_TYPE_GET_REPORT;
+
+	(void)usbd_dev;
+	(void)complete;
+
+	if (req->wIndex != hid->iface) {
+		return USBD_REQ_NEXT_CALLBACK;
+	}
+
+	switch (req->bRequest) {
+	case USB_HID_REQ_TYPE_GET_REPORT:
+	case USB_HID_REQ_TYPE_SET_REPORT:
+		if (!hid->report_cb ||
+		    hid->report_cb(hid, get, req->wValue >> 8,
+				   req->wValue & 0xff, *buf, len)) {
+			return USBD_REQ_NOTSUPP;
+		}
+		return USBD_REQ_HANDLED;
+	case USB_HID_REQ_TYPE_GET_IDLE:
+		(*buf)[0] = hid->idle_rate;
+		*len = MIN(*len, 1);
+		return USBD_REQ_HANDLED;
+	case USB_HID_REQ_TYPE_SET_IDLE:
+		/* Reports are only sent on change, whatever the rate. */
+		hid->idle_rate = req->wValue >> 8;
+		return USBD_REQ_HANDLED;
+	case USB_HID_REQ_TYPE_GET_PROTOCOL:
+		(*buf)[0] = hid->protocol;
+		*len = MIN(*len, 1);
+		return USBD_REQ_HANDLED;
+	case USB_HID_REQ_TYPE_SET_PROTOCOL:
+		hid->protocol = req->wValue;
+		return USBD_REQ_HANDLED;
+	}
+
+	return USBD_REQ_NOTSUPP;
+}
+
+static void hid_set_config(usbd_device *usbd_dev, uint16_t wValue)
+{
+	usbd_hid *hid = &_hid;
+
+	(void)wValue;
+
+	hid->configured = false;
+	hid->busy = false;
+	hid->tail = hid->head;
+	hid->frames = 0;
+	hid->idle_rate = 0;
+	hid->protocol = USB_HID_PROTOCOL_REPORT;
+
+	usbd_ep_setup(usbd_dev, hid->ep_in, USB_ENDPOINT_ATTR_INTERRUPT,
+		      hid->max_packet, hid_in_cb);
+
+	usbd_register_control_callback(
+				usbd_dev,
+				USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_INTERFACE,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				hid_descriptor_request);
+	usbd_register_control_callback(
+				usbd_dev,
+				USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				hid_class_request);
+
+	hid->configured = true;
+}
+
+/** @addtogroup usb_hid */
+/** @{ */
+
+/** @brief Initializes the HID function.
+
+The function answers the report descriptor request, the HID class requests,
+and sends the input reports queued with usb_hid_send() on @a ep_in. This
+registers the device's SOF callback. An application that needs SOF itself
+registers its own callback afterwards and calls usb_hid_sof() from it.
+
+@note Only one HID function can be active.
+
+@param[in] usbd_dev The USB device to add the function to.
+@param[in] iface Number of the HID interface.
+@param[in] ep_in The interrupt IN endpoint.
+@param[in] max_packet Max packet size of @a ep_in, the largest report.
+@param[in] interval Number of SOFs between two reports, bInterval at full
+	speed. With 0, reports are sent as soon as the endpoint is free and
+	are never coalesced with one already queued.
+@param[in] report_desc The report descriptor, must stay valid.
+@param[in] report_desc_len Size of @a report_desc.
+@param[in] report_ids Reports start with a report ID byte.
+@param[in] arena Memory for the queue, @a max_packet bytes per report. The
+	number of reports is rounded down to a power of two.
+@param[in] arena_size Size of @a arena.
+
+@return The HID function, or NULL if @a arena holds no report.
+*/
+usbd_hid *usb_hid_init(usbd_device *usbd_dev, uint8_t iface, uint8_t ep_in,
+		       uint16_t max_packet, uint8_t interval,
+		       const uint8_t *report_desc, uint16_t report_desc_len,
+		       bool report_ids, void *arena, uint32_t arena_size)
+{
+	usbd_hid *hid = &_hid;
+	uint32_t count = max_packet ? arena_size / max_packet : 0;
+
+	if (!count) {
+		return NULL;
+	}
+
+	hid->usbd_dev = usbd_dev;
+	hid->iface = iface;
+	hid->ep_in = ep_in;
+	hid->max_packet = max_packet;
+	hid->interval = interval;
+	hid->report_desc = report_desc;
+	hid->report_desc_len = report_desc_len;
+	hid->report_ids = report_ids;
+	hid->report_cb = NULL;
+	hid->buf = arena;
+	/* A power of two, so that slots follow the wrapping indices. */
+	hid->count = USB_HID_MAX_QUEUE;
+	while (hid->count > count) {
+		hid->count >>= 1;
+	}
+	hid->head = 0;
+	hid->tail = 0;
+	hid->writing = HID_SLOT_NONE;
+	hid->busy = false;
+	hid->configured = false;
+
+	usbd_register_set_config_callback(usbd_dev, hid_set_config);
+	if (interval) {
+		usbd_register_sof_callback(usbd_dev, hid_sof_cb);
+	}
+
+	return hid;
+}
+
+/** @brief Register a callback for GET_REPORT and SET_REPORT requests.
+
+Without a callback both requests are stalled.
+*/
+void usb_hid_register_report_callback(usbd_hid *hid,
+				      usb_hid_report_callback callback)
+{
+	hid->report_cb = callback;
+}
+
+/** @brief Queue an input report.
+
+With @a coalesce, a queued report that has not been put on the bus yet and
+has the same report ID is overwritten instead, as only the latest state of
+that report matters to the host.
+
+@note Without an interval, starting an idle IN endpoint goes through the
+usbd driver, so when usbd_poll() runs from the USB interrupt, that interrupt
+must not preempt this function.
+
+@param[in] hid The HID function.
+@param[in] report The report, with its ID byte if reports have IDs.
+@param[in] len Size of @a report, at most the endpoint max packet size.
+@param[in] coalesce Replace a pending report with the same ID.
+@return 0 if queued, 1 if a pending report was replaced, -1 if the queue
+	is full, the device is not configured or @a len is invalid.
+*/
+int usb_hid_send(usbd_hid *hid, const void *report, uint16_t len,
+		 bool coalesce)
+{
+	uint8_t id = hid->report_ids ? *(const uint8_t *)report : 0;
+	uint8_t seq;
+	uint8_t slot;
+
+	if (!hid->configured || !len || len > hid->max_packet) {
+		return -1;
+	}
+
+	if (coalesce && hid->interval) {
+		/* The newest pending report with that ID, if any. */
+		for (seq = hid->head; seq != hid->tail; ) {
+			seq--;
+			slot = seq % hid->count;
+			if (hid->report_ids && hid_slot(hid, seq)[0] != id) {
+				continue;
+			}
+			/*
+			 * The interrupt cannot take the slot once it is marked.
+			 * Check it was neither taken nor already sent and
+			 * retired before that, else append instead.
+			 */
+			hid->writing = slot;
+			HID_BARRIER();
+			if ((uint8_t)(seq - hid->tail) >=
+			    (uint8_t)(hid->head - hid->tail) ||
+			    (hid->busy && hid->tail == seq)) {
+				hid->writing = HID_SLOT_NONE;
+				break;
+			}
+			memcpy(hid_slot(hid, seq), report, len);
+			hid->len[slot] = len;
+			HID_BARRIER();
+			hid->writing = HID_SLOT_NONE;
+			return 1;
+		}
+	}
+
+	seq = hid->head;
+	if ((uint8_t)(seq - hid->tail) >= hid->count) {
+		return -1;
+	}
+	memcpy(hid_slot(hid, seq), report, len);
+	hid->len[seq % hid->count] = len;
+	HID_BARRIER();
+	hid->head = seq + 1;
+
+	if (!hid->interval && hid->configured) {
+		hid_kick(hid);
+	}
+	return 0;
+}
+
+/** @brief Number of reports queued or on the bus. */
+uint8_t usb_hid_queued(usbd_hid *hid)
+{
+	return hid->head - hid->tail;
+}
+
+/** @brief Protocol selected by the host, USB_HID_PROTOCOL_*. */
+uint8_t usb_hid_protocol(usbd_hid *hid)
+{
+	return hid->protocol;
+}
+
+/** @brief Release the next report once per interval.
+
+Registered as the SOF callback by usb_hid_init(), to be called from the
+application's SOF callback if it registers one.
+*/
+void usb_hid_sof(usbd_hid *hid)
+{
+	if (!hid->configured || !hid->interval) {
+		return;
+	}
+	if (hid->frames < hid->interval) {
+		hid->frames++;
+	}
+	if (hid->frames < hid->interval || hid->busy) {
+		return;
+	}
+	if (hid->head != hid->tail) {
+		hid_kick(hid);
+		if (hid->busy) {
+			hid->frames = 0;
+		}
+	}
+}
 
-/* This stub exists just to trick doxygen. */
\ No newline at end of file
+/** @} */
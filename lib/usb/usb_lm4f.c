@@ -189,7 +189,6 @@ static void lm4f_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
 			  void (*callback) (usbd_device *usbd_dev, uint8_t ep))
 {
 	(void)usbd_dev;
-	(void)type;
 
 	uint8_t reg8;
 	uint16_t fifo_size;
@@ -197,6 +196,8 @@ static void lm4f_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
 	const bool dir_tx = addr & 0x80;
 	const uint8_t ep = addr & 0x0f;
 
+	type &= USB_ENDPOINT_ATTR_TYPE;
+
 	/*
 	 * We do not mess with the maximum packet size, but we can only allocate
 	 * the FIFO in power-of-two increments.
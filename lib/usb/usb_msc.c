@@ -58,6 +58,13 @@
 #define SCSI_SEND_DIAGNOSTIC			0x1D
 #define SCSI_READ_CAPACITY			0x25
 #define SCSI_READ_10				0x28
+#define SCSI_READ_16				0x88
+#define SCSI_WRITE_16				0x8A
+#define SCSI_SERVICE_ACTION_IN_16		0x9E
+#define SCSI_SYNCHRONIZE_CACHE_16		0x91
+
+/* SERVICE ACTION IN(16) service actions */
+#define SCSI_SAI_READ_CAPACITY_16		0x10
 
 
 /* Required SCSI Commands */
@@ -103,6 +110,7 @@ enum sbc_asc {
 	SBC_ASC_INVALID_COMMAND_OPERATION_CODE	= 0x20,
 	SBC_ASC_LBA_OUT_OF_RANGE		= 0x21,
 	SBC_ASC_INVALID_FIELD_IN_CDB		= 0x24,
+	SBC_ASC_LOGICAL_UNIT_NOT_SUPPORTED	= 0x25,
 	SBC_ASC_WRITE_PROTECTED			= 0x27,
 	SBC_ASC_NOT_READY_TO_READY_CHANGE	= 0x28,
 	SBC_ASC_FORMAT_ERROR			= 0x31,
@@ -138,6 +146,87 @@ struct usb_msc_csw {
 	uint8_t  bCSWStatus;
 } __attribute__((packed));
 
+/* Buffers of the pipelined block I/O, see usb_msc_set_pipeline() */
+#define MSC_MAX_PIPE_BUFS			4
+
+enum msc_buf_state {
+	MSC_BUF_FREE,
+	MSC_BUF_BUSY,
+	MSC_BUF_FULL
+};
+
+/*
+ * The pipeline has two stages running concurrently on a ring of buffers:
+ * the block device and the bulk endpoint. Reads go block device -> USB,
+ * writes USB -> block device, so while one buffer is on the bus the next
+ * one is already being read or written.
+ */
+struct usb_msc_pipe {
+	uint8_t buf_count;		/* 0 if pipelining is disabled */
+	uint8_t *buf[MSC_MAX_PIPE_BUFS];
+	uint32_t buf_size;		/* Size of each buffer in bytes */
+	uint32_t buf_blocks;		/* Capacity of each buffer in blocks */
+	uint32_t blocks[MSC_MAX_PIPE_BUFS];
+	uint8_t state[MSC_MAX_PIPE_BUFS];
+
+	int (*read_blocks)(uint8_t lun, uint64_t lba, uint32_t count,
+			   uint8_t *copy_to);
+	int (*write_blocks)(uint8_t lun, uint64_t lba, uint32_t count,
+			    const uint8_t *copy_from);
+
+	bool active;
+	bool reading;
+	bool io_busy;
+	bool usb_busy;
+	bool out_pending;		/* OUT packet left in the endpoint */
+	uint8_t io_idx;
+	uint8_t usb_idx;
+	uint64_t io_lba;		/* First block of the I/O in flight */
+	uint32_t io_block;		/* Blocks handed to the block device */
+	uint32_t usb_block;		/* Blocks moved over the bus */
+	uint32_t usb_pre;		/* Bytes of the buffer read by hand */
+	int status;
+};
+
+#define MSC_MAX_LUNS				4
+
+struct usb_msc_lun {
+	uint64_t last_lba;
+	uint16_t block_size;
+
+	/* LUN 0 as set up by usb_msc_init() has 32-bit LBA callbacks. */
+	int (*read_block)(uint32_t lba, uint8_t *copy_to);
+	int (*write_block)(uint32_t lba, const uint8_t *copy_from);
+	int (*read_block64)(uint64_t lba, uint8_t *copy_to);
+	int (*write_block64)(uint64_t lba, const uint8_t *copy_from);
+	int (*flush)(void);
+};
+
+/* Flags of a sector cache line */
+#define MSC_CACHE_VALID				0x01
+#define MSC_CACHE_DIRTY				0x02
+
+struct usb_msc_cache_line {
+	uint64_t lba;
+	uint32_t stamp;			/* Time of last use, for LRU */
+	uint8_t lun;
+	uint8_t flags;
+};
+
+/*
+ * Write-back LRU cache of single blocks, see usb_msc_set_cache(). Line data
+ * and the line table both live in the arena supplied by the application.
+ */
+struct usb_msc_cache {
+	uint16_t line_count;		/* 0 if caching is disabled */
+	uint16_t line_size;
+	uint8_t *data;
+	struct usb_msc_cache_line *line;
+	uint32_t stamp;
+	uint32_t idle_ticks;		/* Flush after this many idle ticks */
+	uint32_t idle;
+};
+
 struct sbc_sense_info {
 	uint8_t key;
 	uint8_t asc;
@@ -156,7 +245,8 @@ struct usb_msc_trans {
 	uint32_t byte_count;		/* Either read until equal to
 					   bytes_to_read or write until equal
 					   to bytes_to_write. */
-	uint32_t lba_start;
+	uint8_t lun;
+	uint64_t lba_start;
 	uint32_t block_count;
 	uint32_t current_block;
 
@@ -180,16 +270,17 @@ struct _usbd_mass_storage {
 	const char *vendor_id;
 	const char *product_id;
 	const char *product_revision_level;
-	uint32_t block_count;
 
-	int (*read_block)(uint32_t lba, uint8_t *copy_to);
-	int (*write_block)(uint32_t lba, const uint8_t *copy_from);
+	uint8_t lun_count;
+	struct usb_msc_lun lun[MSC_MAX_LUNS];
 
 	void (*lock)(void);
 	void (*unlock)(void);
 
 	struct usb_msc_trans trans;
 	struct sbc_sense_info sense;
+	struct usb_msc_pipe pipe;
+	struct usb_msc_cache cache;
 };
 
 static usbd_mass_storage _mass_storage;
@@ -256,6 +347,302 @@ static uint8_t *get_cbw_buf(struct usb_msc_trans *trans)
 	return &trans->cbw.cbw.CBWCB[0];
 }
 
+static struct usb_msc_lun *get_lun(usbd_mass_storage *ms)
+{
+	return &ms->lun[ms->trans.lun];
+}
+
+static uint32_t get_be32(const uint8_t *buf)
+{
+	return (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+static uint64_t get_be64(const uint8_t *buf)
+{
+	return ((uint64_t)get_be32(buf) << 32) | get_be32(&buf[4]);
+}
+
+static void put_be32(uint8_t *buf, uint32_t val)
+{
+	buf[0] = val >> 24;
+	buf[1] = 0xff & (val >> 16);
+	buf[2] = 0xff & (val >> 8);
+	buf[3] = 0xff & val;
+}
+
+static int msc_dev_read_block(usbd_mass_storage *ms, uint8_t lun_nr,
+			      uint64_t lba, uint8_t *copy_to)
+{
+	struct usb_msc_lun *lun = &ms->lun[lun_nr];
+
+	if (NULL != lun->read_block64) {
+		return (*lun->read_block64)(lba, copy_to);
+	}
+	return (*lun->read_block)(lba, copy_to);
+}
+
+static int msc_dev_write_block(usbd_mass_storage *ms, uint8_t lun_nr,
+			       uint64_t lba, const uint8_t *copy_from)
+{
+	struct usb_msc_lun *lun = &ms->lun[lun_nr];
+
+	if (NULL != lun->write_block64) {
+		return (*lun->write_block64)(lba, copy_from);
+	}
+	return (*lun->write_block)(lba, copy_from);
+}
+
+/*-- Sector Cache ------------------------------------------------------------*/
+
+static uint8_t *msc_cache_data(usbd_mass_storage *ms,
+			       struct usb_msc_cache_line *line)
+{
+	struct usb_msc_cache *cache = &ms->cache;
+
+	return &cache->data[(line - cache->line) * cache->line_size];
+}
+
+static struct usb_msc_cache_line *msc_cache_find(usbd_mass_storage *ms,
+						 uint8_t lun, uint64_t lba)
+{
+	struct usb_msc_cache *cache = &ms->cache;
+	uint16_t i;
+
+	for (i = 0; i < cache->line_count; i++) {
+		if ((cache->line[i].flags & MSC_CACHE_VALID) &&
+		    (cache->line[i].lun == lun) &&
+		    (cache->line[i].lba == lba)) {
+			cache->line[i].stamp = ++cache->stamp;
+			return &cache->line[i];
+		}
+	}
+
+	return NULL;
+}
+
+static int msc_cache_writeback(usbd_mass_storage *ms,
+			       struct usb_msc_cache_line *line)
+{
+	int ret = 0;
+
+	if (line->flags & MSC_CACHE_DIRTY) {
+		ret = msc_dev_write_block(ms, line->lun, line->lba,
+					  msc_cache_data(ms, line));
+		if (0 == ret) {
+			line->flags &= ~MSC_CACHE_DIRTY;
+		}
+	}
+
+	return ret;
+}
+
+/* Make room for a block, writing back the least recently used one. */
+static struct usb_msc_cache_line *msc_cache_alloc(usbd_mass_storage *ms,
+						  uint8_t lun, uint64_t lba)
+{
+	struct usb_msc_cache *cache = &ms->cache;
+	struct usb_msc_cache_line *line = &cache->line[0];
+	uint16_t i;
+
+	for (i = 0; i < cache->line_count; i++) {
+		if (!(cache->line[i].flags & MSC_CACHE_VALID)) {
+			line = &cache->line[i];
+			break;
+		}
+		if (cache->line[i].stamp < line->stamp) {
+			line = &cache->line[i];
+		}
+	}
+
+	if (0 != msc_cache_writeback(ms, line)) {
+		return NULL;
+	}
+
+	line->lun = lun;
+	line->lba = lba;
+	line->flags = MSC_CACHE_VALID;
+	line->stamp = ++cache->stamp;
+
+	return line;
+}
+
+static int msc_cache_flush(usbd_mass_storage *ms, uint8_t lun)
+{
+	struct usb_msc_cache *cache = &ms->cache;
+	int ret = 0;
+	uint16_t i;
+
+	for (i = 0; i < cache->line_count; i++) {
+		if ((cache->line[i].lun == lun) &&
+		    (0 != msc_cache_writeback(ms, &cache->line[i]))) {
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+/* Forget blocks that are about to be overwritten behind the cache. */
+static void msc_cache_drop(usbd_mass_storage *ms, uint8_t lun,
+			   uint64_t lba, uint64_t count)
+{
+	struct usb_msc_cache *cache = &ms->cache;
+	uint16_t i;
+
+	for (i = 0; i < cache->line_count; i++) {
+		if ((cache->line[i].lun == lun) &&
+		    (cache->line[i].lba >= lba) &&
+		    (cache->line[i].lba - lba < count)) {
+			cache->line[i].flags = 0;
+		}
+	}
+}
+
+/*
+ * Only short accesses go through the cache, FAT and directory updates
+ * typically. Bulk file data would just evict them.
+ */
+static bool msc_cache_small(usbd_mass_storage *ms, uint32_t count)
+{
+	return count <= ms->cache.line_count / 2;
+}
+
+static int msc_read_block(usbd_mass_storage *ms, uint64_t lba,
+			  uint8_t *copy_to)
+{
+	uint8_t lun = ms->trans.lun;
+	uint16_t size = get_lun(ms)->block_size;
+	struct usb_msc_cache_line *line;
+	int ret;
+
+	if (0 == ms->cache.line_count) {
+		return msc_dev_read_block(ms, lun, lba, copy_to);
+	}
+
+	line = msc_cache_find(ms, lun, lba);
+	if (NULL != line) {
+		memcpy(copy_to, msc_cache_data(ms, line), size);
+		return 0;
+	}
+
+	ret = msc_dev_read_block(ms, lun, lba, copy_to);
+	if (0 == ret) {
+		line = msc_cache_alloc(ms, lun, lba);
+		if (NULL != line) {
+			memcpy(msc_cache_data(ms, line), copy_to, size);
+		}
+	}
+
+	return ret;
+}
+
+static int msc_write_block(usbd_mass_storage *ms, uint64_t lba,
+			   const uint8_t *copy_from)
+{
+	uint8_t lun = ms->trans.lun;
+	struct usb_msc_cache_line *line;
+
+	if (0 == ms->cache.line_count) {
+		return msc_dev_write_block(ms, lun, lba, copy_from);
+	}
+
+	line = msc_cache_find(ms, lun, lba);
+	if (NULL == line) {
+		line = msc_cache_alloc(ms, lun, lba);
+	}
+	if (NULL == line) {
+		/* Write-back of the victim failed, keep it and go direct. */
+		return msc_dev_write_block(ms, lun, lba, copy_from);
+	}
+
+	memcpy(msc_cache_data(ms, line), copy_from,
+	       get_lun(ms)->block_size);
+	line->flags |= MSC_CACHE_DIRTY;
+
+	return 0;
+}
+
+/* Serve a pipelined read from the cache if all of it is there. */
+static bool msc_cache_read_blocks(usbd_mass_storage *ms, uint64_t lba,
+				  uint32_t count, uint8_t *copy_to)
+{
+	uint16_t size = get_lun(ms)->block_size;
+	struct usb_msc_cache_line *line;
+	uint32_t i;
+
+	if (!msc_cache_small(ms, count)) {
+		return false;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (NULL == msc_cache_find(ms, ms->trans.lun, lba + i)) {
+			return false;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		line = msc_cache_find(ms, ms->trans.lun, lba + i);
+		memcpy(&copy_to[i * size], msc_cache_data(ms, line), size);
+	}
+
+	return true;
+}
+
+/*
+ * Merge blocks read behind the cache with it: dirty lines are newer than
+ * the media, and short reads are kept for next time.
+ */
+static void msc_cache_fill_blocks(usbd_mass_storage *ms, uint64_t lba,
+				  uint32_t count, uint8_t *buf)
+{
+	uint16_t size = get_lun(ms)->block_size;
+	bool small = msc_cache_small(ms, count);
+	struct usb_msc_cache_line *line;
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		line = msc_cache_find(ms, ms->trans.lun, lba + i);
+		if ((NULL != line) && (line->flags & MSC_CACHE_DIRTY)) {
+			memcpy(&buf[i * size], msc_cache_data(ms, line), size);
+		} else if ((NULL == line) && small) {
+			line = msc_cache_alloc(ms, ms->trans.lun, lba + i);
+			if (NULL != line) {
+				memcpy(msc_cache_data(ms, line),
+				       &buf[i * size], size);
+			}
+		}
+	}
+}
+
+static void scsi_rw_setup(usbd_mass_storage *ms,
+			  struct usb_msc_trans *trans,
+			  uint64_t lba, uint32_t count, bool read)
+{
+	uint64_t last_lba = get_lun(ms)->last_lba;
+	uint16_t size = get_lun(ms)->block_size;
+
+	/* The whole range must exist and its length fit the byte counts. */
+	if ((lba > last_lba) ||
+	    ((0 < count) && (count - 1 > last_lba - lba)) ||
+	    (count > UINT32_MAX / size)) {
+		set_sbc_status(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+			       SBC_ASC_LBA_OUT_OF_RANGE,
+			       SBC_ASCQ_NA);
+		trans->csw.csw.bCSWStatus = CSW_STATUS_FAILED;
+		return;
+	}
+
+	trans->lba_start = lba;
+	trans->block_count = count;
+	trans->current_block = 0;
+
+	if (read) {
+		trans->bytes_to_write = count * size;
+		set_sbc_status_good(ms);
+	} else {
+		trans->bytes_to_read = count * size;
+	}
+}
+
 static void scsi_read_6(usbd_mass_storage *ms,
 			struct usb_msc_trans *trans,
 			enum trans_event event)
@@ -265,16 +652,7 @@ static void scsi_read_6(usbd_mass_storage *ms,
 
 		buf = get_cbw_buf(trans);
 
-		trans->lba_start = (buf[2] << 8) | buf[3];
-		trans->block_count = buf[4];
-		trans->current_block = 0;
-
-		/* TODO: Check the lba & block_count for range. */
-
-		/* both are in terms of 512 byte blocks, so shift by 9 */
-		trans->bytes_to_write = trans->block_count << 9;
-
-		set_sbc_status_good(ms);
+		scsi_rw_setup(ms, trans, (buf[2] << 8) | buf[3], buf[4], true);
 	}
 }
 
@@ -282,19 +660,13 @@ static void scsi_write_6(usbd_mass_storage *ms,
 			 struct usb_msc_trans *trans,
 			 enum trans_event event)
 {
-	(void) ms;
-
 	if (EVENT_CBW_VALID == event) {
 		uint8_t *buf;
 
 		buf = get_cbw_buf(trans);
 
-		trans->lba_start = ((0x1f & buf[1]) << 16)
-				    | (buf[2] << 8) | buf[3];
-		trans->block_count = buf[4];
-		trans->current_block = 0;
-
-		trans->bytes_to_read = trans->block_count << 9;
+		scsi_rw_setup(ms, trans, ((0x1f & buf[1]) << 16)
+				| (buf[2] << 8) | buf[3], buf[4], false);
 	}
 }
 
@@ -302,19 +674,13 @@ static void scsi_write_10(usbd_mass_storage *ms,
 			  struct usb_msc_trans *trans,
 			  enum trans_event event)
 {
-	(void) ms;
-
 	if (EVENT_CBW_VALID == event) {
 		uint8_t *buf;
 
 		buf = get_cbw_buf(trans);
 
-		trans->lba_start = (buf[2] << 24) | (buf[3] << 16) |
-					(buf[4] << 8) | buf[5];
-		trans->block_count = (buf[7] << 8) | buf[8];
-		trans->current_block = 0;
-
-		trans->bytes_to_read = trans->block_count << 9;
+		scsi_rw_setup(ms, trans, get_be32(&buf[2]),
+			      (buf[7] << 8) | buf[8], false);
 	}
 }
 
@@ -327,16 +693,36 @@ static void scsi_read_10(usbd_mass_storage *ms,
 
 		buf = get_cbw_buf(trans);
 
-		trans->lba_start = (buf[2] << 24) | (buf[3] << 16)
-				   | (buf[4] << 8) | buf[5];
-		trans->block_count = (buf[7] << 8) | buf[8];
+		scsi_rw_setup(ms, trans, get_be32(&buf[2]),
+			      (buf[7] << 8) | buf[8], true);
+	}
+}
+
+static void scsi_read_write_12(usbd_mass_storage *ms,
+			       struct usb_msc_trans *trans,
+			       enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		uint8_t *buf;
+
+		buf = get_cbw_buf(trans);
+
+		scsi_rw_setup(ms, trans, get_be32(&buf[2]), get_be32(&buf[6]),
+			      SCSI_READ_12 == buf[0]);
+	}
+}
 
-		/* TODO: Check the lba & block_count for range. */
+static void scsi_read_write_16(usbd_mass_storage *ms,
+			       struct usb_msc_trans *trans,
+			       enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		uint8_t *buf;
 
-		/* both are in terms of 512 byte blocks, so shift by 9 */
-		trans->bytes_to_write = trans->block_count << 9;
+		buf = get_cbw_buf(trans);
 
-		set_sbc_status_good(ms);
+		scsi_rw_setup(ms, trans, get_be64(&buf[2]), get_be32(&buf[10]),
+			      SCSI_READ_16 == buf[0]);
 	}
 }
 
@@ -345,32 +731,118 @@ static void scsi_read_capacity(usbd_mass_storage *ms,
 			       enum trans_event event)
 {
 	if (EVENT_CBW_VALID == event) {
-		trans->msd_buf[0] = ms->block_count >> 24;
-		trans->msd_buf[1] = 0xff & (ms->block_count >> 16);
-		trans->msd_buf[2] = 0xff & (ms->block_count >> 8);
-		trans->msd_buf[3] = 0xff & ms->block_count;
-
-		/* Block size: 512 */
-		trans->msd_buf[4] = 0;
-		trans->msd_buf[5] = 0;
-		trans->msd_buf[6] = 2;
-		trans->msd_buf[7] = 0;
+		struct usb_msc_lun *lun = get_lun(ms);
+
+		/* Too large for 32 bits: the host retries with (16). */
+		put_be32(&trans->msd_buf[0], MIN(lun->last_lba, 0xffffffff));
+		put_be32(&trans->msd_buf[4], lun->block_size);
 		trans->bytes_to_write = 8;
 		set_sbc_status_good(ms);
 	}
 }
 
+static void scsi_read_capacity_16(usbd_mass_storage *ms,
+				  struct usb_msc_trans *trans,
+				  enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		struct usb_msc_lun *lun = get_lun(ms);
+		uint8_t *buf;
+
+		buf = get_cbw_buf(trans);
+
+		memset(trans->msd_buf, 0, 32);
+		put_be32(&trans->msd_buf[0], lun->last_lba >> 32);
+		put_be32(&trans->msd_buf[4], lun->last_lba);
+		put_be32(&trans->msd_buf[8], lun->block_size);
+		trans->bytes_to_write = MIN(32U, get_be32(&buf[10]));
+		set_sbc_status_good(ms);
+	}
+}
+
+static void scsi_report_luns(usbd_mass_storage *ms,
+			     struct usb_msc_trans *trans,
+			     enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		uint8_t *buf;
+		uint8_t i;
+
+		buf = get_cbw_buf(trans);
+
+		/* Peripheral device addressing, single level */
+		memset(trans->msd_buf, 0, 8 + 8 * ms->lun_count);
+		put_be32(&trans->msd_buf[0], 8 * ms->lun_count);
+		for (i = 0; i < ms->lun_count; i++) {
+			trans->msd_buf[8 + 8 * i + 1] = i;
+		}
+		trans->bytes_to_write = MIN(8U + 8 * ms->lun_count,
+					    get_be32(&buf[6]));
+		set_sbc_status_good(ms);
+	}
+}
+
+static void scsi_synchronize_cache(usbd_mass_storage *ms,
+				   struct usb_msc_trans *trans,
+				   enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		struct usb_msc_lun *lun = get_lun(ms);
+		int ret;
+
+		ret = msc_cache_flush(ms, trans->lun);
+		if ((0 == ret) && (NULL != lun->flush)) {
+			ret = (*lun->flush)();
+		}
+
+		if (0 != ret) {
+			trans->csw.csw.bCSWStatus = CSW_STATUS_FAILED;
+			set_sbc_status(ms, SBC_SENSE_KEY_MEDIUM_ERROR,
+				       SBC_ASC_PERIPHERAL_DEVICE_WRITE_FAULT,
+				       SBC_ASCQ_NA);
+		} else {
+			set_sbc_status_good(ms);
+		}
+	}
+}
+
+static void scsi_start_stop_unit(usbd_mass_storage *ms,
+				 struct usb_msc_trans *trans,
+				 enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		uint8_t *buf;
+
+		buf = get_cbw_buf(trans);
+
+		/* LOEJ = 1, START = 0: the host ejects the medium. */
+		if ((0x03 & buf[4]) == 0x02) {
+			scsi_synchronize_cache(ms, trans, event);
+		} else {
+			set_sbc_status_good(ms);
+		}
+	}
+}
+
 static void scsi_format_unit(usbd_mass_storage *ms,
 			     struct usb_msc_trans *trans,
 			     enum trans_event event)
 {
 	if (EVENT_CBW_VALID == event) {
-		uint32_t i;
+		uint8_t *zero = trans->msd_buf;
+		uint64_t count = get_lun(ms)->last_lba + 1;
+		uint64_t i;
 
-		memset(trans->msd_buf, 0, 512);
+		if (0 < ms->pipe.buf_count) {
+			/* Blocks may be larger than msd_buf. */
+			zero = ms->pipe.buf[0];
+		}
+		memset(zero, 0, get_lun(ms)->block_size);
 
-		for (i = 0; i < ms->block_count; i++) {
-			(*ms->write_block)(i, trans->msd_buf);
+		/* Nothing cached survives a format. */
+		msc_cache_drop(ms, trans->lun, 0, UINT64_MAX);
+		for (i = 0; i < count; i++) {
+			msc_dev_write_block(ms, trans->lun, i, zero);
 		}
 
 		set_sbc_status_good(ms);
@@ -451,6 +923,10 @@ static void scsi_inquiry(usbd_mass_storage *ms,
 			trans->bytes_to_write = sizeof(_spc3_inquiry_response);
 			memcpy(trans->msd_buf, _spc3_inquiry_response,
 			       sizeof(_spc3_inquiry_response));
+			if (trans->lun >= ms->lun_count) {
+				/* Peripheral Qualifier = 3: no such LUN */
+				trans->msd_buf[0] = 0x7f;
+			}
 
 			len = strlen(ms->vendor_id);
 			len = MIN(len, 8);
@@ -491,6 +967,21 @@ static void scsi_command(usbd_mass_storage *ms,
 		trans->bytes_to_write = 0;
 		trans->bytes_to_read = 0;
 		trans->byte_count = 0;
+		trans->lun = 0x0f & trans->cbw.cbw.bCBWLUN;
+		ms->cache.idle = 0;
+	}
+
+	if ((trans->lun >= ms->lun_count) &&
+	    (SCSI_INQUIRY != trans->cbw.cbw.CBWCB[0]) &&
+	    (SCSI_REQUEST_SENSE != trans->cbw.cbw.CBWCB[0]) &&
+	    (SCSI_REPORT_LUNS != trans->cbw.cbw.CBWCB[0])) {
+		if (EVENT_CBW_VALID == event) {
+			set_sbc_status(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+				       SBC_ASC_LOGICAL_UNIT_NOT_SUPPORTED,
+				       SBC_ASCQ_NA);
+			trans->csw.csw.bCSWStatus = CSW_STATUS_FAILED;
+		}
+		return;
 	}
 
 	switch (trans->cbw.cbw.CBWCB[0]) {
@@ -526,6 +1017,35 @@ static void scsi_command(usbd_mass_storage *ms,
 	case SCSI_WRITE_10:
 		scsi_write_10(ms, trans, event);
 		break;
+	case SCSI_READ_12:
+	case SCSI_WRITE_12:
+		scsi_read_write_12(ms, trans, event);
+		break;
+	case SCSI_READ_16:
+	case SCSI_WRITE_16:
+		scsi_read_write_16(ms, trans, event);
+		break;
+	case SCSI_SERVICE_ACTION_IN_16:
+		if (SCSI_SAI_READ_CAPACITY_16 ==
+		    (0x1f & trans->cbw.cbw.CBWCB[1])) {
+			scsi_read_capacity_16(ms, trans, event);
+			break;
+		}
+		set_sbc_status(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+			       SBC_ASC_INVALID_FIELD_IN_CDB,
+			       SBC_ASCQ_NA);
+		trans->csw.csw.bCSWStatus = CSW_STATUS_FAILED;
+		break;
+	case SCSI_REPORT_LUNS:
+		scsi_report_luns(ms, trans, event);
+		break;
+	case SCSI_SYNCHRONIZE_CACHE:
+	case SCSI_SYNCHRONIZE_CACHE_16:
+		scsi_synchronize_cache(ms, trans, event);
+		break;
+	case SCSI_START_STOP_UNIT:
+		scsi_start_stop_unit(ms, trans, event);
+		break;
 	default:
 		set_sbc_status(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
 					SBC_ASC_INVALID_COMMAND_OPERATION_CODE,
@@ -538,6 +1058,268 @@ static void scsi_command(usbd_mass_storage *ms,
 	}
 }
 
+/*-- Pipelined Block I/O ----------------------------------------------------*/
+
+static void msc_data_tx_cb(usbd_device *usbd_dev, uint8_t ep);
+static void msc_pipe_kick(usbd_mass_storage *ms);
+
+static void msc_pipe_finish(usbd_mass_storage *ms)
+{
+	struct usb_msc_pipe *pipe = &ms->pipe;
+	struct usb_msc_trans *trans = &ms->trans;
+
+	pipe->active = false;
+
+	if (0 != pipe->status) {
+		trans->csw.csw.bCSWStatus = CSW_STATUS_FAILED;
+		if (pipe->reading) {
+			set_sbc_status(ms, SBC_SENSE_KEY_MEDIUM_ERROR,
+				       SBC_ASC_UNRECOVERED_READ_ERROR,
+				       SBC_ASCQ_NA);
+		} else {
+			set_sbc_status(ms, SBC_SENSE_KEY_MEDIUM_ERROR,
+				       SBC_ASC_PERIPHERAL_DEVICE_WRITE_FAULT,
+				       SBC_ASCQ_NA);
+		}
+	}
+
+	if (pipe->reading) {
+		trans->byte_count = trans->bytes_to_write;
+	} else {
+		trans->byte_count = trans->bytes_to_read;
+		usbd_ep_nak_set(ms->usbd_dev, ms->ep_out, 0);
+	}
+	trans->current_block = 0;
+
+	if (NULL != ms->unlock) {
+		(*ms->unlock)();
+	}
+
+	/* Data phase is over, send the CSW. */
+	msc_data_tx_cb(ms->usbd_dev, ms->ep_in);
+}
+
+static void msc_pipe_io_done(usbd_mass_storage *ms, int result)
+{
+	struct usb_msc_pipe *pipe = &ms->pipe;
+
+	if (0 != result) {
+		pipe->status = result;
+	} else if (pipe->reading && (0 < ms->cache.line_count)) {
+		msc_cache_fill_blocks(ms, pipe->io_lba,
+				      pipe->blocks[pipe->io_idx],
+				      pipe->buf[pipe->io_idx]);
+	}
+
+	pipe->state[pipe->io_idx] = pipe->reading ? MSC_BUF_FULL :
+						    MSC_BUF_FREE;
+	pipe->io_idx = (pipe->io_idx + 1) % pipe->buf_count;
+	pipe->io_busy = false;
+
+	msc_pipe_kick(ms);
+}
+
+static void msc_pipe_usb_done(usbd_device *usbd_dev, uint8_t ep,
+			      uint32_t len)
+{
+	usbd_mass_storage *ms = &_mass_storage;
+	struct usb_msc_pipe *pipe = &ms->pipe;
+
+	(void)usbd_dev;
+	(void)ep;
+
+	if (!pipe->reading) {
+		len += pipe->usb_pre;
+		if (len < pipe->blocks[pipe->usb_idx] *
+			  get_lun(ms)->block_size) {
+			/* The host sent less than announced in the CBW. */
+			pipe->status = -1;
+		}
+	}
+
+	pipe->state[pipe->usb_idx] = pipe->reading ? MSC_BUF_FREE :
+						     MSC_BUF_FULL;
+	pipe->usb_idx = (pipe->usb_idx + 1) % pipe->buf_count;
+	pipe->usb_busy = false;
+
+	msc_pipe_kick(ms);
+}
+
+static void msc_pipe_io_start(usbd_mass_storage *ms)
+{
+	struct usb_msc_pipe *pipe = &ms->pipe;
+	struct usb_msc_trans *trans = &ms->trans;
+	uint8_t idx = pipe->io_idx;
+	uint64_t lba = trans->lba_start + pipe->io_block;
+	int ret;
+
+	if (pipe->reading) {
+		pipe->blocks[idx] = MIN(pipe->buf_blocks,
+					trans->block_count - pipe->io_block);
+	}
+	pipe->state[idx] = MSC_BUF_BUSY;
+	pipe->io_busy = true;
+	pipe->io_lba = lba;
+	pipe->io_block += pipe->blocks[idx];
+
+	if (0 < ms->cache.line_count) {
+		if (pipe->reading &&
+		    msc_cache_read_blocks(ms, lba, pipe->blocks[idx],
+					  pipe->buf[idx])) {
+			msc_pipe_io_done(ms, 0);
+			return;
+		}
+		if (!pipe->reading && msc_cache_small(ms, pipe->blocks[idx])) {
+			uint16_t size = get_lun(ms)->block_size;
+			uint32_t i;
+
+			ret = 0;
+			for (i = 0; i < pipe->blocks[idx]; i++) {
+				if (0 != msc_write_block(ms, lba + i,
+						&pipe->buf[idx][i * size])) {
+					ret = -1;
+				}
+			}
+			msc_pipe_io_done(ms, ret);
+			return;
+		}
+		if (!pipe->reading) {
+			msc_cache_drop(ms, trans->lun, lba, pipe->blocks[idx]);
+		}
+	}
+
+	/* The block device may complete right away from inside the call. */
+	if (pipe->reading) {
+		ret = (*pipe->read_blocks)(trans->lun, lba, pipe->blocks[idx],
+					   pipe->buf[idx]);
+	} else {
+		ret = (*pipe->write_blocks)(trans->lun, lba, pipe->blocks[idx],
+					    pipe->buf[idx]);
+	}
+
+	if (0 != ret) {
+		msc_pipe_io_done(ms, ret);
+	}
+}
+
+static void msc_pipe_usb_start(usbd_mass_storage *ms)
+{
+	struct usb_msc_pipe *pipe = &ms->pipe;
+	struct usb_msc_trans *trans = &ms->trans;
+	uint8_t idx = pipe->usb_idx;
+	uint8_t *buf = pipe->buf[idx];
+	uint32_t len;
+
+	if (!pipe->reading) {
+		pipe->blocks[idx] = MIN(pipe->buf_blocks,
+					trans->block_count - pipe->usb_block);
+	}
+	len = pipe->blocks[idx] * get_lun(ms)->block_size;
+	pipe->state[idx] = MSC_BUF_BUSY;
+	pipe->usb_busy = true;
+	pipe->usb_block += pipe->blocks[idx];
+
+	if (pipe->reading) {
+		if (0 != usbd_ep_transfer(ms->usbd_dev, ms->ep_in, buf, len,
+					  false, msc_pipe_usb_done)) {
+			/* Cannot happen with a 32-bit aligned arena. */
+			pipe->status = -1;
+			msc_pipe_usb_done(ms->usbd_dev, ms->ep_in, 0);
+		}
+		return;
+	}
+
+	/* Pick up a packet that came in while all buffers were in use. */
+	pipe->usb_pre = 0;
+	if (pipe->out_pending) {
+		pipe->out_pending = false;
+		pipe->usb_pre = usbd_ep_read_packet(ms->usbd_dev, ms->ep_out,
+						    buf, ms->ep_out_size);
+	}
+
+	if (pipe->usb_pre >= len ||
+	    0 != usbd_ep_transfer(ms->usbd_dev, ms->ep_out,
+				  buf + pipe->usb_pre, len - pipe->usb_pre,
+				  false, msc_pipe_usb_done)) {
+		msc_pipe_usb_done(ms->usbd_dev, ms->ep_out, 0);
+		return;
+	}
+	usbd_ep_nak_set(ms->usbd_dev, ms->ep_out, 0);
+}
+
+/* Advance both stages of the pipeline as far as the buffers allow. */
+static void msc_pipe_kick(usbd_mass_storage *ms)
+{
+	struct usb_msc_pipe *pipe = &ms->pipe;
+	uint32_t block_count = ms->trans.block_count;
+
+	if (!pipe->active) {
+		return;
+	}
+
+	if (pipe->reading) {
+		if (!pipe->io_busy && pipe->io_block < block_count &&
+		    MSC_BUF_FREE == pipe->state[pipe->io_idx]) {
+			msc_pipe_io_start(ms);
+		}
+		if (pipe->active && !pipe->usb_busy &&
+		    MSC_BUF_FULL == pipe->state[pipe->usb_idx]) {
+			msc_pipe_usb_start(ms);
+		}
+		if (pipe->active && !pipe->usb_busy &&
+		    pipe->usb_block == block_count &&
+		    MSC_BUF_FREE == pipe->state[pipe->usb_idx]) {
+			msc_pipe_finish(ms);
+		}
+		return;
+	}
+
+	if (!pipe->usb_busy && pipe->usb_block < block_count) {
+		if (MSC_BUF_FREE == pipe->state[pipe->usb_idx]) {
+			msc_pipe_usb_start(ms);
+		} else {
+			/* Hold the host off until a buffer is free. */
+			usbd_ep_nak_set(ms->usbd_dev, ms->ep_out, 1);
+		}
+	}
+	if (pipe->active && !pipe->io_busy &&
+	    MSC_BUF_FULL == pipe->state[pipe->io_idx]) {
+		msc_pipe_io_start(ms);
+	}
+	if (pipe->active && !pipe->io_busy && !pipe->usb_busy &&
+	    pipe->io_block == block_count &&
+	    MSC_BUF_FREE == pipe->state[pipe->io_idx]) {
+		msc_pipe_finish(ms);
+	}
+}
+
+static void msc_pipe_start(usbd_mass_storage *ms)
+{
+	struct usb_msc_pipe *pipe = &ms->pipe;
+	uint8_t i;
+
+	for (i = 0; i < pipe->buf_count; i++) {
+		pipe->state[i] = MSC_BUF_FREE;
+	}
+	pipe->reading = 0 < ms->trans.bytes_to_write;
+	pipe->buf_blocks = pipe->buf_size / get_lun(ms)->block_size;
+	pipe->io_busy = false;
+	pipe->usb_busy = false;
+	pipe->out_pending = false;
+	pipe->io_idx = 0;
+	pipe->usb_idx = 0;
+	pipe->io_block = 0;
+	pipe->usb_block = 0;
+	pipe->status = 0;
+	pipe->active = true;
+
+	if (NULL != ms->lock) {
+		(*ms->lock)();
+	}
+
+	msc_pipe_kick(ms);
+}
+
 /*-- USB Mass Storage Layer --------------------------------------------------*/
 
 /** @brief Handle the USB 'OUT' requests. */
@@ -551,6 +1333,13 @@ static void msc_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
 	ms = &_mass_storage;
 	trans = &ms->trans;
 
+	if (ms->pipe.active) {
+		/* Data for a pipelined WRITE with no buffer free: leave it in
+		 * the endpoint until msc_pipe_usb_start() picks it up. */
+		ms->pipe.out_pending = true;
+		return;
+	}
+
 	/* RX only */
 	left = sizeof(struct usb_msc_cbw) - trans->cbw_cnt;
 	if (0 < left) {
@@ -561,6 +1350,11 @@ static void msc_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
 
 		if (sizeof(struct usb_msc_cbw) == trans->cbw_cnt) {
 			scsi_command(ms, trans, EVENT_CBW_VALID);
+			if ((0 < ms->pipe.buf_count) &&
+			    (0 < trans->block_count)) {
+				msc_pipe_start(ms);
+				return;
+			}
 			if (trans->byte_count < trans->bytes_to_read) {
 				/* We must wait until there is something to
 				 * read again. */
@@ -584,11 +1378,11 @@ static void msc_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
 
 		if (0 < trans->block_count) {
 			if (0 == (0x1ff & trans->byte_count)) {
-				uint32_t lba;
+				uint64_t lba;
 
 				lba = trans->lba_start + trans->current_block;
-				if (0 != (*ms->write_block)(lba,
-							    trans->msd_buf)) {
+				if (0 != msc_write_block(ms, lba,
+							 trans->msd_buf)) {
 					/* Error */
 				}
 				trans->current_block++;
@@ -616,11 +1410,11 @@ static void msc_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
 			}
 
 			if (0 == (0x1ff & trans->byte_count)) {
-				uint32_t lba;
+				uint64_t lba;
 
 				lba = trans->lba_start + trans->current_block;
-				if (0 != (*ms->read_block)(lba,
-							   trans->msd_buf)) {
+				if (0 != msc_read_block(ms, lba,
+							trans->msd_buf)) {
 					/* Error */
 				}
 				trans->current_block++;
@@ -635,11 +1429,11 @@ static void msc_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
 	} else {
 		if (0 < trans->block_count) {
 			if (trans->current_block == trans->block_count) {
-				uint32_t lba;
+				uint64_t lba;
 
 				lba = trans->lba_start + trans->current_block;
-				if (0 != (*ms->write_block)(lba,
-							    trans->msd_buf)) {
+				if (0 != msc_write_block(ms, lba,
+							 trans->msd_buf)) {
 					/* Error */
 				}
 
@@ -679,11 +1473,11 @@ static void msc_data_tx_cb(usbd_device *usbd_dev, uint8_t ep)
 	if (trans->byte_count < trans->bytes_to_write) {
 		if (0 < trans->block_count) {
 			if (0 == (0x1ff & trans->byte_count)) {
-				uint32_t lba;
+				uint64_t lba;
 
 				lba = trans->lba_start + trans->current_block;
-				if (0 != (*ms->read_block)(lba,
-							   trans->msd_buf)) {
+				if (0 != msc_read_block(ms, lba,
+							trans->msd_buf)) {
 					/* Error */
 				}
 				trans->current_block++;
@@ -738,6 +1532,8 @@ msc_control_request(usbd_device *usbd_dev,
 		    struct usb_setup_data *req, uint8_t **buf, uint16_t *len,
 		    usbd_control_complete_callback *complete)
 {
+	usbd_mass_storage *ms = &_mass_storage;
+
 	(void)complete;
 	(void)usbd_dev;
 
@@ -746,8 +1542,8 @@ msc_control_request(usbd_device *usbd_dev,
 		/* Do any special reset code here. */
 		return USBD_REQ_HANDLED;
 	case USB_MSC_REQ_GET_MAX_LUN:
-		/* Return the number of LUNs.  We use 0. */
-		*buf[0] = 0;
+		/* Return the highest LUN number. */
+		*buf[0] = ms->lun_count - 1;
 		*len = 1;
 		return USBD_REQ_HANDLED;
 	}
@@ -762,10 +1558,36 @@ static void msc_set_config(usbd_device *usbd_dev, uint16_t wValue)
 
 	(void)wValue;
 
+	/*
+	 * A bus reset or SET_CONFIGURATION dropped any transfer in flight
+	 * without completing it, start over from waiting for a CBW.
+	 */
+	if (ms->pipe.active) {
+		ms->pipe.active = false;
+		if (NULL != ms->unlock) {
+			(*ms->unlock)();
+		}
+	}
+	ms->pipe.io_busy = false;
+	ms->pipe.usb_busy = false;
+	ms->pipe.out_pending = false;
+
+	ms->trans.lba_start = 0xffffffff;
+	ms->trans.block_count = 0;
+	ms->trans.current_block = 0;
+	ms->trans.cbw_cnt = 0;
+	ms->trans.bytes_to_read = 0;
+	ms->trans.bytes_to_write = 0;
+	ms->trans.byte_count = 0;
+	ms->trans.csw_valid = false;
+	ms->trans.csw_sent = 0;
+
 	usbd_ep_setup(usbd_dev, ms->ep_in, USB_ENDPOINT_ATTR_BULK,
 		      ms->ep_in_size, msc_data_tx_cb);
 	usbd_ep_setup(usbd_dev, ms->ep_out, USB_ENDPOINT_ATTR_BULK,
 		      ms->ep_out_size, msc_data_rx_cb);
+	/* The pipeline may have left NAK forced on the OUT endpoint. */
+	usbd_ep_nak_set(usbd_dev, ms->ep_out, 0);
 
 	usbd_register_control_callback(
 				usbd_dev,
@@ -818,9 +1640,14 @@ usbd_mass_storage *usb_msc_init(usbd_device *usbd_dev,
 	_mass_storage.vendor_id = vendor_id;
 	_mass_storage.product_id = product_id;
 	_mass_storage.product_revision_level = product_revision_level;
-	_mass_storage.block_count = block_count - 1;
-	_mass_storage.read_block = read_block;
-	_mass_storage.write_block = write_block;
+	_mass_storage.lun_count = 1;
+	_mass_storage.lun[0].last_lba = block_count - 1;
+	_mass_storage.lun[0].block_size = 512;
+	_mass_storage.lun[0].read_block = read_block;
+	_mass_storage.lun[0].write_block = write_block;
+	_mass_storage.lun[0].read_block64 = NULL;
+	_mass_storage.lun[0].write_block64 = NULL;
+	_mass_storage.lun[0].flush = NULL;
 	_mass_storage.lock = NULL;
 	_mass_storage.unlock = NULL;
 
@@ -833,6 +1660,9 @@ usbd_mass_storage *usb_msc_init(usbd_device *usbd_dev,
 	_mass_storage.trans.byte_count = 0;
 	_mass_storage.trans.csw_valid = false;
 	_mass_storage.trans.csw_sent = 0;
+	_mass_storage.pipe.buf_count = 0;
+	_mass_storage.pipe.active = false;
+	_mass_storage.cache.line_count = 0;
 
 	set_sbc_status_good(&_mass_storage);
 
@@ -841,4 +1671,249 @@ usbd_mass_storage *usb_msc_init(usbd_device *usbd_dev,
 	return &_mass_storage;
 }
 
+/** @brief Enable pipelined, asynchronous block I/O.
+
+READ(6/10) and WRITE(6/10) then move up to @a buf_count buffers of blocks
+at a time, with the block device working on one buffer while the previous
+or next one is transferred over USB. The block functions start the
+operation and return 0; the application reports its end by calling
+usb_msc_io_done(). They may also complete synchronously by calling
+usb_msc_io_done() before returning.
+
+@param[in] ms The mass storage instance returned by usb_msc_init().
+@param[in] arena Memory for the buffers, must be 32-bit aligned.
+@param[in] arena_size Size of @a arena in bytes.
+@param[in] buf_count Number of buffers to split @a arena into, 2 to 4.
+@param[in] block_size Size of a block of LUN 0 in bytes, a multiple of 512.
+@param[in] read_blocks Starts reading @a count blocks of @a lun from @a lba.
+@param[in] write_blocks Starts writing @a count blocks of @a lun to @a lba.
+
+@return 0 on success, -1 if a buffer cannot hold a block of every LUN.
+*/
+int usb_msc_set_pipeline(usbd_mass_storage *ms, void *arena,
+			 uint32_t arena_size, uint8_t buf_count,
+			 uint16_t block_size,
+			 int (*read_blocks)(uint8_t lun, uint64_t lba,
+					    uint32_t count, uint8_t *copy_to),
+			 int (*write_blocks)(uint8_t lun, uint64_t lba,
+					     uint32_t count,
+					     const uint8_t *copy_from))
+{
+	struct usb_msc_pipe *pipe = &ms->pipe;
+	uint32_t buf_size;
+	uint8_t i;
+
+	if ((2 > buf_count) || (MSC_MAX_PIPE_BUFS < buf_count) ||
+	    (0 == block_size) || (0 != (block_size % 512))) {
+		return -1;
+	}
+
+	/* Keep the buffers 32-bit aligned for the USB drivers. */
+	buf_size = (arena_size / buf_count) & ~0x3;
+	if ((buf_size < block_size) ||
+	    ((0 < ms->cache.line_count) &&
+	     (ms->cache.line_size < block_size))) {
+		return -1;
+	}
+	for (i = 1; i < ms->lun_count; i++) {
+		if (buf_size < ms->lun[i].block_size) {
+			return -1;
+		}
+	}
+
+	for (i = 0; i < buf_count; i++) {
+		pipe->buf[i] = (uint8_t *)arena + i * buf_size;
+	}
+	pipe->buf_size = buf_size;
+	pipe->read_blocks = read_blocks;
+	pipe->write_blocks = write_blocks;
+	pipe->buf_count = buf_count;
+	ms->lun[0].block_size = block_size;
+
+	return 0;
+}
+
+/** @brief Add a logical unit.
+
+The new LUN gets the next free number, LUN 0 being the one set up by
+usb_msc_init(). Its blocks can be addressed with 64-bit LBAs through
+READ(16)/WRITE(16), so media beyond 2 TiB can be exported.
+
+@param[in] ms The mass storage instance returned by usb_msc_init().
+@param[in] block_count The number of blocks available.
+@param[in] block_size Size of a block in bytes. Must be 512 unless
+		pipelining is enabled with usb_msc_set_pipeline().
+@param[in] read_block Reads one block. Must _NOT_ be NULL.
+@param[in] write_block Writes one block. Must _NOT_ be NULL.
+
+@return The LUN number, or -1 if all LUNs are used or @a block_size is
+	not 512 without a pipeline, or does not fit the pipeline buffers or
+	cache lines.
+*/
+int usb_msc_add_lun(usbd_mass_storage *ms, uint64_t block_count,
+		    uint16_t block_size,
+		    int (*read_block)(uint64_t lba, uint8_t *copy_to),
+		    int (*write_block)(uint64_t lba, const uint8_t *copy_from))
+{
+	struct usb_msc_lun *lun;
+
+	if ((MSC_MAX_LUNS <= ms->lun_count) || (0 == block_size) ||
+	    ((0 == ms->pipe.buf_count) && (512 != block_size)) ||
+	    ((0 < ms->pipe.buf_count) && (ms->pipe.buf_size < block_size)) ||
+	    ((0 < ms->cache.line_count) &&
+	     (ms->cache.line_size < block_size))) {
+		return -1;
+	}
+
+	lun = &ms->lun[ms->lun_count];
+	lun->last_lba = block_count - 1;
+	lun->block_size = block_size;
+	lun->read_block = NULL;
+	lun->write_block = NULL;
+	lun->read_block64 = read_block;
+	lun->write_block64 = write_block;
+	lun->flush = NULL;
+
+	return ms->lun_count++;
+}
+
+/** @brief Set the function SYNCHRONIZE CACHE is forwarded to.
+
+@param[in] ms The mass storage instance returned by usb_msc_init().
+@param[in] lun The LUN number.
+@param[in] flush Writes back any data the LUN caches, returns 0 on
+		success. NULL if there is nothing to flush.
+*/
+void usb_msc_set_flush(usbd_mass_storage *ms, uint8_t lun,
+		       int (*flush)(void))
+{
+	if (lun < ms->lun_count) {
+		ms->lun[lun].flush = flush;
+	}
+}
+
+/** @brief Enable the write-back sector cache.
+
+Single blocks and short multi-block accesses are then served from, and
+written to, an LRU cache held in @a arena. Dirty blocks reach the media
+when they are evicted, on SYNCHRONIZE CACHE, when the host ejects the
+medium, after @a idle_ticks calls of usb_msc_cache_tick() without a
+command, and on usb_msc_cache_flush().
+
+Call this after all LUNs have been added: each line holds a block of the
+largest size in use.
+
+@param[in] ms The mass storage instance returned by usb_msc_init().
+@param[in] arena Memory for the cache, must be 32-bit aligned.
+@param[in] arena_size Size of @a arena in bytes.
+@param[in] idle_ticks Ticks without a command before dirty blocks are
+		written back, 0 to only write back when the host asks to.
+
+@return The number of cache lines, or -1 if @a arena holds less than two
+	or a LUN has blocks other than 512 bytes without a pipeline.
+*/
+int usb_msc_set_cache(usbd_mass_storage *ms, void *arena,
+		      uint32_t arena_size, uint32_t idle_ticks)
+{
+	struct usb_msc_cache *cache = &ms->cache;
+	uint16_t line_size = 0;
+	uint32_t count;
+	uint32_t i;
+
+	for (i = 0; i < ms->lun_count; i++) {
+		/* Without a pipeline blocks pass through msd_buf. */
+		if ((0 == ms->pipe.buf_count) &&
+		    (512 != ms->lun[i].block_size)) {
+			return -1;
+		}
+		if (line_size < ms->lun[i].block_size) {
+			line_size = ms->lun[i].block_size;
+		}
+	}
+
+	count = arena_size /
+		(line_size + sizeof(struct usb_msc_cache_line));
+	count = MIN(count, 0xffffU);
+	if (2 > count) {
+		return -1;
+	}
+
+	/* Line data first, it keeps the arena's alignment. */
+	cache->data = arena;
+	cache->line = (struct usb_msc_cache_line *)
+		      &cache->data[count * line_size];
+	for (i = 0; i < count; i++) {
+		cache->line[i].flags = 0;
+		cache->line[i].stamp = 0;
+	}
+	cache->line_size = line_size;
+	cache->stamp = 0;
+	cache->idle_ticks = idle_ticks;
+	cache->idle = 0;
+	cache->line_count = count;
+
+	return count;
+}
+
+/** @brief Write all dirty cached blocks back to the media.
+
+Must be called from the same context as usbd_poll(), and not while a
+command is in progress.
+
+@param[in] ms The mass storage instance returned by usb_msc_init().
+
+@return 0 on success, -1 if a block could not be written.
+*/
+int usb_msc_cache_flush(usbd_mass_storage *ms)
+{
+	int ret = 0;
+	uint8_t i;
+
+	for (i = 0; i < ms->lun_count; i++) {
+		if (0 != msc_cache_flush(ms, i)) {
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+/** @brief Time base for the idle write-back of the sector cache.
+
+Call periodically from the same context as usbd_poll().
+
+@param[in] ms The mass storage instance returned by usb_msc_init().
+*/
+void usb_msc_cache_tick(usbd_mass_storage *ms)
+{
+	struct usb_msc_cache *cache = &ms->cache;
+
+	if ((0 == cache->idle_ticks) || (cache->idle >= cache->idle_ticks)) {
+		return;
+	}
+
+	/* Only count time between commands. */
+	if ((0 != ms->trans.cbw_cnt) || ms->pipe.active) {
+		return;
+	}
+
+	if (++cache->idle == cache->idle_ticks) {
+		usb_msc_cache_flush(ms);
+	}
+}
+
+/** @brief Report the end of a block operation started by the pipeline.
+
+Must be called from the same context as usbd_poll().
+
+@param[in] ms The mass storage instance returned by usb_msc_init().
+@param[in] result 0 on success, non-zero if the operation failed.
+*/
+void usb_msc_io_done(usbd_mass_storage *ms, int result)
+{
+	if (ms->pipe.active && ms->pipe.io_busy) {
+		msc_pipe_io_done(ms, result);
+	}
+}
+
 /** @} */
@@ -38,15 +38,63 @@ LGPL License Terms @ref lgpl_license
 #ifndef __USB_PRIVATE_H
 #define __USB_PRIVATE_H
 
+/*
+ * The callback tables are sized at compile time. Composite devices with
+ * many functions can raise the limits when building the library, e.g.
+ * with -DMAX_USER_CONTROL_CALLBACK=16 (at most 32).
+ */
+#ifndef MAX_USER_CONTROL_CALLBACK
 #define MAX_USER_CONTROL_CALLBACK	4
+#endif
+#ifndef MAX_USER_SET_CONFIG_CALLBACK
 #define MAX_USER_SET_CONFIG_CALLBACK	4
+#endif
+#define MAX_USBD_TRANSFER		4
+#define MAX_USBD_ENDPOINT		8
+
+#if MAX_USER_CONTROL_CALLBACK > 32
+#error "MAX_USER_CONTROL_CALLBACK must not exceed 32"
+#elif MAX_USER_CONTROL_CALLBACK > 16
+typedef uint32_t usbd_control_mask;
+#elif MAX_USER_CONTROL_CALLBACK > 8
+typedef uint16_t usbd_control_mask;
+#else
+typedef uint8_t usbd_control_mask;
+#endif
+
+/*
+ * Control requests are routed on direction, type and recipient (for the
+ * standard recipients 0..3) of bmRequestType, through a table holding the
+ * set of callbacks that can match each combination.
+ */
+#define USBD_CONTROL_ROUTES		32
+#define USBD_CONTROL_ROUTE(bmRequestType) \
+	((((bmRequestType) >> 3) & 0x10) | (((bmRequestType) >> 3) & 0x0c) | \
+	 ((bmRequestType) & 0x03))
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+/** Multi-packet transfer queued with usbd_ep_transfer(). */
+struct usbd_transfer {
+	uint8_t addr;		/**< Endpoint address, 0 if the slot is free */
+	bool zlp;		/**< A ZLP still has to follow the data */
+	uint16_t max_size;	/**< Max packet size of the endpoint */
+	uint16_t chunk;		/**< Size of the last packet handled */
+	uint8_t *buf;
+	uint32_t len;
+	uint32_t done;		/**< Bytes handed to/received from the USB */
+	uint32_t end;		/**< End of the part programmed into the core */
+	usbd_transfer_callback complete;
+	/** Endpoint callback displaced while the transfer is emulated */
+	usbd_endpoint_callback saved_cb;
+};
+
 /** Internal collection of device information. */
 struct _usbd_device {
 	const struct usb_device_descriptor *desc;
 	const struct usb_config_descriptor *config;
+	/** Flattened configuration descriptors, NULL to build on request */
+	const uint8_t * const *config_blobs;
 	const char * const *strings;
 	int num_strings;
 
@@ -58,6 +106,9 @@ struct _usbd_device {
 
 	uint16_t pm_top;    /**< Top of allocated endpoint buffer memory */
 
+	uint8_t poll_budget; /**< Max transfer events handled per poll */
+	uint8_t poll_events; /**< Transfer events handled by the last poll */
+
 	/* User callback functions for various USB events */
 	void (*user_callback_reset)(void);
 	void (*user_callback_suspend)(void);
@@ -74,6 +125,8 @@ struct _usbd_device {
 		uint8_t *ctrl_buf;
 		uint16_t ctrl_len;
 		usbd_control_complete_callback complete;
+		usbd_control_generator generator;
+		uint16_t gen_offset;	/**< Bytes produced by generator */
 		bool needs_zlp;
 	} control_state;
 
@@ -82,8 +135,15 @@ struct _usbd_device {
 		uint8_t type;
 		uint8_t type_mask;
 	} user_control_callback[MAX_USER_CONTROL_CALLBACK];
+	/** Callbacks that may match each USBD_CONTROL_ROUTE() */
+	usbd_control_mask control_route[USBD_CONTROL_ROUTES];
+	uint8_t num_control_callback;
+
+	usbd_endpoint_callback user_callback_ctr[MAX_USBD_ENDPOINT][3];
 
-	usbd_endpoint_callback user_callback_ctr[8][3];
+	/** [ep][OUT, IN] max packet size */
+	uint16_t ep_max_size[MAX_USBD_ENDPOINT][2];
+	struct usbd_transfer transfer[MAX_USBD_TRANSFER];
 
 	/* User callback function for some standard USB function hooks */
 	usbd_set_config_callback user_callback_set_config[MAX_USER_SET_CONFIG_CALLBACK];
@@ -111,7 +171,12 @@ struct _usbd_device {
 	 * stm32f107_poll() which reads the packet status push register GRXSTSP
 	 * for use in stm32f107_ep_read_packet().
 	 */
-	uint16_t rxbcnt;
+	uint32_t rxbcnt;
+	/*
+	 * Buffers used by the core's internal DMA, NULL when the endpoint
+	 * FIFOs are accessed by the CPU.
+	 */
+	struct dwc_dma_bufs *dma;
 };
 
 enum _usbd_transaction {
@@ -140,6 +205,22 @@ enum usbd_request_return_codes _usbd_standard_request(usbd_device *usbd_dev, str
 			   uint8_t **buf, uint16_t *len);
 
 void _usbd_reset(usbd_device *usbd_dev);
+void _usbd_control_callbacks_reset(usbd_device *usbd_dev);
+
+struct usbd_transfer *_usbd_transfer_find(usbd_device *usbd_dev, uint8_t addr);
+void _usbd_transfer_complete(usbd_device *usbd_dev,
+			     struct usbd_transfer *xfer);
+void _usbd_transfer_reset(usbd_device *usbd_dev);
+
+#ifdef USBD_STATS
+void _usbd_stats_init(void);
+void _usbd_stats_event(uint8_t type, uint8_t addr, uint16_t len);
+uint32_t _usbd_stats_poll_begin(void);
+void _usbd_stats_poll_end(uint32_t start);
+#define USBD_STATS_EVENT(type, addr, len) _usbd_stats_event(type, addr, len)
+#else
+#define USBD_STATS_EVENT(type, addr, len) do { } while (0)
+#endif
 
 /* Functions provided by the hardware abstraction. */
 struct _usbd_driver {
@@ -156,8 +237,12 @@ struct _usbd_driver {
 				    const void *buf, uint16_t len);
 	uint16_t (*ep_read_packet)(usbd_device *usbd_dev, uint8_t addr,
 				   void *buf, uint16_t len);
+	/* Optional, transfers are emulated with packets if NULL */
+	int (*ep_transfer)(usbd_device *usbd_dev, struct usbd_transfer *xfer);
 	void (*poll)(usbd_device *usbd_dev);
 	void (*disconnect)(usbd_device *usbd_dev, bool disconnected);
+	/* Optional, usbd_get_frame_number() returns 0 if NULL */
+	uint16_t (*get_frame_number)(usbd_device *usbd_dev);
 	uint32_t base_address;
 	bool set_address_before_status;
 	uint16_t rx_fifo_size;
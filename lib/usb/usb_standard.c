@@ -65,8 +65,14 @@ void usbd_register_set_altsetting_callback(usbd_device *usbd_dev,
 	usbd_dev->user_callback_set_altsetting = callback;
 }
 
-static uint16_t build_config_descriptor(usbd_device *usbd_dev,
-				   uint8_t index, uint8_t *buf, uint16_t len)
+void usbd_register_config_blobs(usbd_device *usbd_dev,
+				const uint8_t * const *blobs)
+{
+	usbd_dev->config_blobs = blobs;
+}
+
+uint16_t usbd_build_config_descriptor(usbd_device *usbd_dev,
+				      uint8_t index, uint8_t *buf, uint16_t len)
 {
 	uint8_t *tmpbuf = buf;
 	const struct usb_config_descriptor *cfg = &usbd_dev->config[index];
@@ -149,12 +155,61 @@ static int usb_descriptor_index(uint16_t wValue)
 	return wValue & 0xFF;
 }
 
+static const char *usb_standard_string(usbd_device *usbd_dev, int descr_idx)
+{
+	int array_idx = descr_idx - 1;
+
+	if (descr_idx == usbd_dev->extra_string_idx) {
+		return usbd_dev->extra_string;
+	}
+	/* Check that string index is in range. */
+	if (!usbd_dev->strings || array_idx >= usbd_dev->num_strings) {
+		return NULL;
+	}
+	return usbd_dev->strings[array_idx];
+}
+
+/* bLength of the string descriptor, which holds up to 126 characters */
+static uint8_t usb_standard_string_length(const char *str)
+{
+	size_t n = strlen(str);
+
+	return MIN(n, 126) * 2 + 2;
+}
+
+static uint16_t usb_standard_string_chunk(usbd_device *usbd_dev,
+					  struct usb_setup_data *req,
+					  uint16_t offset, uint8_t *buf,
+					  uint16_t len)
+{
+	const char *str;
+	uint16_t i;
+
+	str = usb_standard_string(usbd_dev,
+				  usb_descriptor_index(req->wValue));
+
+	for (i = 0; i < len; i++, offset++) {
+		if (offset == 0) {
+			buf[i] = usb_standard_string_length(str);
+		} else if (offset == 1) {
+			buf[i] = USB_DT_STRING;
+		} else if (offset & 1) {
+			/* High byte of the UTF16 character */
+			buf[i] = 0;
+		} else {
+			buf[i] = str[offset / 2 - 1];
+		}
+	}
+	return len;
+}
+
 static enum usbd_request_return_codes
 usb_standard_get_descriptor(usbd_device *usbd_dev,
 			    struct usb_setup_data *req,
 			    uint8_t **buf, uint16_t *len)
 {
-	int i, array_idx, descr_idx;
+	int descr_idx;
+	const char *str;
 	struct usb_string_descriptor *sd;
 
 	descr_idx = usb_descriptor_index(req->wValue);
@@ -165,8 +220,18 @@ usb_standard_get_descriptor(usbd_device *usbd_dev,
 		*len = MIN(*len, usbd_dev->desc->bLength);
 		return USBD_REQ_HANDLED;
 	case USB_DT_CONFIGURATION:
+		if (descr_idx >= usbd_dev->desc->bNumConfigurations) {
+			return USBD_REQ_NOTSUPP;
+		}
+		if (usbd_dev->config_blobs) {
+			/* Zero-copy: wTotalLength is at offset 2. */
+			*buf = (uint8_t *)usbd_dev->config_blobs[descr_idx];
+			*len = MIN(*len, (*buf)[2] | ((*buf)[3] << 8));
+			return USBD_REQ_HANDLED;
+		}
 		*buf = usbd_dev->ctrl_buf;
-		*len = build_config_descriptor(usbd_dev, descr_idx, *buf, *len);
+		*len = usbd_build_config_descriptor(usbd_dev, descr_idx, *buf,
+					MIN(*len, usbd_dev->ctrl_buf_len));
 		return USBD_REQ_HANDLED;
 	case USB_DT_STRING:
 		sd = (struct usb_string_descriptor *)usbd_dev->ctrl_buf;
@@ -179,52 +244,26 @@ usb_standard_get_descriptor(usbd_device *usbd_dev,
 				      sizeof(sd->wData[0]);
 
 			*len = MIN(*len, sd->bLength);
-		} else if (descr_idx == usbd_dev->extra_string_idx) {
-			/* This string is returned as UTF16, hence the
-			 * multiplication
-			 */
-			sd->bLength = strlen(usbd_dev->extra_string) * 2 +
-				      sizeof(sd->bLength) +
-				      sizeof(sd->bDescriptorType);
-
-			*len = MIN(*len, sd->bLength);
-
-			for (i = 0; i < (*len / 2) - 1; i++) {
-				sd->wData[i] =
-					usbd_dev->extra_string[i];
-			}
-        } else {
-			array_idx = descr_idx - 1;
-
-			if (!usbd_dev->strings) {
-				/* Device doesn't support strings. */
-				return USBD_REQ_NOTSUPP;
-			}
-
-			/* Check that string index is in range. */
-			if (array_idx >= usbd_dev->num_strings) {
+		} else {
+			str = usb_standard_string(usbd_dev, descr_idx);
+			if (!str) {
 				return USBD_REQ_NOTSUPP;
 			}
 
 			/* Strings with Language ID differnet from
 			 * USB_LANGID_ENGLISH_US are not supported */
-			if (req->wIndex != USB_LANGID_ENGLISH_US) {
+			if (descr_idx != usbd_dev->extra_string_idx &&
+			    req->wIndex != USB_LANGID_ENGLISH_US) {
 				return USBD_REQ_NOTSUPP;
 			}
 
-			/* This string is returned as UTF16, hence the
-			 * multiplication
+			/* Converted to UTF16 while sent, so that long strings
+			 * do not need a large control buffer.
 			 */
-			sd->bLength = strlen(usbd_dev->strings[array_idx]) * 2 +
-				      sizeof(sd->bLength) +
-				      sizeof(sd->bDescriptorType);
-
-			*len = MIN(*len, sd->bLength);
-
-			for (i = 0; i < (*len / 2) - 1; i++) {
-				sd->wData[i] =
-					usbd_dev->strings[array_idx][i];
-			}
+			*len = MIN(*len, usb_standard_string_length(str));
+			usbd_control_set_generator(usbd_dev,
+						   usb_standard_string_chunk);
+			return USBD_REQ_HANDLED;
 		}
 
 		sd->bDescriptorType = USB_DT_STRING;
@@ -303,15 +342,14 @@ usb_standard_set_configuration(usbd_device *usbd_dev,
 
 	/* Reset all endpoints. */
 	usbd_dev->driver->ep_reset(usbd_dev);
+	_usbd_transfer_reset(usbd_dev);
 
 	if (usbd_dev->user_callback_set_config[0]) {
 		/*
 		 * Flush control callbacks. These will be reregistered
 		 * by the user handler.
 		 */
-		for (i = 0; i < MAX_USER_CONTROL_CALLBACK; i++) {
-			usbd_dev->user_control_callback[i].cb = NULL;
-		}
+		_usbd_control_callbacks_reset(usbd_dev);
 
 		for (i = 0; i < MAX_USER_SET_CONFIG_CALLBACK; i++) {
 			if (usbd_dev->user_callback_set_config[i]) {
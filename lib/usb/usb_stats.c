@@ -0,0 +1,245 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Optional instrumentation of the USB stack.
+ *
+ * Without USBD_STATS the hooks compile to nothing and the functions below
+ * report that no statistics are kept, so applications can call them either
+ * way. The counters and the trace are kept for a single device.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <libopencm3/usb/usbd.h>
+#include "usb_private.h"
+
+#ifdef USBD_STATS
+
+#include <libopencm3/cm3/cortex.h>
+
+/* ARMv6-M has neither the ITM nor the DWT cycle counter. */
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+#define USBD_STATS_ARMV7
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/cm3/itm.h>
+#endif
+
+static struct usbd_stats _usbd_stats;
+static struct usbd_trace _usbd_trace;
+
+#ifdef USBD_STATS_ARMV7
+static uint32_t last_poll;
+static uint32_t itm_cursor;
+
+/* Histogram bucket: n for durations below 4^n cycles */
+static uint8_t stats_bucket(uint32_t cycles)
+{
+	uint8_t bits = cycles ? 32 - __builtin_clz(cycles) : 0;
+
+	return MIN((bits + 1) / 2, USBD_STATS_BUCKETS - 1);
+}
+
+static uint32_t stats_cycles(void)
+{
+	return dwt_read_cycle_counter();
+}
+#else
+static uint32_t stats_cycles(void)
+{
+	return 0;
+}
+#endif
+
+void _usbd_stats_init(void)
+{
+#ifdef USBD_STATS_ARMV7
+	dwt_enable_cycle_counter();
+	itm_cursor = 0;
+#endif
+	memset(&_usbd_stats, 0, sizeof(_usbd_stats));
+	memset(&_usbd_trace, 0, sizeof(_usbd_trace));
+}
+
+void _usbd_stats_event(uint8_t type, uint8_t addr, uint16_t len)
+{
+	struct usbd_ep_stats *ep = &_usbd_stats.ep
+		[addr & (USBD_STATS_ENDPOINTS - 1)][!!(addr & 0x80)];
+	struct usbd_trace_event *ev;
+	uint32_t primask;
+
+	/* Events come from both the interrupt and the application. */
+	primask = cm_mask_interrupts(1);
+
+	switch (type) {
+	case USBD_TRACE_RESET:
+		_usbd_stats.resets++;
+		break;
+	case USBD_TRACE_SETUP:
+		_usbd_stats.setups++;
+		break;
+	case USBD_TRACE_IN:
+	case USBD_TRACE_OUT:
+		ep->packets++;
+		ep->bytes += len;
+		break;
+	case USBD_TRACE_BUSY:
+		ep->busy++;
+		break;
+	case USBD_TRACE_NAK:
+		ep->naks++;
+		break;
+	case USBD_TRACE_STALL:
+		ep->stalls++;
+		break;
+	case USBD_TRACE_TRANSFER:
+		ep->transfers++;
+		break;
+	}
+
+	ev = &_usbd_trace.event[_usbd_trace.head % USBD_TRACE_SIZE];
+	ev->cycles = stats_cycles();
+	ev->type = type;
+	ev->addr = addr;
+	ev->len = len;
+	_usbd_trace.head++;
+
+	cm_mask_interrupts(primask);
+}
+
+uint32_t _usbd_stats_poll_begin(void)
+{
+	uint32_t now = stats_cycles();
+
+#ifdef USBD_STATS_ARMV7
+	if (_usbd_stats.polls) {
+		_usbd_stats.poll_gap[stats_bucket(now - last_poll)]++;
+	}
+	last_poll = now;
+#endif
+	_usbd_stats.polls++;
+	return now;
+}
+
+void _usbd_stats_poll_end(uint32_t start)
+{
+#ifdef USBD_STATS_ARMV7
+	uint32_t cycles = stats_cycles() - start;
+
+	_usbd_stats.poll_time[stats_bucket(cycles)]++;
+#else
+	(void)start;
+#endif
+}
+
+#endif
+
+const struct usbd_stats *usbd_get_stats(usbd_device *usbd_dev)
+{
+	(void)usbd_dev;
+
+#ifdef USBD_STATS
+	return &_usbd_stats;
+#else
+	return NULL;
+#endif
+}
+
+const struct usbd_trace *usbd_get_trace(usbd_device *usbd_dev)
+{
+	(void)usbd_dev;
+
+#ifdef USBD_STATS
+	return &_usbd_trace;
+#else
+	return NULL;
+#endif
+}
+
+void usbd_stats_reset(usbd_device *usbd_dev)
+{
+	(void)usbd_dev;
+
+#ifdef USBD_STATS
+	_usbd_stats_init();
+#endif
+}
+
+enum usbd_request_return_codes usbd_stats_control_request(
+		usbd_device *usbd_dev, struct usb_setup_data *req,
+		uint8_t **buf, uint16_t *len,
+		usbd_control_complete_callback *complete)
+{
+	(void)usbd_dev;
+	(void)complete;
+
+	if (req->bRequest != USBD_STATS_REQ_READ ||
+	    !(req->bmRequestType & USB_REQ_TYPE_IN)) {
+		return USBD_REQ_NEXT_CALLBACK;
+	}
+
+#ifdef USBD_STATS
+	switch (req->wValue) {
+	case USBD_STATS_READ_COUNTERS:
+		*buf = (uint8_t *)&_usbd_stats;
+		*len = MIN(*len, sizeof(_usbd_stats));
+		return USBD_REQ_HANDLED;
+	case USBD_STATS_READ_TRACE:
+		*buf = (uint8_t *)&_usbd_trace;
+		*len = MIN(*len, sizeof(_usbd_trace));
+		return USBD_REQ_HANDLED;
+	}
+#else
+	(void)buf;
+	(void)len;
+#endif
+
+	return USBD_REQ_NOTSUPP;
+}
+
+uint32_t usbd_trace_itm(usbd_device *usbd_dev, uint8_t port)
+{
+	uint32_t n = 0;
+#if defined(USBD_STATS) && defined(USBD_STATS_ARMV7)
+	const struct usbd_trace_event *ev;
+	uint32_t head = _usbd_trace.head;
+
+	(void)usbd_dev;
+
+	/* Nothing drains the FIFO of a disabled ITM or port. */
+	if (!(ITM_TCR & ITM_TCR_ITMENA) || port >= 32 ||
+	    !(ITM_TER[0] & (1 << port))) {
+		return 0;
+	}
+
+	if (head - itm_cursor > USBD_TRACE_SIZE) {
+		itm_cursor = head - USBD_TRACE_SIZE;
+	}
+	for (; itm_cursor != head; itm_cursor++, n++) {
+		ev = &_usbd_trace.event[itm_cursor % USBD_TRACE_SIZE];
+		while (!(ITM_STIM32(port) & ITM_STIM_FIFOREADY));
+		ITM_STIM32(port) = ev->cycles;
+		while (!(ITM_STIM32(port) & ITM_STIM_FIFOREADY));
+		ITM_STIM32(port) = ev->type | (ev->addr << 8) |
+				   ((uint32_t)ev->len << 16);
+	}
+#else
+	(void)usbd_dev;
+	(void)port;
+#endif
+	return n;
+}
@@ -0,0 +1,53 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include "usb-gadget0.h"
+#include "usbip-sim.h"
+
+#define ER_DEBUG
+#ifdef ER_DEBUG
+#define ER_DPRINTF(fmt, ...) \
+	do { printf(fmt, ## __VA_ARGS__); } while (0)
+#else
+#define ER_DPRINTF(fmt, ...) \
+	do { } while (0)
+#endif
+
+/* There is no ITM on the host, stdout is used for debug output instead. */
+#include "trace.h"
+void trace_send_blocking8(int stimulus_port, char c)
+{
+	(void)stimulus_port;
+	(void)c;
+}
+
+int main(void)
+{
+	if (usbip_sim_listen(USBIP_SIM_PORT) < 0) {
+		perror("usbip-sim");
+		return 1;
+	}
+
+	usbd_device *usbd_dev = gadget0_init(&usbip_usb_driver, "host-usbip");
+
+	ER_DPRINTF("bootup complete, waiting for usbip attach on port %d\n",
+		   USBIP_SIM_PORT);
+	while (1) {
+		gadget0_run(usbd_dev);
+	}
+}
@@ -326,7 +326,7 @@ static enum usbd_request_return_codes gadget0_control_request(usbd_device *usbd_
 		ER_DPRINTF("fake loopback of %d\n", req->wValue);
 		if (req->wValue > sizeof(usbd_control_buffer)) {
 			ER_DPRINTF("Can't write more than out control buffer! %d > %d\n",
-				req->wValue, sizeof(usbd_control_buffer));
+				req->wValue, (int)sizeof(usbd_control_buffer));
 			return USBD_REQ_NOTSUPP;
 		}
 		/* Don't produce more than asked for! */
@@ -0,0 +1,853 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Simulated usbd driver, running the usb stack as a regular Linux process.
+ *
+ * The "hardware" is one packet buffer per endpoint and direction, exactly
+ * like the real peripherals, and the bus is a USB/IP server: URBs coming
+ * from the kernel's vhci-hcd are split into packets, fed to the endpoint
+ * callbacks, and the packets queued by the stack are collected back into
+ * URB replies. Only control, bulk and interrupt transfers are supported.
+ *
+ * The protocol is documented in the Linux kernel tree, in
+ * Documentation/usb/usbip_protocol.rst.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include <libopencm3/usb/usbd.h>
+#include "usb_private.h"
+#include "usbip-sim.h"
+
+#define USBIP_VERSION		0x0111
+
+#define OP_REQ_DEVLIST		0x8005
+#define OP_REP_DEVLIST		0x0005
+#define OP_REQ_IMPORT		0x8003
+#define OP_REP_IMPORT		0x0003
+
+#define USBIP_CMD_SUBMIT	1
+#define USBIP_CMD_UNLINK	2
+#define USBIP_RET_SUBMIT	3
+#define USBIP_RET_UNLINK	4
+
+#define USBIP_DIR_OUT		0
+#define USBIP_DIR_IN		1
+
+#define USBIP_SPEED_FULL	2
+#define URB_ZERO_PACKET		0x0040
+
+#define SIM_BUSID		"1-1"
+#define SIM_MAX_URB		32
+#define SIM_MAX_PACKET		1024
+/* Requests handled per poll, so the stack still gets to run in between */
+#define SIM_MAX_REQUESTS	16
+
+struct usbip_op_header {
+	uint16_t version;
+	uint16_t code;
+	uint32_t status;
+} __attribute__((packed));
+
+struct usbip_usb_device {
+	char path[256];
+	char busid[32];
+	uint32_t busnum;
+	uint32_t devnum;
+	uint32_t speed;
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+	uint8_t bDeviceClass;
+	uint8_t bDeviceSubClass;
+	uint8_t bDeviceProtocol;
+	uint8_t bConfigurationValue;
+	uint8_t bNumConfigurations;
+	uint8_t bNumInterfaces;
+} __attribute__((packed));
+
+struct usbip_usb_interface {
+	uint8_t bInterfaceClass;
+	uint8_t bInterfaceSubClass;
+	uint8_t bInterfaceProtocol;
+	uint8_t padding;
+} __attribute__((packed));
+
+/* All fields are big endian on the wire, except for the setup packet. */
+struct usbip_header {
+	uint32_t command;
+	uint32_t seqnum;
+	uint32_t devid;
+	uint32_t direction;
+	uint32_t ep;
+	union {
+		struct {
+			uint32_t transfer_flags;
+			uint32_t transfer_buffer_length;
+			uint32_t start_frame;
+			uint32_t number_of_packets;
+			uint32_t interval;
+			uint8_t setup[8];
+		} __attribute__((packed)) submit;
+		struct {
+			uint32_t status;
+			uint32_t actual_length;
+			uint32_t start_frame;
+			uint32_t number_of_packets;
+			uint32_t error_count;
+		} __attribute__((packed)) ret_submit;
+		struct {
+			uint32_t seqnum;
+		} __attribute__((packed)) unlink;
+		struct {
+			uint32_t status;
+		} __attribute__((packed)) ret_unlink;
+		uint8_t raw[28];
+	} u;
+} __attribute__((packed));
+
+/* Endpoint packet buffer, as seen by the stack. */
+struct sim_ep {
+	uint16_t max_size;
+	bool stall;
+	bool nak;
+	bool full;
+	uint16_t len;
+	uint8_t buf[SIM_MAX_PACKET];
+};
+
+/* URB queued on a non control endpoint. */
+struct sim_urb {
+	uint32_t seqnum;
+	uint8_t ep;
+	uint8_t dir;
+	bool zlp;
+	uint32_t len;
+	uint32_t actual;
+	uint8_t *buf;
+};
+
+static usbd_device sim_dev;
+static struct sim_ep sim_ep[MAX_USBD_ENDPOINT][2];
+static struct sim_urb sim_urb[SIM_MAX_URB];
+static int sim_num_urb;
+
+static int listen_fd = -1;
+static int conn_fd = -1;
+static bool attached;
+static uint32_t last_sof;
+
+static uint32_t sim_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void sim_callback(usbd_device *usbd_dev, uint8_t ep,
+			 enum _usbd_transaction type)
+{
+	if (usbd_dev->user_callback_ctr[ep][type]) {
+		usbd_dev->user_callback_ctr[ep][type](usbd_dev, ep);
+	}
+}
+
+/* ---- USB/IP transport ---- */
+
+static void sim_drop_urbs(void)
+{
+	int i;
+
+	for (i = 0; i < sim_num_urb; i++) {
+		free(sim_urb[i].buf);
+	}
+	sim_num_urb = 0;
+}
+
+static void sim_close(void)
+{
+	if (conn_fd >= 0) {
+		close(conn_fd);
+	}
+	conn_fd = -1;
+	attached = false;
+	sim_drop_urbs();
+}
+
+static int sim_send(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(conn_fd, p, len);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			sim_close();
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int sim_recv(void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = read(conn_fd, p, len);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			sim_close();
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void sim_fill_device(usbd_device *usbd_dev, struct usbip_usb_device *d)
+{
+	memset(d, 0, sizeof(*d));
+	strncpy(d->path, "/sys/devices/usbip-sim/" SIM_BUSID,
+		sizeof(d->path) - 1);
+	strncpy(d->busid, SIM_BUSID, sizeof(d->busid) - 1);
+	d->busnum = htonl(1);
+	d->devnum = htonl(1);
+	d->speed = htonl(USBIP_SPEED_FULL);
+	d->idVendor = htons(usbd_dev->desc->idVendor);
+	d->idProduct = htons(usbd_dev->desc->idProduct);
+	d->bcdDevice = htons(usbd_dev->desc->bcdDevice);
+	d->bDeviceClass = usbd_dev->desc->bDeviceClass;
+	d->bDeviceSubClass = usbd_dev->desc->bDeviceSubClass;
+	d->bDeviceProtocol = usbd_dev->desc->bDeviceProtocol;
+	d->bConfigurationValue = usbd_dev->current_config;
+	d->bNumConfigurations = usbd_dev->desc->bNumConfigurations;
+	d->bNumInterfaces = usbd_dev->config[0].bNumInterfaces;
+}
+
+static void sim_devlist(usbd_device *usbd_dev)
+{
+	struct usbip_op_header op = {
+		.version = htons(USBIP_VERSION),
+		.code = htons(OP_REP_DEVLIST),
+	};
+	const struct usb_interface_descriptor *alt;
+	struct usbip_usb_interface iface;
+	struct usbip_usb_device d;
+	uint32_t count = htonl(1);
+	int i;
+
+	sim_fill_device(usbd_dev, &d);
+	if (sim_send(&op, sizeof(op)) || sim_send(&count, sizeof(count)) ||
+	    sim_send(&d, sizeof(d))) {
+		return;
+	}
+
+	for (i = 0; i < usbd_dev->config[0].bNumInterfaces; i++) {
+		alt = &usbd_dev->config[0].interface[i].altsetting[0];
+		iface.bInterfaceClass = alt->bInterfaceClass;
+		iface.bInterfaceSubClass = alt->bInterfaceSubClass;
+		iface.bInterfaceProtocol = alt->bInterfaceProtocol;
+		iface.padding = 0;
+		if (sim_send(&iface, sizeof(iface))) {
+			return;
+		}
+	}
+}
+
+static void sim_reset_eps(void)
+{
+	memset(sim_ep, 0, sizeof(sim_ep));
+}
+
+static void sim_import(usbd_device *usbd_dev)
+{
+	struct usbip_op_header op = {
+		.version = htons(USBIP_VERSION),
+		.code = htons(OP_REP_IMPORT),
+	};
+	struct usbip_usb_device d;
+	char busid[32];
+
+	if (sim_recv(busid, sizeof(busid))) {
+		return;
+	}
+	busid[sizeof(busid) - 1] = '\0';
+
+	if (strcmp(busid, SIM_BUSID)) {
+		op.status = htonl(1);
+		sim_send(&op, sizeof(op));
+		sim_close();
+		return;
+	}
+
+	sim_fill_device(usbd_dev, &d);
+	if (sim_send(&op, sizeof(op)) || sim_send(&d, sizeof(d))) {
+		return;
+	}
+
+	/* Attaching is the simulated equivalent of a bus reset. */
+	attached = true;
+	sim_reset_eps();
+	_usbd_reset(usbd_dev);
+}
+
+static void sim_ret_submit(uint32_t seqnum, int32_t status,
+			   const uint8_t *buf, uint32_t actual)
+{
+	struct usbip_header h;
+
+	memset(&h, 0, sizeof(h));
+	h.command = htonl(USBIP_RET_SUBMIT);
+	h.seqnum = htonl(seqnum);
+	h.u.ret_submit.status = htonl(status);
+	h.u.ret_submit.actual_length = htonl(actual);
+
+	if (sim_send(&h, sizeof(h))) {
+		return;
+	}
+	if (buf && actual) {
+		sim_send(buf, actual);
+	}
+}
+
+/* ---- bus simulation ---- */
+
+/* Run a whole control transfer, the stack always answers synchronously. */
+static int32_t sim_control(usbd_device *usbd_dev, const uint8_t *setup,
+			   uint8_t *buf, uint32_t len, uint32_t *actual)
+{
+	struct sim_ep *out = &sim_ep[0][USBIP_DIR_OUT];
+	struct sim_ep *in = &sim_ep[0][USBIP_DIR_IN];
+	uint16_t wlength = setup[6] | (setup[7] << 8);
+	bool short_packet;
+	uint32_t n;
+
+	*actual = 0;
+	if (len > wlength) {
+		len = wlength;
+	}
+
+	/* A SETUP always gets through and clears a protocol stall. */
+	out->stall = false;
+	in->stall = false;
+	in->full = false;
+	out->full = false;
+	memcpy(&usbd_dev->control_state.req, setup, 8);
+	sim_callback(usbd_dev, 0, USB_TRANSACTION_SETUP);
+
+	if (setup[0] & USB_REQ_TYPE_IN) {
+		while (!in->stall && in->full) {
+			n = MIN(in->len, len - *actual);
+			memcpy(buf + *actual, in->buf, n);
+			*actual += n;
+			short_packet = in->len < in->max_size;
+			in->full = false;
+			sim_callback(usbd_dev, 0, USB_TRANSACTION_IN);
+			if (short_packet || *actual == len) {
+				break;
+			}
+		}
+		if (in->stall) {
+			return -EPIPE;
+		}
+
+		out->len = 0;
+		out->full = true;
+		sim_callback(usbd_dev, 0, USB_TRANSACTION_OUT);
+		return 0;
+	}
+
+	while (*actual < len && !out->stall) {
+		n = MIN(out->max_size, len - *actual);
+		memcpy(out->buf, buf + *actual, n);
+		out->len = n;
+		out->full = true;
+		*actual += n;
+		sim_callback(usbd_dev, 0, USB_TRANSACTION_OUT);
+	}
+	if (out->stall || in->stall) {
+		return -EPIPE;
+	}
+
+	/* Status stage, the stack must have queued a ZLP by now. */
+	if (!in->full) {
+		return -ETIMEDOUT;
+	}
+	in->full = false;
+	sim_callback(usbd_dev, 0, USB_TRANSACTION_IN);
+	return 0;
+}
+
+/*
+ * Move packets between a pending URB and its endpoint buffer.
+ * @return 1 if the URB completed, with its status in *status, 0 otherwise.
+ */
+static int sim_urb_run(usbd_device *usbd_dev, struct sim_urb *urb,
+		       int32_t *status)
+{
+	struct sim_ep *ep = &sim_ep[urb->ep][urb->dir];
+	bool short_packet;
+	uint32_t n;
+
+	*status = 0;
+	if (ep->max_size == 0 || ep->stall) {
+		*status = -EPIPE;
+		return 1;
+	}
+
+	if (urb->dir == USBIP_DIR_IN) {
+		while (ep->full) {
+			n = MIN(ep->len, urb->len - urb->actual);
+			memcpy(urb->buf + urb->actual, ep->buf, n);
+			urb->actual += n;
+			short_packet = ep->len < ep->max_size;
+			ep->full = false;
+			sim_callback(usbd_dev, urb->ep, USB_TRANSACTION_IN);
+			if (short_packet || urb->actual == urb->len) {
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	/* A packet is acked as soon as it fits in the endpoint buffer. */
+	while (urb->actual < urb->len || urb->zlp) {
+		if (ep->full || ep->nak) {
+			return 0;
+		}
+		n = MIN(ep->max_size, urb->len - urb->actual);
+		if (n == 0) {
+			urb->zlp = false;
+		}
+		memcpy(ep->buf, urb->buf + urb->actual, n);
+		ep->len = n;
+		ep->full = true;
+		urb->actual += n;
+		sim_callback(usbd_dev, urb->ep, USB_TRANSACTION_OUT);
+		if (ep->stall) {
+			*status = -EPIPE;
+			return 1;
+		}
+	}
+	return 1;
+}
+
+static void sim_urb_remove(int i)
+{
+	free(sim_urb[i].buf);
+	sim_num_urb--;
+	memmove(&sim_urb[i], &sim_urb[i + 1],
+		(sim_num_urb - i) * sizeof(sim_urb[0]));
+}
+
+/* Let every endpoint work on its oldest URB until nothing moves anymore. */
+static void sim_progress(usbd_device *usbd_dev)
+{
+	uint32_t busy;
+	int32_t status;
+	bool again = true;
+	int i;
+
+	while (again && conn_fd >= 0) {
+		again = false;
+		busy = 0;
+		for (i = 0; i < sim_num_urb && conn_fd >= 0; i++) {
+			struct sim_urb *urb = &sim_urb[i];
+			uint32_t bit = 1 << (urb->ep * 2 + urb->dir);
+
+			if (busy & bit) {
+				continue;
+			}
+			busy |= bit;
+
+			if (!sim_urb_run(usbd_dev, urb, &status)) {
+				continue;
+			}
+			sim_ret_submit(urb->seqnum, status,
+				       urb->dir == USBIP_DIR_IN ? urb->buf : NULL,
+				       urb->actual);
+			sim_urb_remove(i);
+			again = true;
+			break;
+		}
+	}
+}
+
+static void sim_submit(usbd_device *usbd_dev, const struct usbip_header *h)
+{
+	uint32_t seqnum = ntohl(h->seqnum);
+	uint32_t dir = ntohl(h->direction);
+	uint32_t ep = ntohl(h->ep);
+	uint32_t flags = ntohl(h->u.submit.transfer_flags);
+	uint32_t len = ntohl(h->u.submit.transfer_buffer_length);
+	int32_t packets = ntohl(h->u.submit.number_of_packets);
+	struct sim_urb *urb;
+	uint32_t actual;
+	int32_t status;
+	uint8_t *buf;
+
+	buf = malloc(len ? len : 1);
+	if (!buf) {
+		sim_close();
+		return;
+	}
+	if (dir == USBIP_DIR_OUT && len && sim_recv(buf, len)) {
+		free(buf);
+		return;
+	}
+
+	/* Isochronous URBs carry packet descriptors, which we refuse. */
+	if (packets > 0) {
+		while (packets--) {
+			uint8_t desc[16];
+
+			if (sim_recv(desc, sizeof(desc))) {
+				free(buf);
+				return;
+			}
+		}
+		sim_ret_submit(seqnum, -EINVAL, NULL, 0);
+		free(buf);
+		return;
+	}
+
+	if (ep == 0) {
+		status = sim_control(usbd_dev, h->u.submit.setup, buf, len,
+				     &actual);
+		sim_ret_submit(seqnum, status,
+			       dir == USBIP_DIR_IN ? buf : NULL, actual);
+		free(buf);
+		return;
+	}
+
+	if (ep >= MAX_USBD_ENDPOINT || dir > USBIP_DIR_IN ||
+	    sim_num_urb == SIM_MAX_URB) {
+		sim_ret_submit(seqnum, ep >= MAX_USBD_ENDPOINT ? -EPIPE :
+			       -ENOMEM, NULL, 0);
+		free(buf);
+		return;
+	}
+
+	urb = &sim_urb[sim_num_urb++];
+	urb->seqnum = seqnum;
+	urb->ep = ep;
+	urb->dir = dir;
+	urb->len = len;
+	urb->actual = 0;
+	urb->buf = buf;
+	urb->zlp = dir == USBIP_DIR_OUT && (len == 0 ||
+		((flags & URB_ZERO_PACKET) && sim_ep[ep][dir].max_size &&
+		 len % sim_ep[ep][dir].max_size == 0));
+}
+
+static void sim_unlink(const struct usbip_header *h)
+{
+	uint32_t victim = ntohl(h->u.unlink.seqnum);
+	struct usbip_header r;
+	int32_t status = 0;
+	int i;
+
+	/* Already completed URBs are simply not found. */
+	for (i = 0; i < sim_num_urb; i++) {
+		if (sim_urb[i].seqnum == victim) {
+			sim_urb_remove(i);
+			status = -ECONNRESET;
+			break;
+		}
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.command = htonl(USBIP_RET_UNLINK);
+	r.seqnum = h->seqnum;
+	r.u.ret_unlink.status = htonl(status);
+	sim_send(&r, sizeof(r));
+}
+
+static void sim_request(usbd_device *usbd_dev)
+{
+	struct usbip_op_header op;
+	struct usbip_header h;
+
+	if (!attached) {
+		if (sim_recv(&op, sizeof(op))) {
+			return;
+		}
+		switch (ntohs(op.code)) {
+		case OP_REQ_DEVLIST:
+			sim_devlist(usbd_dev);
+			sim_close();
+			break;
+		case OP_REQ_IMPORT:
+			sim_import(usbd_dev);
+			break;
+		default:
+			sim_close();
+		}
+		return;
+	}
+
+	if (sim_recv(&h, sizeof(h))) {
+		return;
+	}
+	switch (ntohl(h.command)) {
+	case USBIP_CMD_SUBMIT:
+		sim_submit(usbd_dev, &h);
+		break;
+	case USBIP_CMD_UNLINK:
+		sim_unlink(&h);
+		break;
+	default:
+		sim_close();
+	}
+}
+
+static void sim_accept(void)
+{
+	int one = 1;
+
+	conn_fd = accept(listen_fd, NULL, NULL);
+	if (conn_fd >= 0) {
+		setsockopt(conn_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+}
+
+static bool sim_readable(int fd, long usec)
+{
+	struct timeval tv = { .tv_sec = 0, .tv_usec = usec };
+	fd_set fds;
+
+	FD_ZERO(&fds);
+	FD_SET(fd, &fds);
+	return select(fd + 1, &fds, NULL, NULL, &tv) > 0;
+}
+
+int usbip_sim_listen(uint16_t port)
+{
+	struct sockaddr_in addr;
+	int one = 1;
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		return -1;
+	}
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(listen_fd, 1)) {
+		close(listen_fd);
+		listen_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/* ---- usbd driver ---- */
+
+static usbd_device *sim_init(void)
+{
+	sim_reset_eps();
+	return &sim_dev;
+}
+
+static void sim_set_address(usbd_device *usbd_dev, uint8_t addr)
+{
+	/* vhci-hcd assigns addresses itself, there is nothing to filter. */
+	(void)usbd_dev;
+	(void)addr;
+}
+
+static void sim_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
+			 uint16_t max_size, usbd_endpoint_callback callback)
+{
+	uint8_t dir = addr & 0x80;
+
+	(void)type;
+	addr &= 0x7f;
+	if (max_size > SIM_MAX_PACKET) {
+		max_size = SIM_MAX_PACKET;
+	}
+
+	if (dir || (addr == 0)) {
+		memset(&sim_ep[addr][USBIP_DIR_IN], 0, sizeof(struct sim_ep));
+		sim_ep[addr][USBIP_DIR_IN].max_size = max_size;
+		if (callback) {
+			usbd_dev->user_callback_ctr[addr][USB_TRANSACTION_IN] =
+			    callback;
+		}
+	}
+
+	if (!dir) {
+		memset(&sim_ep[addr][USBIP_DIR_OUT], 0, sizeof(struct sim_ep));
+		sim_ep[addr][USBIP_DIR_OUT].max_size = max_size;
+		if (callback) {
+			usbd_dev->user_callback_ctr[addr][USB_TRANSACTION_OUT] =
+			    callback;
+		}
+	}
+}
+
+static void sim_ep_reset(usbd_device *usbd_dev)
+{
+	(void)usbd_dev;
+	memset(&sim_ep[1], 0, sizeof(sim_ep) - sizeof(sim_ep[0]));
+}
+
+static void sim_ep_stall_set(usbd_device *usbd_dev, uint8_t addr,
+			     uint8_t stall)
+{
+	(void)usbd_dev;
+	if ((addr & 0x7f) == 0) {
+		sim_ep[0][USBIP_DIR_OUT].stall = stall;
+		sim_ep[0][USBIP_DIR_IN].stall = stall;
+		return;
+	}
+	sim_ep[addr & 0x7f][!!(addr & 0x80)].stall = stall;
+}
+
+static uint8_t sim_ep_stall_get(usbd_device *usbd_dev, uint8_t addr)
+{
+	(void)usbd_dev;
+	return sim_ep[addr & 0x7f][!!(addr & 0x80)].stall;
+}
+
+static void sim_ep_nak_set(usbd_device *usbd_dev, uint8_t addr, uint8_t nak)
+{
+	/* It does not make sense to force NAK on IN endpoints. */
+	(void)usbd_dev;
+	if (addr & 0x80) {
+		return;
+	}
+	sim_ep[addr & 0x7f][USBIP_DIR_OUT].nak = nak;
+}
+
+static uint16_t sim_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
+				    const void *buf, uint16_t len)
+{
+	struct sim_ep *ep = &sim_ep[addr & 0x7f][USBIP_DIR_IN];
+
+	(void)usbd_dev;
+	if (ep->full) {
+		return 0;
+	}
+	len = MIN(len, SIM_MAX_PACKET);
+	memcpy(ep->buf, buf, len);
+	ep->len = len;
+	ep->full = true;
+	return len;
+}
+
+static uint16_t sim_ep_read_packet(usbd_device *usbd_dev, uint8_t addr,
+				   void *buf, uint16_t len)
+{
+	struct sim_ep *ep = &sim_ep[addr & 0x7f][USBIP_DIR_OUT];
+
+	(void)usbd_dev;
+	if (!ep->full) {
+		return 0;
+	}
+	len = MIN(len, ep->len);
+	memcpy(buf, ep->buf, len);
+	ep->full = false;
+	return len;
+}
+
+static void sim_poll(usbd_device *usbd_dev)
+{
+	int requests = 0;
+	uint32_t now;
+
+	if (attached) {
+		now = sim_ms();
+		if (now != last_sof && usbd_dev->user_callback_sof) {
+			usbd_dev->user_callback_sof();
+		}
+		last_sof = now;
+	}
+
+	if (conn_fd < 0) {
+		if (listen_fd >= 0 && sim_readable(listen_fd, 1000)) {
+			sim_accept();
+		}
+		return;
+	}
+
+	/* Wait at most a frame for the host, then drain what it sent. */
+	while (conn_fd >= 0 && requests < SIM_MAX_REQUESTS &&
+	       sim_readable(conn_fd, requests ? 0 : 1000)) {
+		sim_request(usbd_dev);
+		requests++;
+	}
+	sim_progress(usbd_dev);
+}
+
+static void sim_disconnect(usbd_device *usbd_dev, bool disconnected)
+{
+	(void)usbd_dev;
+	if (disconnected) {
+		sim_close();
+	}
+}
+
+static uint16_t sim_get_frame_number(usbd_device *usbd_dev)
+{
+	(void)usbd_dev;
+	return sim_ms() & 0x7ff;
+}
+
+const struct _usbd_driver usbip_usb_driver = {
+	.init = sim_init,
+	.set_address = sim_set_address,
+	.ep_setup = sim_ep_setup,
+	.ep_reset = sim_ep_reset,
+	.ep_stall_set = sim_ep_stall_set,
+	.ep_stall_get = sim_ep_stall_get,
+	.ep_nak_set = sim_ep_nak_set,
+	.ep_write_packet = sim_ep_write_packet,
+	.ep_read_packet = sim_ep_read_packet,
+	.poll = sim_poll,
+	.disconnect = sim_disconnect,
+	.get_frame_number = sim_get_frame_number,
+};
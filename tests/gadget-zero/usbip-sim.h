@@ -0,0 +1,40 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef USBIP_SIM_H
+#define USBIP_SIM_H
+
+#include <stdint.h>
+#include <libopencm3/usb/usbd.h>
+
+#define USBIP_SIM_PORT		3240
+
+/**
+ * A usbd driver for the host, with the bus simulated by a USB/IP server.
+ * Once the device is attached with "usbip attach -r localhost -b 1-1" it
+ * shows up as a regular USB device through the vhci-hcd kernel driver.
+ */
+extern const usbd_driver usbip_usb_driver;
+
+/**
+ * Start listening for USB/IP clients, before calling usbd_init().
+ * @param port TCP port to listen on, normally USBIP_SIM_PORT.
+ * @return 0 on success, -1 with errno set otherwise.
+ */
+int usbip_sim_listen(uint16_t port);
+
+#endif